@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Compares the execution engines on the benchmark programs.
+# Usage: engines.sh N [PROGRAM...]
+# Prints the real/user/sys times for each program under the switch-based interpreter,
+# the threaded interpreter and the native code engine, and checks that the outputs agree.
+
+N=$1
+shift
+PROGRAMS="$*"
+ENGINES="interpreter threaded native"
+
+if [ -z "$N" ]; then
+  echo No N specified
+  exit 1
+fi
+
+if [ -z "$PROGRAMS" ]; then
+  PROGRAMS="bintree matmult nsieve quicksort mergesort nfib mandelbrot"
+fi
+
+TEMPDIR=`mktemp -d /tmp/engines.XXXXXX`
+TIMEFORMAT="%R %U %S"
+
+# The native engine is only built into 32-bit x86 binaries; elsewhere -e native is rejected
+echo 'main = nil' > $TEMPDIR/probe.elc
+if ! nreduce -e native $TEMPDIR/probe.elc >/dev/null 2>&1; then
+  echo "Skipping native engine: not supported by this build"
+  ENGINES="interpreter threaded"
+fi
+
+printf "%-12s %-12s %s\n" PROGRAM ENGINE "REAL USER SYS"
+
+for PROGRAM in $PROGRAMS; do
+  if [ ${PROGRAM} = "nsieve" ]; then
+    ARGS="-v lazy"
+  else
+    ARGS=""
+  fi
+  for ENGINE in $ENGINES; do
+    TIME=`(time nreduce -e $ENGINE $ARGS ${PROGRAM}.elc $N \
+           >$TEMPDIR/${PROGRAM}_${ENGINE} 2>/dev/null) 2>&1`
+    printf "%-12s %-12s %s\n" $PROGRAM $ENGINE "$TIME"
+    if ! diff -q $TEMPDIR/${PROGRAM}_${ENGINE} $TEMPDIR/${PROGRAM}_interpreter >/dev/null; then
+      echo "  Different output: $PROGRAM $ENGINE"
+    fi
+  done
+done
+
+rm -rf "$TEMPDIR"
@@ -0,0 +1,386 @@
+/*
+ * This file is part of the NReduce project
+ * Copyright (C) 2006-2010 Peter Kelly <kellypmk@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * $Id$
+ *
+ */
+
+#define _GNU_SOURCE /* for dladdr() */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "source.h"
+#include "bytecode.h"
+#include "src/nreduce.h"
+#include "runtime/runtime.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_LIBDL
+#include <dlfcn.h>
+#endif
+
+/* Cache of compiled bytecode, so that running the same program again skips parsing and all of
+   the compilation stages. Caching is off unless the BYTECODE_CACHE environment variable names
+   a directory to keep entries in (for example $HOME/.nreduce/bytecode; it is created if
+   necessary). Entries are stored in files named after a hash of the program's source code, its
+   filename, the compilation flags and the build of the compiler.
+
+   The main source file is covered by the key, but the modules it imports from the current
+   directory are only known after parsing. Each entry therefore also lists the files it was
+   built from along with a hash of their contents, and is only used if these still match.
+   The modules built in to nreduce are covered by the build id, since they are linked into the
+   same object as the compiler. */
+
+#define BCCACHE_SIGNATURE "NREDUCE BCCACHE1"
+
+typedef struct bccache_header {
+  char signature[16];
+  uint64_t key;
+  int ndeps;
+  int bcsize;
+} bccache_header;
+
+/* Followed by ndeps entries of the form (uint64_t hash, int namelen, char name[namelen]), and
+   then the bytecode itself */
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t fnv_add(uint64_t h, const void *data, int size)
+{
+  const unsigned char *p = (const unsigned char*)data;
+  int i;
+  for (i = 0; i < size; i++) {
+    h ^= p[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+/* Identifies the build of nreduce doing the compilation; bytecode produced by a different build
+   may differ even if the source is the same. The compiler and the built-in modules may live in
+   a shared copy of libnreduce rather than in the executable, so we look at whichever object
+   this function was loaded from, and only fall back to the executable if that is unknown. */
+static uint64_t build_id(void)
+{
+  struct stat statbuf;
+  const char *objname = "/proc/self/exe";
+  uint64_t h = FNV_OFFSET;
+#ifdef HAVE_LIBDL
+  Dl_info info;
+  if (dladdr((void*)build_id,&info) && (NULL != info.dli_fname) && ('\0' != *info.dli_fname))
+    objname = info.dli_fname;
+#endif
+  h = fnv_add(h,BCCACHE_SIGNATURE,16);
+  if (0 == stat(objname,&statbuf)) {
+    h = fnv_add(h,&statbuf.st_dev,sizeof(statbuf.st_dev));
+    h = fnv_add(h,&statbuf.st_ino,sizeof(statbuf.st_ino));
+    h = fnv_add(h,&statbuf.st_size,sizeof(statbuf.st_size));
+    h = fnv_add(h,&statbuf.st_mtime,sizeof(statbuf.st_mtime));
+  }
+  else {
+    h = fnv_add(h,__DATE__" "__TIME__,strlen(__DATE__" "__TIME__));
+  }
+  return h;
+}
+
+/* Returns the contents of a file, or NULL if it cannot be read. Unlike read_file(), a missing
+   file is not reported as an error, since this just means the cache entry is out of date. */
+static array *read_source(const char *filename)
+{
+  array *buf;
+  int fd;
+  int r;
+
+  if (0 > (fd = open(filename,O_RDONLY)))
+    return NULL;
+
+  buf = array_new(1,0);
+  while (1) {
+    array_mkroom(buf,16384);
+    r = read(fd,&buf->data[buf->nbytes],16384);
+    if ((0 > r) && (EINTR == errno))
+      continue;
+    if (0 > r) {
+      array_free(buf);
+      close(fd);
+      return NULL;
+    }
+    if (0 == r)
+      break;
+    buf->nbytes += r;
+  }
+
+  close(fd);
+  return buf;
+}
+
+static int hash_file(const char *filename, uint64_t *h)
+{
+  array *buf;
+  if (NULL == (buf = read_source(filename)))
+    return -1;
+  *h = fnv_add(FNV_OFFSET,buf->data,buf->nbytes);
+  array_free(buf);
+  return 0;
+}
+
+/* Returns the cache directory (creating it if necessary), or NULL if caching is disabled */
+static char *cache_dir(void)
+{
+  char *env = getenv("BYTECODE_CACHE");
+  char *dir;
+  char *slash;
+
+  if ((NULL == env) || ('\0' == *env) || !strcmp(env,"none"))
+    return NULL;
+  dir = strdup(env);
+
+  /* Create each directory in the path that does not already exist */
+  for (slash = strchr(dir+1,'/'); ; slash = strchr(slash+1,'/')) {
+    if (slash)
+      *slash = '\0';
+    if ((0 > mkdir(dir,0755)) && (EEXIST != errno)) {
+      free(dir);
+      return NULL;
+    }
+    if (!slash)
+      break;
+    *slash = '/';
+  }
+
+  return dir;
+}
+
+static char *entry_filename(const char *dir, uint64_t key)
+{
+  char *filename = (char*)malloc(strlen(dir)+1+16+strlen(".bc")+1);
+  sprintf(filename,"%s/%016llx.bc",dir,(unsigned long long)key);
+  return filename;
+}
+
+/* Maps the cache entry into memory and, if it is valid for the given key and all of the files it
+   depends on are unchanged, returns a copy of the bytecode */
+static int bccache_load(const char *filename, uint64_t key, char **bcdata, int *bcsize)
+{
+  struct stat statbuf;
+  const char *map;
+  bccache_header hdr;
+  int pos;
+  int i;
+  int fd;
+  int r = -1;
+
+  if (0 > (fd = open(filename,O_RDONLY)))
+    return -1;
+
+  if ((0 > fstat(fd,&statbuf)) || (sizeof(bccache_header) > statbuf.st_size)) {
+    close(fd);
+    return -1;
+  }
+
+  map = (const char*)mmap(NULL,statbuf.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (MAP_FAILED == map)
+    return -1;
+
+  memcpy(&hdr,map,sizeof(bccache_header));
+  if (memcmp(hdr.signature,BCCACHE_SIGNATURE,16) || (hdr.key != key) ||
+      (0 > hdr.ndeps) || (0 > hdr.bcsize))
+    goto done;
+
+  pos = sizeof(bccache_header);
+  for (i = 0; i < hdr.ndeps; i++) {
+    uint64_t wanted;
+    uint64_t actual;
+    int namelen;
+    char *depname;
+    int ok;
+
+    if (pos+sizeof(uint64_t)+sizeof(int) > statbuf.st_size)
+      goto done;
+    memcpy(&wanted,&map[pos],sizeof(uint64_t));
+    pos += sizeof(uint64_t);
+    memcpy(&namelen,&map[pos],sizeof(int));
+    pos += sizeof(int);
+    if ((0 > namelen) || (pos+namelen > statbuf.st_size))
+      goto done;
+
+    depname = (char*)malloc(namelen+1);
+    memcpy(depname,&map[pos],namelen);
+    depname[namelen] = '\0';
+    pos += namelen;
+
+    ok = ((0 == hash_file(depname,&actual)) && (actual == wanted));
+    free(depname);
+    if (!ok)
+      goto done;
+  }
+
+  if (pos+hdr.bcsize != statbuf.st_size)
+    goto done;
+
+  *bcsize = hdr.bcsize;
+  *bcdata = (char*)malloc(hdr.bcsize);
+  memcpy(*bcdata,&map[pos],hdr.bcsize);
+  r = 0;
+
+done:
+  munmap((void*)map,statbuf.st_size);
+  return r;
+}
+
+/* Writes a new cache entry. This is done via a temporary file which is then renamed, so other
+   processes using the same cache never see a partially-written entry. Failures are ignored;
+   the program will just be compiled again next time. */
+static void bccache_store(const char *filename, uint64_t key, source *src, int skipfileno,
+                          const char *bcdata, int bcsize)
+{
+  array *buf = array_new(1,0);
+  bccache_header hdr;
+  char *tmpname;
+  int count = array_count(src->parsedfiles);
+  int fd;
+  int i;
+
+  memset(&hdr,0,sizeof(hdr));
+  memcpy(hdr.signature,BCCACHE_SIGNATURE,16);
+  hdr.key = key;
+  hdr.bcsize = bcsize;
+  array_append(buf,&hdr,sizeof(hdr));
+
+  for (i = 0; i < count; i++) {
+    char *depname = array_item(src->parsedfiles,i,char*);
+    int namelen = strlen(depname);
+    uint64_t h;
+
+    if ((i == skipfileno) ||
+        !strncmp(depname,MODULE_FILENAME_PREFIX,strlen(MODULE_FILENAME_PREFIX)))
+      continue;
+
+    if (0 != hash_file(depname,&h)) {
+      array_free(buf);
+      return;
+    }
+
+    array_append(buf,&h,sizeof(uint64_t));
+    array_append(buf,&namelen,sizeof(int));
+    array_append(buf,depname,namelen);
+    ((bccache_header*)buf->data)->ndeps++;
+  }
+
+  array_append(buf,bcdata,bcsize);
+
+  tmpname = (char*)malloc(strlen(filename)+strlen(".XXXXXX")+1);
+  sprintf(tmpname,"%s.XXXXXX",filename);
+  if (0 <= (fd = mkstemp(tmpname))) {
+    int done = 0;
+    while (done < buf->nbytes) {
+      int w = write(fd,&buf->data[done],buf->nbytes-done);
+      if ((0 > w) && (EINTR == errno))
+        continue;
+      if (0 >= w)
+        break;
+      done += w;
+    }
+    fchmod(fd,0644);
+    close(fd);
+
+    if ((done < buf->nbytes) || (0 > rename(tmpname,filename)))
+      unlink(tmpname);
+  }
+
+  free(tmpname);
+  array_free(buf);
+}
+
+static int compile_cached(const char *filename, const char *code, int nosink,
+                          char **bcdata, int *bcsize)
+{
+  array *contents = NULL;
+  char *dir = NULL;
+  char *entry = NULL;
+  uint64_t key = 0;
+  source *src;
+  int r = 0;
+
+  if (NULL != (dir = cache_dir())) {
+    if ((NULL != code) || (NULL != (contents = read_source(filename)))) {
+      key = build_id();
+      key = fnv_add(key,filename,strlen(filename)+1);
+      key = fnv_add(key,&nosink,sizeof(int));
+      key = fnv_add(key,&strict_evaluation,sizeof(int));
+      if (NULL != code)
+        key = fnv_add(key,code,strlen(code));
+      else
+        key = fnv_add(key,contents->data,contents->nbytes);
+      entry = entry_filename(dir,key);
+
+      if (0 == bccache_load(entry,key,bcdata,bcsize)) {
+        if (contents)
+          array_free(contents);
+        free(entry);
+        free(dir);
+        return 0;
+      }
+    }
+  }
+
+  src = source_new();
+  if (NULL != code)
+    r = source_parse_string(src,code,filename,"");
+  else
+    r = source_parse_file(src,filename,"");
+
+  if ((0 == r) &&
+      (0 == (r = source_process(src,0,nosink,0,0))) &&
+      (0 == (r = source_compile(src,bcdata,bcsize))) &&
+      (NULL != entry)) {
+    /* The main file is already covered by the key */
+    bccache_store(entry,key,src,0,*bcdata,*bcsize);
+  }
+
+  source_free(src);
+  if (contents)
+    array_free(contents);
+  free(entry);
+  free(dir);
+  return r;
+}
+
+int source_compile_file_cached(const char *filename, int nosink, char **bcdata, int *bcsize)
+{
+  return compile_cached(filename,NULL,nosink,bcdata,bcsize);
+}
+
+int source_compile_string_cached(const char *code, const char *filename,
+                                 char **bcdata, int *bcsize)
+{
+  return compile_cached(filename,code,0,bcdata,bcsize);
+}
@@ -146,6 +146,7 @@ const char *opcodes[OP_COUNT] = {
 "CONSN",
 "ITEMN",
 "JEQ",
+"ARITH",
 "INVALID",
 };
 
@@ -421,6 +422,10 @@ static void add_instruction(compilation *comp, sourceloc sl, int opcode, int arg
     /* Should only be added during peephole optimisation */
     abort();
     break;
+  case OP_ARITH:
+    /* Should only be added during peephole optimisation */
+    abort();
+    break;
   case OP_CONSN:
     popstatus(comp->si,arg0-1);
     setstatusat(comp->si,comp->si->count-1,STATUS_EVALUATED);
@@ -1245,6 +1250,20 @@ static void peephole(compilation *comp, int start)
         source += 2;
         changed = 1;
       }
+      /* Arithmetic on numbers is done directly by the interpreter, rather than through the
+         builtin table; other argument types fall back to the builtin */
+      else if ((OP_BIF == instrs[source].opcode) &&
+               ((B_ADD == instrs[source].arg0) ||
+                (B_SUBTRACT == instrs[source].arg0) ||
+                (B_MULTIPLY == instrs[source].arg0) ||
+                (B_DIVIDE == instrs[source].arg0) ||
+                (B_MOD == instrs[source].arg0))) {
+        instrs[dest] = instrs[source];
+        instrs[dest].opcode = OP_ARITH;
+        map[source] = dest;
+        dest++;
+        source++;
+      }
       /* JEQ optimisation */
       else if ((source+3 < count) &&
                (OP_PUSH == instrs[source].opcode) &&
@@ -1723,7 +1742,7 @@ void bc_print(const char *bcdata, FILE *f, source *src, int builtins, int *usage
              (OP_JFUN == instr->opcode)) {
       fprintf(f," %-18s %-6d",bc_function_name(bcdata,instr->arg0),instr->arg1);
     }
-    else if (OP_BIF == instr->opcode) {
+    else if ((OP_BIF == instr->opcode) || (OP_ARITH == instr->opcode)) {
       fprintf(f," %-25s",builtin_info[instr->arg0].name);
     }
     else if (OP_JCMP == instr->opcode) {
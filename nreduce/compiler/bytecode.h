@@ -53,8 +53,9 @@
 #define OP_CONSN         24
 #define OP_ITEMN         25
 #define OP_JEQ           26
-#define OP_INVALID       27
-#define OP_COUNT         28
+#define OP_ARITH         27
+#define OP_INVALID       28
+#define OP_COUNT         29
 
 #define CONSTANT_APP_MSG "constant cannot be applied to arguments"
 #define EVALDO_SEQUENCE_SIZE 2
@@ -357,6 +357,10 @@ int source_process(source *src, int stopafterlambda, int nosink, int disstrict,
   if (0 != handle_unbound(src,unbound))
     return -1;
 
+  compile_stage(src,"Unused function removal"); /* super.c */
+  remove_unused_scombs(src);
+  sccount = array_count(src->scombs);
+
   compile_stage(src,"Lambda lifting"); /* lifting.c */
   for (scno = 0; scno < sccount; scno++)
     lift(src,array_item(src->scombs,scno,scomb*));
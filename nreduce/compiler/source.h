@@ -127,6 +127,12 @@ int source_process(source *src, int stopafterlambda, int nosink, int disstrict,
 int source_compile(source *src, char **bcdata, int *bcsize);
 void source_free(source *src);
 
+/* bccache */
+
+int source_compile_file_cached(const char *filename, int nosink, char **bcdata, int *bcsize);
+int source_compile_string_cached(const char *code, const char *filename,
+                                 char **bcdata, int *bcsize);
+
 const char *lookup_parsedfile(source *src, int fileno);
 int add_parsedfile(source *src, const char *filename);
 void print_sourceloc(source *src, FILE *f, sourceloc sl);
@@ -156,6 +162,7 @@ int get_scomb_var(scomb *sc, const char *name);
 scomb *add_scomb(source *src, const char *name1);
 void scomb_free(scomb *sc);
 void schash_rebuild(source *src);
+void remove_unused_scombs(source *src);
 int schash_check(source *src);
 
 /* lifting */
@@ -135,6 +135,97 @@ void schash_rebuild(source *src)
   }
 }
 
+static void push_scref_targets(snode *s, array *pending)
+{
+  switch (s->type) {
+  case SNODE_APPLICATION:
+    push_scref_targets(s->left,pending);
+    push_scref_targets(s->right,pending);
+    break;
+  case SNODE_LAMBDA:
+    push_scref_targets(s->body,pending);
+    break;
+  case SNODE_LETREC: {
+    letrec *rec;
+    for (rec = s->bindings; rec; rec = rec->next)
+      push_scref_targets(rec->value,pending);
+    push_scref_targets(s->body,pending);
+    break;
+  }
+  case SNODE_SCREF:
+    if (!s->sc->used) {
+      s->sc->used = 1;
+      array_append(pending,&s->sc,sizeof(scomb*));
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static int is_from_module(source *src, scomb *sc)
+{
+  return ((0 <= sc->sl.fileno) &&
+          !strncmp(array_item(src->parsedfiles,sc->sl.fileno,char*),
+                   MODULE_FILENAME_PREFIX,strlen(MODULE_FILENAME_PREFIX)));
+}
+
+/* Removes library supercombinators that cannot be reached from the program. Every program
+   imports the whole prelude (and often other modules), but typically only uses a small part of
+   it; dropping the rest straight after symbol resolution means the remaining compilation stages,
+   and the generated bytecode, only cover the functions actually needed. Only functions from the
+   built-in modules are candidates for removal; everything defined in the program's own files is
+   kept, so that it still shows up in the output of the compiler's debugging options. Besides
+   those, this keeps item, which the interpreter calls directly, and append, to which append
+   optimisation may introduce new calls. */
+void remove_unused_scombs(source *src)
+{
+  const char *roots[4] = { "__start", "main", "item", "append" };
+  array *pending = array_new(sizeof(scomb*),0);
+  array *newscombs = array_new(sizeof(scomb*),0);
+  int sccount = array_count(src->scombs);
+  int scno;
+  int i;
+
+  for (scno = 0; scno < sccount; scno++) {
+    scomb *sc = array_item(src->scombs,scno,scomb*);
+    sc->used = !is_from_module(src,sc);
+    if (sc->used)
+      array_append(pending,&sc,sizeof(scomb*));
+  }
+
+  for (i = 0; i < 4; i++) {
+    scomb *sc = get_scomb(src,roots[i]);
+    if (sc && !sc->used) {
+      sc->used = 1;
+      array_append(pending,&sc,sizeof(scomb*));
+    }
+  }
+
+  while (0 < array_count(pending)) {
+    scomb *sc = array_item(pending,array_count(pending)-1,scomb*);
+    pending->nbytes -= sizeof(scomb*);
+    push_scref_targets(sc->body,pending);
+  }
+
+  for (scno = 0; scno < sccount; scno++) {
+    scomb *sc = array_item(src->scombs,scno,scomb*);
+    if (sc->used) {
+      sc->index = array_count(newscombs);
+      array_append(newscombs,&sc,sizeof(scomb*));
+    }
+    else {
+      scomb_free(sc);
+    }
+  }
+
+  array_free(src->scombs);
+  src->scombs = newscombs;
+  array_free(pending);
+
+  schash_rebuild(src);
+}
+
 int schash_check(source *src)
 {
   int sccount = array_count(src->scombs);
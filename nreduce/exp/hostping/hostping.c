@@ -0,0 +1,144 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "network/util.h"
+#include "network/node.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/time.h>
+
+/* Measures the round trip latency of messages between two nodes, which are normally run on the
+   same host to compare the shared memory transport with TCP (by setting SHM_TRANSPORT=0). Start
+   the pong node first, then the ping node:
+
+   hostping pong <port>
+   hostping ping <host> <port> <msgcount> <size> */
+
+#define MSG_PING 0
+#define MSG_PONG 1
+
+#define PONG_ID 1000
+#define WARMUP_COUNT 100
+
+typedef struct {
+  int count;
+  int size;
+  endpointid pongid;
+} ping_arg;
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static void roundtrip(endpoint *endpt, endpointid pongid, char *data, int size)
+{
+  message *msg;
+  endpoint_send(endpt,pongid,MSG_PING,data,size);
+  msg = endpoint_receive(endpt,-1);
+  if (MSG_PONG != msg->tag)
+    fatal("ping: unexpected message %d",msg->tag);
+  message_free(msg);
+}
+
+static void ping_thread(node *n, endpoint *endpt, void *arg)
+{
+  ping_arg *pa = (ping_arg*)arg;
+  char *data = (char*)calloc(1,pa->size);
+  double start;
+  double taken;
+  int i;
+
+  /* The first messages also establish the connection and (if used) the shared memory rings */
+  for (i = 0; i < WARMUP_COUNT; i++)
+    roundtrip(endpt,pa->pongid,data,pa->size);
+
+  start = now();
+  for (i = 0; i < pa->count; i++)
+    roundtrip(endpt,pa->pongid,data,pa->size);
+  taken = now()-start;
+
+  printf("%d round trips of %d bytes: %.3fs, avg %.1fus\n",
+         pa->count,pa->size,taken,1000000.0*taken/pa->count);
+
+  free(data);
+}
+
+static void pong_thread(node *n, endpoint *endpt, void *arg)
+{
+  int done = 0;
+
+  while (!done) {
+    message *msg = endpoint_receive(endpt,-1);
+    switch (msg->tag) {
+    case MSG_PING:
+      endpoint_send(endpt,msg->source,MSG_PONG,msg->data,msg->size);
+      break;
+    case MSG_KILL:
+      done = 1;
+      break;
+    default:
+      fatal("pong: unexpected message %d",msg->tag);
+      break;
+    }
+    message_free(msg);
+  }
+}
+
+static void usage(void)
+{
+  fprintf(stderr,"Usage: hostping pong <port>\n");
+  fprintf(stderr,"       hostping ping <host> <port> <msgcount> <size>\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  node *n;
+
+  setbuf(stdout,NULL);
+
+  if ((3 == argc) && !strcmp(argv[1],"pong")) {
+    pthread_t thread;
+    if (NULL == (n = node_start(LOG_ERROR,atoi(argv[2]))))
+      exit(1);
+    node_add_thread2(n,"pong",pong_thread,NULL,&thread,PONG_ID,0);
+    if (0 != pthread_join(thread,NULL))
+      fatal("pthread_join: %s",strerror(errno));
+  }
+  else if ((6 == argc) && !strcmp(argv[1],"ping")) {
+    ping_arg pa;
+    pthread_t thread;
+    struct hostent *he;
+
+    if (NULL == (he = gethostbyname(argv[2]))) {
+      fprintf(stderr,"%s: host not found\n",argv[2]);
+      exit(1);
+    }
+
+    pa.pongid.ip = (*((struct in_addr*)he->h_addr)).s_addr;
+    pa.pongid.port = atoi(argv[3]);
+    pa.pongid.localid = PONG_ID;
+    pa.count = atoi(argv[4]);
+    pa.size = atoi(argv[5]);
+
+    if (NULL == (n = node_start(LOG_ERROR,0)))
+      exit(1);
+    node_add_thread(n,"ping",ping_thread,&pa,&thread);
+    if (0 != pthread_join(thread,NULL))
+      fatal("pthread_join: %s",strerror(errno));
+  }
+  else {
+    usage();
+  }
+
+  node_shutdown(n);
+  node_run(n);
+
+  return 0;
+}
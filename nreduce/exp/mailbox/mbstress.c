@@ -0,0 +1,163 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "network/util.h"
+#include "network/node.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+
+/* Stress test for endpoint mailboxes. Several producer threads send numbered messages to a
+   single consumer in the same process, which goes through the lock-free mailbox without taking
+   the node lock. The consumer checks that every message arrives exactly once and that each
+   producer's messages arrive in the order they were sent. It alternates between blocking,
+   non-blocking and short timed receives, and the producers occasionally pause, so that the
+   consumer often parks and has to be woken while other producers are mid-push. */
+
+#define MSG_ITEM 0
+#define MSG_DONE 1
+
+typedef struct {
+  int producer;
+  int seq;
+} item;
+
+typedef struct {
+  int nproducers;
+  int count;
+  int errors;
+} consumer_arg;
+
+typedef struct {
+  int index;
+  int count;
+  endpointid consumerid;
+} producer_arg;
+
+static void producer_thread(node *n, endpoint *endpt, void *arg)
+{
+  producer_arg *pa = (producer_arg*)arg;
+  item it;
+  int i;
+
+  it.producer = pa->index;
+  for (i = 0; i < pa->count; i++) {
+    it.seq = i;
+    endpoint_send(endpt,pa->consumerid,MSG_ITEM,&it,sizeof(item));
+    if (0 == random()%1000)
+      usleep(random()%200);
+    else if (0 == random()%50)
+      sched_yield();
+  }
+  endpoint_send(endpt,pa->consumerid,MSG_DONE,&it,sizeof(item));
+}
+
+static void consumer_thread(node *n, endpoint *endpt, void *arg)
+{
+  consumer_arg *ca = (consumer_arg*)arg;
+  int *next = (int*)calloc(ca->nproducers,sizeof(int));
+  int remaining = ca->nproducers;
+  int received = 0;
+  int iter = 0;
+  int i;
+
+  while (0 < remaining) {
+    int mode = (iter++)%3;
+    message *msg = endpoint_receive(endpt,(0 == mode) ? -1 : (1 == mode) ? 0 : 1);
+    item it;
+
+    if (NULL == msg)
+      continue;
+
+    if (sizeof(item) != msg->size)
+      fatal("consumer: bad message size %d",msg->size);
+    memcpy(&it,msg->data,sizeof(item));
+    if ((0 > it.producer) || (ca->nproducers <= it.producer))
+      fatal("consumer: bad producer %d",it.producer);
+
+    switch (msg->tag) {
+    case MSG_ITEM:
+      if (next[it.producer] != it.seq) {
+        fprintf(stderr,"producer %d: expected message %d, got %d\n",
+                it.producer,next[it.producer],it.seq);
+        ca->errors++;
+      }
+      next[it.producer] = it.seq+1;
+      received++;
+      break;
+    case MSG_DONE:
+      remaining--;
+      break;
+    default:
+      fatal("consumer: unexpected message %d",msg->tag);
+      break;
+    }
+    message_free(msg);
+  }
+
+  for (i = 0; i < ca->nproducers; i++) {
+    if (ca->count != next[i]) {
+      fprintf(stderr,"producer %d: received %d of %d messages\n",i,next[i],ca->count);
+      ca->errors++;
+    }
+  }
+  printf("%d producers, %d messages received, %d errors\n",ca->nproducers,received,ca->errors);
+  free(next);
+}
+
+int main(int argc, char **argv)
+{
+  node *n;
+  consumer_arg ca;
+  producer_arg *pa;
+  pthread_t consumer;
+  pthread_t *producers;
+  endpointid consumerid;
+  int i;
+
+  setbuf(stdout,NULL);
+
+  if (3 > argc) {
+    fprintf(stderr,"Usage: mbstress <producers> <msgcount>\n");
+    return -1;
+  }
+
+  ca.nproducers = atoi(argv[1]);
+  ca.count = atoi(argv[2]);
+  ca.errors = 0;
+  if ((0 >= ca.nproducers) || (0 > ca.count)) {
+    fprintf(stderr,"Invalid producer or message count\n");
+    return -1;
+  }
+
+  n = node_start(LOG_ERROR,0);
+  if (NULL == n)
+    exit(1);
+
+  consumerid = node_add_thread(n,"consumer",consumer_thread,&ca,&consumer);
+  pa = (producer_arg*)calloc(ca.nproducers,sizeof(producer_arg));
+  producers = (pthread_t*)calloc(ca.nproducers,sizeof(pthread_t));
+  for (i = 0; i < ca.nproducers; i++) {
+    pa[i].index = i;
+    pa[i].count = ca.count;
+    pa[i].consumerid = consumerid;
+    node_add_thread(n,"producer",producer_thread,&pa[i],&producers[i]);
+  }
+
+  for (i = 0; i < ca.nproducers; i++)
+    if (0 != pthread_join(producers[i],NULL))
+      fatal("pthread_join: %s",strerror(errno));
+  if (0 != pthread_join(consumer,NULL))
+    fatal("pthread_join: %s",strerror(errno));
+
+  node_shutdown(n);
+  node_run(n);
+
+  free(pa);
+  free(producers);
+  return (0 == ca.errors) ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# Measures how long it takes to start nreduce and run a trivial program, with and without the
+# bytecode cache. Usage: run.sh [runs] [program.elc]
+
+RUNS=${1:-20}
+PROGRAM=${2:-`dirname $0`/hello.elc}
+CACHEDIR=`mktemp -d`
+
+measure()
+{
+  local start=`date +%s%N`
+  for ((i = 0; i < $RUNS; i++)); do
+    nreduce $PROGRAM > /dev/null || exit 1
+  done
+  local end=`date +%s%N`
+  echo "$1: $(( (end-start)/1000000/RUNS ))ms per run"
+}
+
+BYTECODE_CACHE=none measure "No cache"
+
+export BYTECODE_CACHE=$CACHEDIR
+nreduce $PROGRAM > /dev/null || exit 1
+measure "Cached"
+
+rm -rf $CACHEDIR
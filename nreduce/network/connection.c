@@ -114,8 +114,12 @@ static void remove_connection(node *n, connection *conn)
   if (!conn->isreg)
     node_log(n,LOG_INFO,"Removing connection %s",conn->hostname);
   add_connection_stats(n,conn);
+  unwatch_connection(conn);
   if (0 <= conn->sock)
-    list_push(&n->p->toclose,(void*)conn->sock);
+    node_close_later(n,conn->ioth,conn->sock);
+#ifdef USE_SHMRING
+  shmring_close(n,conn);
+#endif
   connhash_remove(n,conn);
   if (CS_WAITING == conn->state) {
     llist_remove(&conn->si->waiting_connections,conn);
@@ -288,6 +292,7 @@ static void connection_state(connection *conn, int newstate)
     create_connection_buffers(conn);
 
   conn->state = newstate;
+  watch_connection(conn);
   connection_fsm(conn,CE_AUTO);
 }
 
@@ -44,6 +44,64 @@ typedef struct console {
   socketid sockid;
 } console;
 
+/* How long to wait for tasks to report their statistics */
+#define GLOBSTATS_TIMEOUT 5000
+
+static void print_globtable(array *out, const char *taskname, const char *name,
+                            globtable_stats *gs)
+{
+  array_printf(out,"%-22s %-10s %-10d %-10d %-5d %-8.2f %-8d %-7d\n",
+               taskname,name,gs->count,gs->size,
+               gs->size ? (int)(100LL*gs->count/gs->size) : 0,
+               gs->lookups ? (double)gs->probes/gs->lookups : 0.0,
+               gs->maxprobe,gs->resizes);
+}
+
+/* Asks each task on this node for its statistics, and prints those of its global tables. This
+   runs as a separate endpoint, so that the responses don't get mixed up with the messages the
+   console receives about its connection. */
+static void globstats_thread(node *n, endpoint *endpt, void *arg)
+{
+  array *out = (array*)arg;
+  endpointid *epids = NULL;
+  int count = node_get_endpoints(n,"task",&epids);
+  int remaining = count;
+  get_stats_msg gsm;
+  int i;
+
+  memset(&gsm,0,sizeof(gsm));
+  gsm.sender = endpt->epid;
+  for (i = 0; i < count; i++)
+    endpoint_send(endpt,epids[i],MSG_GET_STATS,&gsm,sizeof(gsm));
+
+  array_printf(out,"%-22s %-10s %-10s %-10s %-5s %-8s %-8s %-7s\n",
+               "Task","Table","Entries","Size","Load%","Probes","Maxprobe","Resizes");
+  array_printf(out,"%-22s %-10s %-10s %-10s %-5s %-8s %-8s %-7s\n",
+               "----------------------","----------","----------","----------","-----",
+               "--------","--------","-------");
+
+  while (0 < remaining) {
+    message *msg = endpoint_receive(endpt,GLOBSTATS_TIMEOUT);
+    if (NULL == msg) {
+      array_printf(out,"%d task(s) did not respond\n",remaining);
+      break;
+    }
+    if (MSG_GET_STATS_RESPONSE == msg->tag) {
+      get_stats_response_msg *gsrm = (get_stats_response_msg*)msg->data;
+      char taskname[100];
+      assert(sizeof(get_stats_response_msg) == msg->size);
+      snprintf(taskname,100,EPID_FORMAT,EPID_ARGS(gsrm->epid));
+      print_globtable(out,taskname,"target",&gsrm->targethash);
+      print_globtable(out,taskname,"phys",&gsrm->physhash);
+      print_globtable(out,taskname,"addr",&gsrm->addrhash);
+      remaining--;
+    }
+    message_free(msg);
+  }
+
+  free(epids);
+}
+
 static int process_cmd(node *n, endpoint *endpt, int argc, char **argv, array *out)
 {
   assert(NODE_UNLOCKED(n));
@@ -114,6 +172,13 @@ static int process_cmd(node *n, endpoint *endpt, int argc, char **argv, array *o
     unlock_node(n);
     return 0;
   }
+  else if (!strcmp(argv[0],"globals") || !strcmp(argv[0],"g")) {
+    pthread_t thread;
+    node_add_thread(n,"globstats",globstats_thread,out,&thread);
+    if (0 != pthread_join(thread,NULL))
+      fatal("pthread_join: %s",strerror(errno));
+    return 0;
+  }
   else if (!strcmp(argv[0],"kill") || !strcmp(argv[0],"k")) {
     if (2 > argc)  {
       array_printf(out,"Please specify a task to kill\n");
@@ -142,6 +207,7 @@ static int process_cmd(node *n, endpoint *endpt, int argc, char **argv, array *o
     /* FIXME: see above */
 /*     array_printf(out,"tasks             [t] - List tasks\n"); */
     array_printf(out,"threads           [r] - List threads\n");
+    array_printf(out,"globals           [g] - Show sizes and probe lengths of global tables\n");
     array_printf(out,"kill              [k] - Kill a task\n");
     array_printf(out,"quit (or exit)    [q] - Disconnect from debug console\n");
     array_printf(out,"shutdown          [s] - Shut down VM\n");
@@ -49,6 +49,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#define MAX_EVENTS  256
+#endif
 
 static listener *get_listener(node *n, socketid id)
 {
@@ -92,6 +96,7 @@ static void iothread_accept(node *n, endpoint *endpt, accept_msg *m, endpointid
   l->accept_frameid = m->ioid;
   assert(l->dontaccept);
   l->dontaccept = 0;
+  watch_listener(n,l);
   node_notify(n);
 }
 
@@ -172,6 +177,7 @@ static void iothread_read(node *n, endpoint *endpt, read_msg *m, endpointid sour
 
     conn->frameids[READ_FRAMEADDR] = m->ioid;
     conn->dontread = 0;
+    watch_connection(conn);
     node_notify(n);
   }
 }
@@ -200,10 +206,27 @@ static void iothread_write(node *n, endpoint *endpt, write_msg *m, endpointid so
       endpoint_link_locked(endpt,conn->owner);
     }
 
-    if (0 < m->len)
-      array_append(conn->sendbuf,m->data,m->len);
-    else
+    if (0 < m->len) {
+      int w = 0;
+
+      /* If nothing is queued up ahead of this data, try to write it straight to the socket from
+         the message, and only buffer whatever is left over */
+      if ((0 <= conn->sock) && CANWRITE(conn) && (0 == conn->sendbuf->nbytes) && !conn->finwrite) {
+        w = TEMP_FAILURE_RETRY(write(conn->sock,m->data,m->len));
+        if (0 > w)
+          w = 0; /* errors are dealt with by handle_write() */
+        conn->totalwritten += w;
+        n->p->byteswritten += w;
+      }
+
+      if (w < m->len) {
+        array_append(conn->sendbuf,&m->data[w],m->len-w);
+        n->p->bytescopied += m->len-w;
+      }
+    }
+    else {
       conn->finwrite = 1;
+    }
 
     assert(0 == conn->frameids[WRITE_FRAMEADDR]);
 
@@ -215,6 +238,7 @@ static void iothread_write(node *n, endpoint *endpt, write_msg *m, endpointid so
     else
       conn->frameids[WRITE_FRAMEADDR] = m->ioid;
 
+    watch_connection(conn);
     node_notify(n);
   }
 
@@ -234,6 +258,7 @@ static void iothread_delete_connection(node *n, endpoint *endpt,
     conn->collected = 1;
     if (!conn->finwrite) {
       conn->finwrite = 1;
+      watch_connection(conn);
       node_notify(n);
     }
     connection_fsm(conn,CE_FINREAD);
@@ -297,8 +322,24 @@ static void iothread_handle_message(node *n, endpoint *endpt, message *msg)
 
 static void handle_write(node *n, connection *conn)
 {
+#ifdef USE_SHMRING
+  if (conn->txring && conn->txring->active) {
+    shmring_flush(n,conn);
+    if ((0 == conn->sendbuf->nbytes) && conn->finwrite)
+      connection_fsm(conn,CE_FINWRITE);
+    return;
+  }
+#endif
+
   while (0 < conn->sendbuf->nbytes) {
-    int w = TEMP_FAILURE_RETRY(write(conn->sock,conn->sendbuf->data,conn->sendbuf->nbytes));
+    int len = conn->sendbuf->nbytes;
+    int w;
+#ifdef USE_SHMRING
+    /* Only the data up to and including the shared memory offer goes over the socket */
+    if (conn->txring)
+      len = conn->txring->tcpbytes;
+#endif
+    w = TEMP_FAILURE_RETRY(write(conn->sock,conn->sendbuf->data,len));
     if ((0 > w) && (EAGAIN == errno))
       break;
 
@@ -321,7 +362,17 @@ static void handle_write(node *n, connection *conn)
     }
 
     conn->totalwritten += w;
+    n->p->byteswritten += w;
     array_remove_data(conn->sendbuf,w);
+
+#ifdef USE_SHMRING
+    if (conn->txring && (0 == (conn->txring->tcpbytes -= w))) {
+      node_log(n,LOG_INFO,"Sending to %s:%d through shared memory",conn->hostname,conn->port);
+      conn->txring->active = 1;
+      shmring_flush(n,conn);
+      break;
+    }
+#endif
   }
 
   notify_write(n,conn);
@@ -406,11 +457,17 @@ static void process_received(node *n, connection *conn)
     }
   }
 
+  /* The node that opened the connection sends its listen port and wire format version; the node
+     that accepted it replies with its own version. Each side checks the other's version before
+     any messages are exchanged, so a mismatch is reported clearly at both ends instead of showing
+     up later as a corrupt message. */
   if (conn->donewelcome && !conn->donehandshake) {
     unsigned char *connip = (unsigned char*)&conn->ip;
+    unsigned char wireversion;
+    int accepted = (0 > conn->port);
 
-    if (0 > conn->port) {
-      if (sizeof(int) > conn->recvbuf->nbytes-start) {
+    if (accepted) {
+      if (sizeof(unsigned short)+sizeof(unsigned char) > conn->recvbuf->nbytes-start) {
         array_remove_data(conn->recvbuf,start);
         return;
       }
@@ -420,10 +477,45 @@ static void process_received(node *n, connection *conn)
       if (0 > conn->port)
         fatal("Client sent bad listen port: %d",conn->port);
     }
+    else if (sizeof(unsigned char) > conn->recvbuf->nbytes-start) {
+      array_remove_data(conn->recvbuf,start);
+      return;
+    }
+
+    wireversion = *(unsigned char*)&conn->recvbuf->data[start];
+    start += sizeof(unsigned char);
+
+    if (WIRE_VERSION != wireversion) {
+      node_log(n,LOG_ERROR,"Node %u.%u.%u.%u:%d uses wire format version %d; we use %d",
+               connip[0],connip[1],connip[2],connip[3],conn->port,wireversion,WIRE_VERSION);
+      if (accepted && (0 == conn->sendbuf->nbytes)) {
+        /* Best effort: tell the other node our version before closing, so it can report the
+           mismatch too rather than just seeing the connection drop */
+        unsigned char ours = WIRE_VERSION;
+        if (0 > TEMP_FAILURE_RETRY(write(conn->sock,&ours,sizeof(unsigned char))))
+          node_log(n,LOG_DEBUG1,"Could not send wire format version: %s",strerror(errno));
+      }
+      snprintf(conn->errmsg,ERRMSG_MAX,"incompatible wire format version %d",wireversion);
+      conn->errmsg[ERRMSG_MAX] = '\0';
+      array_remove_data(conn->recvbuf,conn->recvbuf->nbytes);
+      connection_fsm(conn,CE_ERROR);
+      return;
+    }
+
+    if (accepted) {
+      wireversion = WIRE_VERSION;
+      array_append(conn->sendbuf,&wireversion,sizeof(unsigned char));
+      watch_connection(conn);
+    }
 
     node_log(n,LOG_INFO,"Node %u.%u.%u.%u:%d connected",
              connip[0],connip[1],connip[2],connip[3],conn->port);
     conn->donehandshake = 1;
+
+#ifdef USE_SHMRING
+    if (n->p->useshm && conn->si->samehost)
+      shmring_offer(n,conn);
+#endif
   }
 
   /* inspect the next section of the input buffer to see if it contains a complete message */
@@ -438,6 +530,16 @@ static void process_received(node *n, connection *conn)
     if (MSG_HEADER_SIZE+hdr->size1 > conn->recvbuf->nbytes-start)
       break; /* incomplete message */
 
+#ifdef USE_SHMRING
+    if ((0 == hdr->destlocalid) && (MSG_SHM_OFFER == hdr->tag1)) {
+      if (0 > shmring_attach(n,conn,(shm_offer_msg*)&conn->recvbuf->data[start+MSG_HEADER_SIZE],
+                             hdr->size1))
+        return; /* connection has been removed */
+      start += MSG_HEADER_SIZE+hdr->size1;
+      continue;
+    }
+#endif
+
     /* complete message present; add it to the mailbox */
     got_message(n,hdr,source,hdr->tag1,hdr->size1,&conn->recvbuf->data[start+MSG_HEADER_SIZE]);
     start += MSG_HEADER_SIZE+hdr->size1;
@@ -447,34 +549,129 @@ static void process_received(node *n, connection *conn)
   array_remove_data(conn->recvbuf,start);
 }
 
-static void handle_read(node *n, connection *conn)
+#ifdef USE_SHMRING
+/* Processes everything that is currently in the connection's incoming ring. Returns 0 if the
+   connection has been removed as a result. */
+static int read_shmring(node *n, connection *conn)
+{
+  socketid sockid = conn->sockid;
+  while (0 < shmring_receive(n,conn)) {
+    process_received(n,conn);
+    if ((NULL == (conn = connhash_lookup(n,sockid))) || (NULL == conn->rxring))
+      return 0;
+  }
+  return 1;
+}
+#endif
+
+/* Passes data read directly into a READ_RESPONSE message on to the connection's owner */
+static void deliver_read(node *n, connection *conn, message *msg, int len)
+{
+  read_response_msg *rrm = (read_response_msg*)msg->data;
+
+  rrm->ioid = conn->frameids[READ_FRAMEADDR];
+  rrm->sockid = conn->sockid;
+  rrm->len = len;
+  msg->size = sizeof(read_response_msg)+len;
+
+  node_send_message_locked(n,IO_ID,conn->owner,MSG_READ_RESPONSE,msg);
+
+  conn->frameids[READ_FRAMEADDR] = 0;
+  conn->dontread = 1;
+  watch_connection(conn);
+}
+
+static void handle_read(node *n, iothread *ioth, connection *conn)
 {
   /* Just do one read; there may still be more data pending after this, but we want to also
      give a fair chance for other connections to be read from. We also want to process messages
      as they arrive rather than waiting until can't ready an more, to avoid buffering up large
      numbers of messages */
   int r;
+  int readerr;
   array *buf = conn->recvbuf;
+  message *msg = NULL;
+  char *dest;
 
   assert(CANREAD(conn));
   assert(!conn->isreg || (0 <= conn->frameids[READ_FRAMEADDR]));
 
-  array_mkroom(conn->recvbuf,n->iosize);
-  r = TEMP_FAILURE_RETRY(read(conn->sock,
-                              &buf->data[buf->nbytes],
-                              n->iosize));
+  /* If a task is waiting for data from a regular connection, read straight into the message that
+     will be sent to it, rather than going via the receive buffer */
+  if (conn->isreg && (0 < conn->frameids[READ_FRAMEADDR]) && (0 == buf->nbytes)) {
+    msg = message_alloc(sizeof(read_response_msg)+n->iosize);
+    dest = ((read_response_msg*)msg->data)->data;
+  }
+  else if (1 < n->p->niothreads) {
+    dest = ioth->readbuf;
+  }
+  else {
+    array_mkroom(buf,n->iosize);
+    dest = &buf->data[buf->nbytes];
+  }
+
+  if (1 < n->p->niothreads) {
+    /* Release the node lock during the read so that other I/O threads can proceed. The
+       destination is private to this thread, since the connection's receive buffer may be
+       modified in the meantime. The socket cannot be closed while we are using it, because
+       only this thread closes it. If the connection has gone away, the data is discarded. */
+    int sock = conn->sock;
+    socketid sockid = conn->sockid;
+    unlock_mutex(&n->p->lock);
+    r = TEMP_FAILURE_RETRY(read(sock,dest,n->iosize));
+    readerr = errno;
+    lock_mutex(&n->p->lock);
+
+    conn = connhash_lookup(n,sockid);
+    if ((NULL == conn) || (sock != conn->sock) || !CANREAD(conn)) {
+      if (msg)
+        message_free(msg);
+      return;
+    }
+
+    buf = conn->recvbuf;
+    if (msg && ((0 == conn->frameids[READ_FRAMEADDR]) || (0 < buf->nbytes))) {
+      /* The read request was dealt with some other way while the lock was released */
+      if (0 < r) {
+        array_mkroom(buf,r);
+        memcpy(&buf->data[buf->nbytes],dest,r);
+        n->p->bytescopied += r;
+      }
+      message_free(msg);
+      msg = NULL;
+    }
+    else if (!msg && (0 < r)) {
+      array_mkroom(buf,r);
+      memcpy(&buf->data[buf->nbytes],dest,r);
+      n->p->bytescopied += r;
+    }
+  }
+  else {
+    r = TEMP_FAILURE_RETRY(read(conn->sock,dest,n->iosize));
+    readerr = errno;
+  }
+
+  if ((0 >= r) && msg) {
+    message_free(msg);
+    msg = NULL;
+  }
 
   if (0 > r) {
     node_log(n,LOG_WARNING,"read() from %s:%d failed: %s",
-             conn->hostname,conn->port,strerror(errno));
-    conn->errn = errno;
-    snprintf(conn->errmsg,ERRMSG_MAX,"%s",strerror(errno));
+             conn->hostname,conn->port,strerror(readerr));
+    conn->errn = readerr;
+    snprintf(conn->errmsg,ERRMSG_MAX,"%s",strerror(readerr));
     conn->errmsg[ERRMSG_MAX] = '\0';
     connection_fsm(conn,CE_ERROR);
     return;
   }
 
   if (0 == r) {
+#ifdef USE_SHMRING
+    /* The peer may have put more data in the ring before it went away */
+    if (conn->rxring && !read_shmring(n,conn))
+      return;
+#endif
     if (!conn->isreg)
       node_log(n,LOG_WARNING,"read: Connection %s:%d closed by peer",conn->hostname,conn->port);
     notify_read(n,conn);
@@ -491,8 +688,14 @@ static void handle_read(node *n, connection *conn)
 
   connection_fsm(conn,CE_READ);
 
-  conn->recvbuf->nbytes += r;
   conn->totalread += r;
+  n->p->bytesread += r;
+  if (msg) {
+    deliver_read(n,conn,msg,r);
+    return;
+  }
+
+  conn->recvbuf->nbytes += r;
   process_received(n,conn);
 }
 
@@ -538,7 +741,7 @@ static int handle_connected(node *n, connection *conn)
   return 0;
 }
 
-static void handle_new_connection(node *n, listener *l)
+static void handle_new_connection(node *n, iothread *ioth, listener *l)
 {
   struct sockaddr_in remote_addr;
   socklen_t sin_size = sizeof(struct sockaddr_in);
@@ -547,7 +750,7 @@ static void handle_new_connection(node *n, listener *l)
   int yes = 1;
   char *hostname;
 
-  if (0 > (clientfd = accept(l->fd,(struct sockaddr*)&remote_addr,&sin_size))) {
+  if (0 > (clientfd = accept(l->fds[ioth->index],(struct sockaddr*)&remote_addr,&sin_size))) {
     perror("accept");
     return;
   }
@@ -566,6 +769,7 @@ static void handle_new_connection(node *n, listener *l)
   node_log(n,LOG_INFO,"Got connection from %s",hostname);
   conn = add_connection(n,hostname,remote_addr.sin_addr.s_addr,l);
   conn->sock = clientfd;
+  conn->ioth = ioth->index;
   free(hostname);
 
   conn->ip = remote_addr.sin_addr.s_addr;
@@ -575,8 +779,258 @@ static void handle_new_connection(node *n, listener *l)
   notify_accept(n,conn);
 }
 
+#ifdef USE_EPOLL
+static void set_interest(int epfd, int fd, unsigned int *current, unsigned int events,
+                         uint64_t token)
+{
+  struct epoll_event ev;
+  int op;
+
+  if (events == *current)
+    return;
+
+  /* Descriptors we are not interested in are removed from the epoll set altogether, because
+     epoll always reports errors and hangups, and we would otherwise spin on a connection that
+     has been closed by the peer but which nobody is reading from yet */
+  if (0 == events)
+    op = EPOLL_CTL_DEL;
+  else if (0 == *current)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  memset(&ev,0,sizeof(ev));
+  ev.events = events;
+  ev.data.u64 = token;
+  if (0 > epoll_ctl(epfd,op,fd,&ev))
+    fatal("epoll_ctl: %s",strerror(errno));
+  *current = events;
+}
+#endif
+
+/* Must be called whenever something changes that affects whether the I/O thread should be
+   waiting to read from or write to a connection: its state, dontread, finwrite, or the contents
+   of the send buffer. With select() this is worked out on each iteration of the loop, but with
+   epoll we only tell the kernel when it changes. The change takes effect immediately even if the
+   connection's I/O thread is currently blocked in epoll_wait(), so no wakeup is necessary. */
+void watch_connection(connection *conn)
+{
+#ifdef USE_EPOLL
+  unsigned int events = 0;
+
+  assert(NODE_ALREADY_LOCKED(conn->n));
+  if (0 > conn->sock)
+    return;
+
+  if (CANREAD(conn) && !conn->dontread)
+    events |= EPOLLIN;
+
+  /* Once the shared memory ring is in use, a full send buffer means we're waiting for the
+     receiver to make room in the ring, not for the socket to become writable */
+  if (CANWRITE(conn) && ((0 < conn->sendbuf->nbytes) || conn->finwrite) &&
+      (!conn->txring || !conn->txring->active || conn->finwrite))
+    events |= EPOLLOUT;
+  else if (CS_CONNECTING == conn->state)
+    events |= EPOLLOUT;
+
+  set_interest(conn->n->p->iothreads[conn->ioth].epfd,conn->sock,&conn->epevents,events,
+               conn->sockid.sid);
+
+  if (conn->txring)
+    set_interest(conn->n->p->iothreads[conn->ioth].epfd,conn->txring->waitfd,
+                 &conn->txring->epevents,EPOLLIN,EP_SHMRING|conn->sockid.sid);
+  if (conn->rxring)
+    set_interest(conn->n->p->iothreads[conn->ioth].epfd,conn->rxring->waitfd,
+                 &conn->rxring->epevents,EPOLLIN,EP_SHMRING|conn->sockid.sid);
+#endif
+}
+
+void unwatch_connection(connection *conn)
+{
+#ifdef USE_EPOLL
+  int epfd = conn->n->p->iothreads[conn->ioth].epfd;
+  if (0 <= conn->sock)
+    set_interest(epfd,conn->sock,&conn->epevents,0,conn->sockid.sid);
+  if (conn->txring)
+    set_interest(epfd,conn->txring->waitfd,&conn->txring->epevents,0,
+                 EP_SHMRING|conn->sockid.sid);
+  if (conn->rxring)
+    set_interest(epfd,conn->rxring->waitfd,&conn->rxring->epevents,0,
+                 EP_SHMRING|conn->sockid.sid);
+#endif
+}
+
+void watch_listener(node *n, listener *l)
+{
+#ifdef USE_EPOLL
+  int i;
+  for (i = 0; i < n->p->niothreads; i++)
+    set_interest(n->p->iothreads[i].epfd,l->fds[i],&l->epevents[i],
+                 l->dontaccept ? 0 : EPOLLIN,EP_LISTENER|l->sockid.sid);
+#endif
+}
+
+void unwatch_listener(node *n, listener *l)
+{
+#ifdef USE_EPOLL
+  int i;
+  for (i = 0; i < n->p->niothreads; i++)
+    set_interest(n->p->iothreads[i].epfd,l->fds[i],&l->epevents[i],0,
+                 EP_LISTENER|l->sockid.sid);
+#endif
+}
+
+#ifdef USE_EPOLL
+static listener *find_listener(node *n, uint32_t sid)
+{
+  listener *l;
+  for (l = n->p->listeners.first; l; l = l->next)
+    if (l->sockid.sid == sid)
+      return l;
+  return NULL;
+}
+
+static connection *find_connection_sid(node *n, uint32_t sid)
+{
+  socketid sockid;
+  sockid.coordid = n->iothid;
+  sockid.sid = sid;
+  return connhash_lookup(n,sockid);
+}
+
+/* Main loop of an I/O thread. endpt is only set for the first thread, which is the one that
+   handles messages sent to the I/O endpoint. */
+static void iothread_loop(node *n, iothread *ioth, endpoint *endpt)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  lock_mutex(&n->p->lock);
+  while (!n->p->shutdown) {
+    int nevents;
+    int i;
+
+    unlock_mutex(&n->p->lock);
+    nevents = epoll_wait(ioth->epfd,events,MAX_EVENTS,-1);
+    lock_mutex(&n->p->lock);
+
+    if (0 > nevents) {
+      if (EINTR != errno)
+        fatal("epoll_wait: %s",strerror(errno));
+      continue;
+    }
+
+    if (ioth->notified) {
+      uint64_t c;
+      if (0 > read(ioth->wakefd_read,&c,sizeof(c)))
+        fatal("Can't read from wakeup descriptor: %s",strerror(errno));
+      ioth->notified = 0;
+    }
+
+    /* Process messages */
+    if (endpt && endpt->interrupt) {
+      message *msg;
+      endpt->interrupt = 0;
+      while (NULL != (msg = endpoint_receive(endpt,0))) {
+        iothread_handle_message(n,endpt,msg);
+        message_free(msg);
+      }
+    }
+
+    /* Move data through shared memory rings whose doorbells have been rung */
+    for (i = 0; i < nevents; i++) {
+      connection *conn;
+      if (!(events[i].data.u64 & EP_SHMRING))
+        continue;
+      if (NULL == (conn = find_connection_sid(n,events[i].data.u64 & EP_SID_MASK)))
+        continue;
+      if (conn->txring) {
+        shmring_clear_doorbell(conn->txring);
+        if (conn->txring->active)
+          handle_write(n,conn);
+      }
+      if ((NULL != (conn = find_connection_sid(n,events[i].data.u64 & EP_SID_MASK))) &&
+          conn->rxring) {
+        shmring_clear_doorbell(conn->rxring);
+        if (read_shmring(n,conn))
+          watch_connection(conn);
+      }
+    }
+
+    /* Do all the writing we can. The connection may have been removed, or no longer be
+       interested in writing, as a result of one of the messages processed above. */
+    for (i = 0; i < nevents; i++) {
+      connection *conn;
+      if (events[i].data.u64 & (EP_LISTENER|EP_WAKEUP|EP_SHMRING))
+        continue;
+      if (!(events[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
+        continue;
+      conn = find_connection_sid(n,events[i].data.u64 & EP_SID_MASK);
+      if ((NULL == conn) || (0 > conn->sock) || !(conn->epevents & EPOLLOUT))
+        continue;
+      if (CS_CONNECTING == conn->state)
+        handle_connected(n,conn);
+      else
+        handle_write(n,conn);
+    }
+
+    /* Read data */
+    for (i = 0; i < nevents; i++) {
+      connection *conn;
+      if (events[i].data.u64 & (EP_LISTENER|EP_WAKEUP|EP_SHMRING))
+        continue;
+      if (!(events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
+        continue;
+      conn = find_connection_sid(n,events[i].data.u64 & EP_SID_MASK);
+      if ((NULL == conn) || (0 > conn->sock) || !(conn->epevents & EPOLLIN) || !CANREAD(conn))
+        continue;
+      handle_read(n,ioth,conn);
+    }
+
+    /* accept new connections */
+    for (i = 0; i < nevents; i++) {
+      listener *l;
+      if (!(events[i].data.u64 & EP_LISTENER))
+        continue;
+      l = find_listener(n,events[i].data.u64 & EP_SID_MASK);
+      if ((NULL != l) && !l->dontaccept)
+        handle_new_connection(n,ioth,l);
+    }
+
+    /* Bring the interest sets of the connections we've just dealt with up to date */
+    for (i = 0; i < nevents; i++) {
+      connection *conn;
+      if (events[i].data.u64 & (EP_LISTENER|EP_WAKEUP|EP_SHMRING))
+        continue;
+      if (NULL != (conn = find_connection_sid(n,events[i].data.u64 & EP_SID_MASK)))
+        watch_connection(conn);
+    }
+
+    /* Handle pending close requests - this is done here to avoid closing an fd while it
+       is still in use above */
+    node_close_pending(n,ioth);
+
+    /* If there are available slots, initiate any new connections that are in the waiting state */
+    if (endpt)
+      connect_pending(n);
+  }
+  unlock_mutex(&n->p->lock);
+}
+
 static void ioloop(node *n, endpoint *endpt, void *arg)
 {
+  iothread_loop(n,&n->p->iothreads[0],endpt);
+}
+
+static void *iothread_worker(void *arg)
+{
+  iothread *ioth = (iothread*)arg;
+  iothread_loop(ioth->n,ioth,NULL);
+  return NULL;
+}
+#else
+static void ioloop(node *n, endpoint *endpt, void *arg)
+{
+  iothread *ioth = &n->p->iothreads[0];
   lock_mutex(&n->p->lock);
   while (!n->p->shutdown) {
     int highest = -1;
@@ -592,14 +1046,14 @@ static void ioloop(node *n, endpoint *endpt, void *arg)
 
     for (l = n->p->listeners.first; l; l = l->next) {
       if (!l->dontaccept)
-        FD_SET(l->fd,&readfds);
-      if (highest < l->fd)
-        highest = l->fd;
+        FD_SET(l->fds[0],&readfds);
+      if (highest < l->fds[0])
+        highest = l->fds[0];
     }
 
-    FD_SET(n->p->ioready_readfd,&readfds);
-    if (highest < n->p->ioready_readfd)
-      highest = n->p->ioready_readfd;
+    FD_SET(ioth->wakefd_read,&readfds);
+    if (highest < ioth->wakefd_read)
+      highest = ioth->wakefd_read;
 
     for (conn = n->p->connections.first; conn; conn = conn->next) {
       assert(!conn->iswaiting);
@@ -620,7 +1074,7 @@ static void ioloop(node *n, endpoint *endpt, void *arg)
 
       /* Note: it is possible that we did not find any data waiting to be written at this point,
          but some will become avaliable either just after we release the lock, or while the select
-         is actually blocked. node_notify() writes a single byte of data to the node's ioready pipe,
+         is actually blocked. node_notify() writes a value to the I/O thread's wakeup pipe,
          which will cause the select to be woken, and we will look around again to write the
          data. */
     }
@@ -636,13 +1090,13 @@ static void ioloop(node *n, endpoint *endpt, void *arg)
         fatal("select: %s",strerror(errno));
     }
 
-    assert(!FD_ISSET(n->p->ioready_readfd,&readfds) || n->p->notified);
+    assert(!FD_ISSET(ioth->wakefd_read,&readfds) || ioth->notified);
 
-    if (FD_ISSET(n->p->ioready_readfd,&readfds) || n->p->notified) {
-      int c;
-      if (0 > read(n->p->ioready_readfd,&c,1))
-        fatal("Can't read from ioready_readfd: %s",strerror(errno));
-      n->p->notified = 0;
+    if (FD_ISSET(ioth->wakefd_read,&readfds) || ioth->notified) {
+      uint64_t c;
+      if (0 > read(ioth->wakefd_read,&c,sizeof(c)))
+        fatal("Can't read from wakeup descriptor: %s",strerror(errno));
+      ioth->notified = 0;
     }
 
     if (0 == s)
@@ -673,26 +1127,39 @@ static void ioloop(node *n, endpoint *endpt, void *arg)
     for (conn = n->p->connections.first; conn; conn = next) {
       next = conn->next;
       if ((0 <= conn->sock) && FD_ISSET(conn->sock,&readfds) && CANREAD(conn))
-        handle_read(n,conn);
+        handle_read(n,ioth,conn);
     }
 
     /* accept new connections */
     for (l = n->p->listeners.first; l; l = l->next) {
-      if (FD_ISSET(l->fd,&readfds))
-        handle_new_connection(n,l);
+      if (FD_ISSET(l->fds[0],&readfds))
+        handle_new_connection(n,ioth,l);
     }
 
     /* Handle pending close requests - this is done here to avoid closing an fd while select()
       is looking at it */
-    node_close_pending(n);
+    node_close_pending(n,ioth);
 
     /* If there are available slots, initiate any new connections that are in the waiting state */
     connect_pending(n);
   }
   unlock_mutex(&n->p->lock);
 }
+#endif
 
 void node_start_iothread(node *n)
 {
-  node_add_thread2(n,"io",ioloop,NULL,&n->p->iothread,IO_ID,0);
+  node_add_thread2(n,"io",ioloop,NULL,&n->p->iothreads[0].thread,IO_ID,0);
+
+#ifdef USE_EPOLL
+  int i;
+  for (i = 1; i < n->p->niothreads; i++) {
+    if (0 != pthread_create(&n->p->iothreads[i].thread,NULL,iothread_worker,
+                            &n->p->iothreads[i]))
+      fatal("pthread_create: %s",strerror(errno));
+  }
+#endif
+
+  if (1 < n->p->niothreads)
+    node_log(n,LOG_INFO,"Using %d I/O threads",n->p->niothreads);
 }
@@ -0,0 +1,214 @@
+/*
+ * This file is part of the NReduce project
+ * Copyright (C) 2006-2010 Peter Kelly <kellypmk@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * $Id$
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netprivate.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef USE_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/* Endpoint mailboxes are intrusive multi-producer single-consumer queues, linked through the next
+   field of each message. Any thread may add a message without taking a lock: it atomically swaps
+   itself in as the new tail, then links the previous tail to it. Only the endpoint's own thread
+   removes messages. A stub message is kept in the queue when it would otherwise be empty, so that
+   head and tail are never NULL.
+
+   Between a producer swapping the tail and linking in its message, the queue appears empty to the
+   consumer beyond the old tail. The producer always checks whether the consumer is parked after
+   finishing the push, so such a message is never missed, just picked up on the next wakeup.
+
+   When the consumer has nothing to do, it sets the parked flag, checks the queue once more, and
+   sleeps until a producer clears the flag. On Linux this uses a futex on the flag itself, so
+   producers only make a system call if the consumer is actually asleep. */
+
+#define MAILBOX_NEXT(_msg) (*(message* volatile*)&(_msg)->next)
+
+void mailbox_init(mailbox *mb)
+{
+  memset(mb,0,sizeof(mailbox));
+  mb->head = &mb->stub;
+  mb->tail = &mb->stub;
+#ifndef USE_FUTEX
+  init_mutex(&mb->lock);
+  pthread_cond_init(&mb->cond,NULL);
+#endif
+}
+
+void mailbox_destroy(mailbox *mb)
+{
+  message *msg;
+  while (NULL != (msg = mailbox_pop(mb)))
+    message_free(msg);
+#ifndef USE_FUTEX
+  destroy_mutex(&mb->lock);
+  pthread_cond_destroy(&mb->cond);
+#endif
+}
+
+static void mailbox_push(mailbox *mb, message *msg)
+{
+  message *prev;
+  msg->next = NULL;
+  __sync_synchronize();
+  prev = (message*)__sync_lock_test_and_set(&mb->tail,msg);
+  MAILBOX_NEXT(prev) = msg;
+}
+
+/* Returns the next message, or NULL if there is none (or a producer is still in the middle of
+   adding one). Must only be called from the endpoint's own thread. */
+message *mailbox_pop(mailbox *mb)
+{
+  message *head = mb->head;
+  message *next = MAILBOX_NEXT(head);
+
+  if (&mb->stub == head) {
+    if (NULL == next)
+      return NULL;
+    mb->head = next;
+    head = next;
+    next = MAILBOX_NEXT(next);
+  }
+
+  if (NULL != next) {
+    mb->head = next;
+    return head;
+  }
+
+  if (head != *(message* volatile*)&mb->tail)
+    return NULL;
+
+  /* head is the only message; put the stub back behind it so it can be removed */
+  mailbox_push(mb,&mb->stub);
+  next = MAILBOX_NEXT(head);
+  if (NULL != next) {
+    mb->head = next;
+    return head;
+  }
+  return NULL;
+}
+
+/* Returns 1 if the consumer was parked and has been woken up */
+static int mailbox_wake(mailbox *mb)
+{
+  if (!*(volatile int*)&mb->parked || !__sync_lock_test_and_set(&mb->parked,0))
+    return 0;
+#ifdef USE_FUTEX
+  syscall(SYS_futex,&mb->parked,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+#else
+  lock_mutex(&mb->lock);
+  pthread_cond_broadcast(&mb->cond);
+  unlock_mutex(&mb->lock);
+#endif
+  return 1;
+}
+
+/* Adds a message to the mailbox; may be called from any thread */
+int mailbox_add(mailbox *mb, message *msg)
+{
+  mailbox_push(mb,msg);
+  __sync_synchronize(); /* the link to msg must be visible before we check the parked flag */
+  return mailbox_wake(mb);
+}
+
+/* Sleeps until a producer clears the parked flag, or the timeout (if non-NULL) expires */
+static void mailbox_park(mailbox *mb, const struct timespec *timeout)
+{
+#ifdef USE_FUTEX
+  syscall(SYS_futex,&mb->parked,FUTEX_WAIT_PRIVATE,1,timeout,NULL,0);
+#else
+  lock_mutex(&mb->lock);
+  if (*(volatile int*)&mb->parked) {
+    if (NULL == timeout) {
+      pthread_cond_wait(&mb->cond,&mb->lock);
+    }
+    else {
+      struct timeval now;
+      struct timespec abstime;
+      gettimeofday(&now,NULL);
+      abstime.tv_sec = now.tv_sec+timeout->tv_sec;
+      abstime.tv_nsec = now.tv_usec*1000+timeout->tv_nsec;
+      if (1000000000 <= abstime.tv_nsec) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&mb->cond,&mb->lock,&abstime);
+    }
+  }
+  unlock_mutex(&mb->lock);
+#endif
+}
+
+/* Removes the next message, waiting for up to delayms milliseconds if there is none. A negative
+   delay means wait indefinitely. */
+message *mailbox_receive(mailbox *mb, int delayms)
+{
+  struct timeval deadline;
+  message *msg;
+
+  if ((NULL != (msg = mailbox_pop(mb))) || (0 == delayms))
+    return msg;
+
+  if (0 < delayms) {
+    gettimeofday(&deadline,NULL);
+    deadline = timeval_addms(deadline,delayms);
+  }
+
+  while (1) {
+    struct timespec remaining;
+    struct timespec *timeout = NULL;
+
+    __sync_lock_test_and_set(&mb->parked,1);
+    __sync_synchronize();
+    if (NULL != (msg = mailbox_pop(mb))) {
+      mb->parked = 0;
+      return msg;
+    }
+
+    if (0 < delayms) {
+      struct timeval now;
+      struct timeval left;
+      gettimeofday(&now,NULL);
+      if (timeval_diffms(now,deadline) <= 0) {
+        mb->parked = 0;
+        return mailbox_pop(mb);
+      }
+      left = timeval_diff(now,deadline);
+      remaining.tv_sec = left.tv_sec;
+      remaining.tv_nsec = left.tv_usec*1000;
+      timeout = &remaining;
+    }
+
+    mailbox_park(mb,timeout);
+  }
+}
@@ -40,15 +40,95 @@
 
 #define MAX_OPENING 3
 
-typedef struct messagelist {
-  message *first;
-  message *last; 
+/* On Linux, the I/O thread waits for events using epoll rather than select(), so that the cost of
+   a wakeup does not depend on the number of connections, and there is no FD_SETSIZE limit */
+#ifdef __linux__
+#define USE_EPOLL
+#endif
+
+/* Upper limit on the number of I/O threads that may be requested via the IO_THREADS environment
+   variable. Additional threads are only supported with epoll, since listening sockets are shared
+   between them using SO_REUSEPORT. */
+#define MAX_IOTHREADS 32
+
+#ifdef USE_EPOLL
+#include <stdint.h>
+
+/* The data associated with each descriptor in an epoll set is the sid of the connection or
+   listener, so that events for objects that have been removed since epoll_wait() returned can
+   be recognised and ignored */
+#define EP_LISTENER ((uint64_t)1 << 32)
+#define EP_WAKEUP   ((uint64_t)1 << 33)
+#define EP_SHMRING  ((uint64_t)1 << 34)
+#define EP_SID_MASK 0xFFFFFFFFULL
+#endif
+
+/* Waiting for messages uses a futex where available, otherwise a condition variable */
+#ifdef __linux__
+#define USE_FUTEX
+#endif
+
+#define ENDPOINT_HASH_SIZE 1021
+
+/* Connections to other nodes on the same host carry messages through a pair of shared memory ring
+   buffers, one in each direction, rather than through the socket. The TCP connection is still
+   used for the initial handshake, and to detect when the other node goes away. This relies on
+   epoll to wait for the doorbells that signal a ring has become non-empty or non-full. */
+#ifdef USE_EPOLL
+#define USE_SHMRING
+#endif
+
+#define SHMRING_SIZE (4*1024*1024)
+#define SHMRING_DIR "/dev/shm"
+
+/* Lives at the start of the shared memory segment, followed by the data. head and tail are running
+   byte counts, and are kept on separate cache lines since they are written by different
+   processes. */
+typedef struct shmring_header {
+  volatile uint32_t head;
+  char pad1[60];
+  volatile uint32_t tail;
+  char pad2[60];
+  volatile int readerwaiting;
+  volatile int writerwaiting;
+  uint32_t size;
+  char pad3[52];
+} shmring_header;
+
+typedef struct shmring {
+  shmring_header *hdr;
+  char *data;
+  uint32_t size;
+  int bellfd;
+  int waitfd;
+  unsigned int epevents;
+  int active;
+  int tcpbytes;
+  int owner;
+  int pid;
+  uint32_t sid;
+} shmring;
+
+typedef struct {
+  int pid;
+  uint32_t sid;
+  uint32_t size;
+} __attribute__ ((__packed__)) shm_offer_msg;
+
+typedef struct mailbox {
+  message *head;
+  message *tail;
+  message stub;
+  int parked;
+#ifndef USE_FUTEX
   pthread_mutex_t lock;
   pthread_cond_t cond;
-} messagelist;
+#endif
+} mailbox;
 
 typedef struct endpoint_private {
-  messagelist mailbox;
+  mailbox mailbox;
+  struct endpoint *hashnext;
   pthread_t thread;
   char *type;
   void *data;
@@ -104,13 +184,17 @@ typedef struct connection {
   int haderror;
   struct serverinfo *si;
   struct connection *hashnext;
+  unsigned int epevents;
+  int ioth;
+  shmring *txring;
+  shmring *rxring;
 } connection;
 
 typedef struct listener {
   socketid sockid;
   in_addr_t ip;
   int port;
-  int fd;
+  int fds[MAX_IOTHREADS];
   void *data;
   int dontaccept;
   int accept_frameid;
@@ -118,6 +202,7 @@ typedef struct listener {
   struct listener *next;
   endpointid owner;
   int notify;
+  unsigned int epevents[MAX_IOTHREADS];
 } listener;
 
 typedef struct endpointlist {
@@ -140,6 +225,7 @@ typedef struct serverinfo {
   int nopening;
   int naccepted;
   in_addr_t ip;
+  int samehost;
   connectionlist waiting_connections;
 } serverinfo;
 
@@ -157,6 +243,23 @@ typedef struct portset {
   int end;
 } portset;
 
+/* Each I/O thread services a subset of the node's connections, and has its own epoll set and
+   wakeup descriptor. Thread 0 is the I/O endpoint, and in addition to its own connections handles
+   all messages sent to IO_ID, as well as initiating outgoing connections. Other threads only
+   deal with reads, writes and accepts. Sockets are only ever closed by the thread that services
+   them, since it may be reading from them without holding the node lock. */
+typedef struct iothread {
+  struct node *n;
+  int index;
+  pthread_t thread;
+  int epfd;
+  int wakefd_read;
+  int wakefd_write;
+  int notified;
+  list *toclose;
+  char *readbuf;
+} iothread;
+
 typedef struct node_private {
   struct listener *mainl;
   endpointlist endpoints;
@@ -164,22 +267,25 @@ typedef struct node_private {
   listenerlist listeners;
   unsigned int nextlocalid;
   unsigned int nextsid;
-  pthread_t iothread;
-  int ioready_writefd;
-  int ioready_readfd;
-  int notified;
+  iothread iothreads[MAX_IOTHREADS];
+  int niothreads;
+  int useshm;
   pthread_mutex_t lock;
+  pthread_rwlock_t eplock;
+  endpoint *ephash[ENDPOINT_HASH_SIZE];
   int shutdown;
   FILE *logfile;
   int loglevel;
   pthread_cond_t closecond;
-  list *toclose;
   list *stats;
   list *servers;
   connection *connhash[CONNECTION_HASH_SIZE];
   portset outports;
   int counthist[MSG_HISTMAX];
   int sizehist[MSG_HISTMAX];
+  long long bytesread;
+  long long byteswritten;
+  long long bytescopied;
 } node_private;
 
 #define lock_node(_n) { lock_mutex(&(_n)->p->lock);
@@ -192,8 +298,10 @@ listener *node_listen_locked(node *n, in_addr_t ip, int port, int notify, void *
                              int dontaccept, int ismain, endpointid *owner, char *errmsg,
                              int errlen);
 void node_remove_listener(node *n, listener *l);
-void node_close_pending(node *n);
+void node_close_later(node *n, int ioth, int fd);
+void node_close_pending(node *n, iothread *ioth);
 void node_start_iothread(node *n);
+void iothread_wake(iothread *ioth);
 void node_close_endpoints(node *n);
 void node_close_connections(node *n);
 void node_handle_endpoint_exit(node *n, endpoint_exit_msg *m);
@@ -202,6 +310,8 @@ void connect_pending(node *n);
 void start_console(node *n, connection *conn);
 void node_send_locked(node *n, uint32_t sourcelocalid, endpointid destendpointid,
                       uint32_t tag, const void *data, uint32_t size);
+void node_send_message_locked(node *n, uint32_t sourcelocalid, endpointid dest,
+                              uint32_t tag, message *msg);
 void got_message(node *n, const msgheader *hdr, endpointid source,
                  uint32_t tag, uint32_t size, const void *data);
 void create_connection_buffers(connection *conn);
@@ -220,6 +330,27 @@ void connhash_remove(node *n, connection *conn);
 /* iothread.c */
 
 void handle_disconnection(node *n, connection *conn);
+void watch_connection(connection *conn);
+void unwatch_connection(connection *conn);
+void watch_listener(node *n, listener *l);
+void unwatch_listener(node *n, listener *l);
+
+/* mailbox.c */
+
+void mailbox_init(mailbox *mb);
+void mailbox_destroy(mailbox *mb);
+message *mailbox_pop(mailbox *mb);
+int mailbox_add(mailbox *mb, message *msg);
+message *mailbox_receive(mailbox *mb, int delayms);
+
+/* shmring.c */
+
+void shmring_offer(node *n, connection *conn);
+int shmring_attach(node *n, connection *conn, const shm_offer_msg *m, uint32_t size);
+void shmring_flush(node *n, connection *conn);
+int shmring_receive(node *n, connection *conn);
+void shmring_clear_doorbell(shmring *ring);
+void shmring_close(node *n, connection *conn);
 
 /* notify.c */
 
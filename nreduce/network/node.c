@@ -43,8 +43,14 @@
 #include <sys/time.h>
 #include <time.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 const char *log_levels[LOG_COUNT] = {
   "NONE",
@@ -78,23 +84,49 @@ const char *msg_names[MSG_HISTMAX] = {
   "DELETE_REPLICAS",
   "COUNT_SPARKS",
   "NUM_SPARKS",
-  "DISTRIBUTE"};
+  "DISTRIBUTE",
+  "BUNDLE"};
 
 static void endpoint_add_message(endpoint *endpt, message *msg);
 static endpointid node_add_thread_locked(node *n, const char *type,
                                          endpoint_threadfun fun, void *arg, pthread_t *threadp,
                                          int localid, int stacksize);
 
+/* The endpoint hash table is modified only with both the node lock and eplock held, so it can be
+   read with either of them */
 static endpoint *find_endpoint(node *n, int localid)
 {
   endpoint *endpt;
-  assert(NODE_ALREADY_LOCKED(n));
-  for (endpt = n->p->endpoints.first; endpt; endpt = endpt->next)
+  for (endpt = n->p->ephash[localid % ENDPOINT_HASH_SIZE]; endpt; endpt = endpt->p->hashnext)
     if (endpt->epid.localid == localid)
       break;
   return endpt;
 }
 
+static void ephash_add(node *n, endpoint *endpt)
+{
+  int h = endpt->epid.localid % ENDPOINT_HASH_SIZE;
+  assert(NODE_ALREADY_LOCKED(n));
+  pthread_rwlock_wrlock(&n->p->eplock);
+  endpt->p->hashnext = n->p->ephash[h];
+  n->p->ephash[h] = endpt;
+  pthread_rwlock_unlock(&n->p->eplock);
+}
+
+static void ephash_remove(node *n, endpoint *endpt)
+{
+  endpoint **ep;
+  assert(NODE_ALREADY_LOCKED(n));
+  pthread_rwlock_wrlock(&n->p->eplock);
+  for (ep = &n->p->ephash[endpt->epid.localid % ENDPOINT_HASH_SIZE]; *ep; ep = &(*ep)->p->hashnext) {
+    if (*ep == endpt) {
+      *ep = endpt->p->hashnext;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&n->p->eplock);
+}
+
 void got_message(node *n, const msgheader *hdr, endpointid source,
                  uint32_t tag, uint32_t size, const void *data)
 {
@@ -206,6 +238,7 @@ connection *add_connection(node *n, const char *hostname, in_addr_t ip, listener
   assert(IO_ID == n->iothid.localid);
   conn->sockid.coordid = n->iothid;
   conn->sockid.sid = n->p->nextsid++;
+  conn->ioth = conn->sockid.sid % n->p->niothreads;
   conn->hostname = strdup(hostname);
   conn->ip = ip;
   conn->sock = -1;
@@ -224,15 +257,77 @@ connection *add_connection(node *n, const char *hostname, in_addr_t ip, listener
   return conn;
 }
 
+/* Allow as many open connections as the system will let us have */
+static void raise_fd_limit(void)
+{
+  struct rlimit rl;
+  if ((0 == getrlimit(RLIMIT_NOFILE,&rl)) && (rl.rlim_cur < rl.rlim_max)) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE,&rl);
+  }
+}
+
+static void iothread_init(node *n, iothread *ioth, int index)
+{
+  ioth->n = n;
+  ioth->index = index;
+  ioth->readbuf = (char*)malloc(n->iosize);
+
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+
+  if (0 > (ioth->epfd = epoll_create(1024))) {
+    perror("epoll_create");
+    exit(1);
+  }
+
+  if (0 > (ioth->wakefd_read = eventfd(0,0))) {
+    perror("eventfd");
+    exit(1);
+  }
+  ioth->wakefd_write = ioth->wakefd_read;
+
+  memset(&ev,0,sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = EP_WAKEUP;
+  if (0 > epoll_ctl(ioth->epfd,EPOLL_CTL_ADD,ioth->wakefd_read,&ev)) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+#else
+  int pipefds[2];
+
+  if (0 > pipe(pipefds)) {
+    perror("pipe");
+    exit(1);
+  }
+  ioth->wakefd_read = pipefds[0];
+  ioth->wakefd_write = pipefds[1];
+#endif
+}
+
+static void iothread_destroy(iothread *ioth)
+{
+  close(ioth->wakefd_read);
+  if (ioth->wakefd_write != ioth->wakefd_read)
+    close(ioth->wakefd_write);
+#ifdef USE_EPOLL
+  close(ioth->epfd);
+#endif
+  free(ioth->readbuf);
+}
+
 static node *node_new(int loglevel)
 {
   node *n = (node*)calloc(1,sizeof(node));
-  int pipefds[2];
   char *logenv;
+  char *iothenv;
+  int i;
 
   n->p = (node_private*)calloc(1,sizeof(node_private));
   init_mutex(&n->p->lock);
   init_mutex(&n->clock_lock);
+  pthread_rwlock_init(&n->p->eplock,NULL);
   pthread_cond_init(&n->p->closecond,NULL);
   n->p->nextlocalid = FIRST_ID;
   n->p->nextsid = 2;
@@ -241,12 +336,28 @@ static node *node_new(int loglevel)
   if (0 > determine_ip(&n->listenip))
     exit(1);
 
-  if (0 > pipe(pipefds)) {
-    perror("pipe");
-    exit(1);
+  n->p->niothreads = 1;
+  if (NULL != (iothenv = getenv("IO_THREADS"))) {
+    char *end = NULL;
+    n->p->niothreads = strtol(iothenv,&end,10);
+    if (('\0' == *iothenv) || ('\0' != *end) ||
+        (1 > n->p->niothreads) || (MAX_IOTHREADS < n->p->niothreads)) {
+      fprintf(stderr,"Invalid number of I/O threads: %s\n",iothenv);
+      exit(1);
+    }
+#ifndef USE_EPOLL
+    n->p->niothreads = 1;
+#endif
   }
-  n->p->ioready_readfd = pipefds[0];
-  n->p->ioready_writefd = pipefds[1];
+  for (i = 0; i < n->p->niothreads; i++)
+    iothread_init(n,&n->p->iothreads[i],i);
+
+#ifdef USE_SHMRING
+  char *shmenv = getenv("SHM_TRANSPORT");
+  n->p->useshm = ((NULL == shmenv) || strcmp(shmenv,"0"));
+#endif
+
+  raise_fd_limit();
   n->p->logfile = stderr;
   n->p->loglevel = loglevel;
 
@@ -285,24 +396,27 @@ static node *node_new(int loglevel)
 
 static void node_free(node *n)
 {
+  int i;
   if (n->p->mainl) {
     lock_node(n);
     node_remove_listener(n,n->p->mainl);
     unlock_node(n);
   }
-  node_close_pending(n);
+  for (i = 0; i < n->p->niothreads; i++) {
+    node_close_pending(n,&n->p->iothreads[i]);
+    iothread_destroy(&n->p->iothreads[i]);
+  }
   list_free(n->p->stats,free);
   assert(NULL == n->p->endpoints.first);
   assert(NULL == n->p->listeners.first);
 
-  close(n->p->ioready_readfd);
-  close(n->p->ioready_writefd);
   list_free(n->p->servers,free);
   portset_destroy(&n->p->outports);
   node_log(n,LOG_INFO,"Shutdown complete");
   pthread_cond_destroy(&n->p->closecond);
   destroy_mutex(&n->clock_lock);
   destroy_mutex(&n->p->lock);
+  pthread_rwlock_destroy(&n->p->eplock);
   free(n->p);
   free(n);
 }
@@ -340,6 +454,13 @@ static void node_show_netstats(node *n)
     sprintf(ipstr,IP_FORMAT":%u",IP_ARGS(ns->ip),ns->port);
     node_log(n,LOG_INFO,"NETSTATS %-21s %-9u %-9u",ipstr,ns->totalwritten,ns->totalread);
   }
+
+  /* Bytes copied between buffers in the I/O threads, as opposed to being read into or written
+     from the messages exchanged with the task */
+  node_log(n,LOG_INFO,"I/O: read %lld bytes, wrote %lld bytes, copied %lld bytes (%.0f per MB transferred)",
+           n->p->bytesread,n->p->byteswritten,n->p->bytescopied,
+           (0 < n->p->bytesread+n->p->byteswritten) ?
+           MB*(double)n->p->bytescopied/(n->p->bytesread+n->p->byteswritten) : 0.0);
 }
 
 static void node_show_msg_hist(node *n)
@@ -355,8 +476,10 @@ static void node_show_msg_hist(node *n)
 
 void node_run(node *n)
 {
-  if (0 != pthread_join(n->p->iothread,NULL))
-    fatal("pthread_join: %s",strerror(errno));
+  int i;
+  for (i = 0; i < n->p->niothreads; i++)
+    if (0 != pthread_join(n->p->iothreads[i].thread,NULL))
+      fatal("pthread_join: %s",strerror(errno));
   node_close_endpoints(n);
   node_close_connections(n);
   node_show_netstats(n);
@@ -387,17 +510,12 @@ void node_log(node *n, int level, const char *format, ...)
   free(newfmt);
 }
 
-listener *node_listen_locked(node *n, in_addr_t ip, int port, int notify, void *data,
-                             int dontaccept, int ismain, endpointid *owner, char *errmsg,
-                             int errlen)
+static int open_listener_socket(in_addr_t ip, int port, int reuseport,
+                                char *errmsg, int errlen)
 {
   int fd;
-  int actualport = 0;
   int yes = 1;
   struct sockaddr_in local_addr;
-  struct sockaddr_in new_addr;
-  socklen_t new_size = sizeof(struct sockaddr_in);
-  listener *l;
 
   local_addr.sin_family = AF_INET;
   local_addr.sin_port = htons(port);
@@ -406,32 +524,68 @@ listener *node_listen_locked(node *n, in_addr_t ip, int port, int notify, void *
 
   if (-1 == (fd = socket(AF_INET,SOCK_STREAM,0))) {
     snprintf(errmsg,errlen,"socket: %s",strerror(errno));
-    return NULL;
+    return -1;
   }
 
   if (-1 == setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(int))) {
     snprintf(errmsg,errlen,"setsockopt: %s",strerror(errno));
     close(fd);
-    return NULL;
+    return -1;
   }
 
-  if (-1 == bind(fd,(struct sockaddr*)&local_addr,sizeof(struct sockaddr))) {
-    snprintf(errmsg,errlen,"bind: %s",strerror(errno));
+#ifdef SO_REUSEPORT
+  if (reuseport && (-1 == setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&yes,sizeof(int)))) {
+    snprintf(errmsg,errlen,"setsockopt SO_REUSEPORT: %s",strerror(errno));
     close(fd);
-    return NULL;
+    return -1;
   }
+#endif
 
-  if (0 > getsockname(fd,(struct sockaddr*)&new_addr,&new_size)) {
-    snprintf(errmsg,errlen,"getsockname: %s",strerror(errno));
+  if (-1 == bind(fd,(struct sockaddr*)&local_addr,sizeof(struct sockaddr))) {
+    snprintf(errmsg,errlen,"bind: %s",strerror(errno));
     close(fd);
-    return NULL;
+    return -1;
   }
-  actualport = ntohs(new_addr.sin_port);
 
   if (-1 == listen(fd,LISTEN_BACKLOG)) {
     snprintf(errmsg,errlen,"listen: %s",strerror(errno));
     close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* When there are multiple I/O threads, each has its own socket bound to the same port, and the
+   kernel distributes incoming connections between them */
+listener *node_listen_locked(node *n, in_addr_t ip, int port, int notify, void *data,
+                             int dontaccept, int ismain, endpointid *owner, char *errmsg,
+                             int errlen)
+{
+  int fds[MAX_IOTHREADS];
+  int reuseport = (1 < n->p->niothreads);
+  int actualport = 0;
+  struct sockaddr_in new_addr;
+  socklen_t new_size = sizeof(struct sockaddr_in);
+  listener *l;
+  int i;
+
+  if (0 > (fds[0] = open_listener_socket(ip,port,reuseport,errmsg,errlen)))
     return NULL;
+
+  if (0 > getsockname(fds[0],(struct sockaddr*)&new_addr,&new_size)) {
+    snprintf(errmsg,errlen,"getsockname: %s",strerror(errno));
+    close(fds[0]);
+    return NULL;
+  }
+  actualport = ntohs(new_addr.sin_port);
+
+  for (i = 1; i < n->p->niothreads; i++) {
+    if (0 > (fds[i] = open_listener_socket(ip,actualport,reuseport,errmsg,errlen))) {
+      while (0 <= --i)
+        close(fds[i]);
+      return NULL;
+    }
   }
 
   assert((0 == port) || (actualport == port));
@@ -439,7 +593,7 @@ listener *node_listen_locked(node *n, in_addr_t ip, int port, int notify, void *
   l = (listener*)calloc(1,sizeof(listener));
   l->ip = ip;
   l->port = actualport;
-  l->fd = fd;
+  memcpy(l->fds,fds,n->p->niothreads*sizeof(int));
   l->notify = notify;
   l->data = data;
   l->dontaccept = dontaccept;
@@ -458,6 +612,7 @@ listener *node_listen_locked(node *n, in_addr_t ip, int port, int notify, void *
   l->sockid.coordid = n->iothid;
   l->sockid.sid = n->p->nextsid++;
   llist_append(&n->p->listeners,l);
+  watch_listener(n,l);
   node_notify(n);
 
   return l;
@@ -466,6 +621,7 @@ listener *node_listen_locked(node *n, in_addr_t ip, int port, int notify, void *
 void node_remove_listener(node *n, listener *l)
 {
   connection *conn;
+  int i;
   assert(NODE_ALREADY_LOCKED(n));
   /* No need to check waiting connections here, since these are outgoing only, and thus
      don't have a listener associated with them */
@@ -478,20 +634,30 @@ void node_remove_listener(node *n, listener *l)
   }
 
   llist_remove(&n->p->listeners,l);
+  unwatch_listener(n,l);
   node_notify(n);
 
-  list_push(&n->p->toclose,(void*)l->fd);
+  for (i = 0; i < n->p->niothreads; i++)
+    node_close_later(n,i,l->fds[i]);
   free(l);
 }
 
-void node_close_pending(node *n)
+/* Arrange for a socket to be closed by the I/O thread that services it */
+void node_close_later(node *n, int ioth, int fd)
+{
+  assert(NODE_ALREADY_LOCKED(n));
+  list_push(&n->p->iothreads[ioth].toclose,(void*)(intptr_t)fd);
+  iothread_wake(&n->p->iothreads[ioth]);
+}
+
+void node_close_pending(node *n, iothread *ioth)
 {
-  while (n->p->toclose) {
-    int fd = (int)n->p->toclose->data;
-    list *next = n->p->toclose->next;
+  while (ioth->toclose) {
+    int fd = (int)(intptr_t)ioth->toclose->data;
+    list *next = ioth->toclose->next;
     close(fd);
-    free(n->p->toclose);
-    n->p->toclose = next;
+    free(ioth->toclose);
+    ioth->toclose = next;
   }
 }
 
@@ -595,6 +761,7 @@ void node_send_locked(node *n, uint32_t sourcelocalid, endpointid destendpointid
 {
   connection *conn;
   msgheader hdr;
+  unsigned char wireversion = WIRE_VERSION;
 
   assert(NODE_ALREADY_LOCKED(n));
   assert(n->listenport == n->p->mainl->port);
@@ -635,6 +802,7 @@ void node_send_locked(node *n, uint32_t sourcelocalid, endpointid destendpointid
 
       assert(n->listenport == n->p->mainl->port);
       array_append(conn->sendbuf,&n->listenport,sizeof(unsigned short));
+      array_append(conn->sendbuf,&wireversion,sizeof(unsigned char));
 
       array_append(conn->sendbuf,&hdr,sizeof(msgheader));
       array_append(conn->sendbuf,data,size);
@@ -646,6 +814,15 @@ void node_send_locked(node *n, uint32_t sourcelocalid, endpointid destendpointid
     else {
       array_append(conn->sendbuf,&hdr,sizeof(msgheader));
       array_append(conn->sendbuf,data,size);
+#ifdef USE_SHMRING
+      /* Nodes on the same host can be given the message directly, without the I/O thread */
+      if (conn->txring && conn->txring->active) {
+        shmring_flush(n,conn);
+        watch_connection(conn);
+        return;
+      }
+#endif
+      watch_connection(conn);
     }
     node_notify(n);
   }
@@ -653,22 +830,34 @@ void node_send_locked(node *n, uint32_t sourcelocalid, endpointid destendpointid
 
 void node_shutdown(node *n)
 {
+  int i;
   lock_node(n);
   n->p->shutdown = 1;
-  node_notify(n);
+  for (i = 0; i < n->p->niothreads; i++)
+    iothread_wake(&n->p->iothreads[i]);
   unlock_node(n);
 }
 
-void node_notify(node *n)
+/* Wake up the I/O thread if it is blocked waiting for events. The same 8-byte value is used for
+   both eventfds and pipes, since a write of this size to a pipe is atomic. */
+void iothread_wake(iothread *ioth)
 {
-  char c = 1;
-  assert(NODE_ALREADY_LOCKED(n));
-  if (!n->p->notified) {
-    write(n->p->ioready_writefd,&c,1);
-    n->p->notified = 1;
+  uint64_t c = 1;
+  assert(NODE_ALREADY_LOCKED(ioth->n));
+  if (!ioth->notified) {
+    write(ioth->wakefd_write,&c,sizeof(c));
+    ioth->notified = 1;
   }
 }
 
+/* Only the first I/O thread processes messages and starts outgoing connections, so it is the only
+   one that needs to be told about these. Changes to the events a connection is waiting for are
+   made directly to the epoll set of its thread, which does not require a wakeup. */
+void node_notify(node *n)
+{
+  iothread_wake(&n->p->iothreads[0]);
+}
+
 static void *endpoint_thread(void *data)
 {
   endpoint *endpt = (endpoint*)data;
@@ -692,18 +881,14 @@ static void *endpoint_thread(void *data)
     }
   }
   llist_remove(&n->p->endpoints,endpt);
+  ephash_remove(n,endpt);
   pthread_cond_broadcast(&n->p->closecond);
 
-  /* Free data */
-  while (NULL != endpt->p->mailbox.first) {
-    message *next = endpt->p->mailbox.first->next;
-    message_free(endpt->p->mailbox.first);
-    endpt->p->mailbox.first = next;
-  }
+  /* Free data. No more messages can be added to the mailbox, since the endpoint can no longer be
+     found by senders, and any sender on the fast path has released eplock. */
+  mailbox_destroy(&endpt->p->mailbox);
   list_free(endpt->p->inlinks,free);
   list_free(endpt->p->outlinks,free);
-  destroy_mutex(&endpt->p->mailbox.lock);
-  pthread_cond_destroy(&endpt->p->mailbox.cond);
   free(endpt->p->type);
   free(endpt->p);
   free(endpt);
@@ -739,14 +924,14 @@ static endpointid node_add_thread_locked(node *n, const char *type,
   /* Create endpoint */
   endpt = (endpoint*)calloc(1,sizeof(endpoint));
   endpt->p = (endpoint_private*)calloc(1,sizeof(endpoint_private));
-  init_mutex(&endpt->p->mailbox.lock);
-  pthread_cond_init(&endpt->p->mailbox.cond,NULL);
+  mailbox_init(&endpt->p->mailbox);
   endpt->epid = epid;
   endpt->p->type = strdup(type);
   endpt->p->data = arg;
   endpt->n = n;
   endpt->p->fun = fun;
   llist_append(&n->p->endpoints,endpt);
+  ephash_add(n,endpt);
 
   /* Start thread */
   if (0 != pthread_attr_init(&attr))
@@ -926,6 +1111,18 @@ void endpoint_interrupt(endpoint *endpt) /* Can be called from native code */
     node_notify(endpt->n);
 }
 
+/* Adds a message to an endpoint's mailbox and wakes it up. This doesn't require the node lock,
+   except for the I/O endpoint, which is woken via node_notify(). */
+static void endpoint_deliver(endpoint *endpt, message *msg)
+{
+  if (endpt->p->closed) {
+    message_free(msg);
+    return;
+  }
+  mailbox_add(&endpt->p->mailbox,msg);
+  endpoint_interrupt(endpt);
+}
+
 static void endpoint_add_message(endpoint *endpt, message *msg)
 {
   assert(NODE_ALREADY_LOCKED(endpt->n));
@@ -951,13 +1148,7 @@ static void endpoint_add_message(endpoint *endpt, message *msg)
       endpoint_list_remove(&endpt->p->outlinks,eem->epid);
     }
 
-    lock_mutex(&endpt->p->mailbox.lock);
-    if (!endpt->p->closed) {
-      llist_append(&endpt->p->mailbox,msg);
-      endpoint_interrupt(endpt);
-      pthread_cond_broadcast(&endpt->p->mailbox.cond);
-    }
-    unlock_mutex(&endpt->p->mailbox.lock);
+    endpoint_deliver(endpt,msg);
   }
 }
 
@@ -966,38 +1157,111 @@ void endpoint_send_locked(endpoint *endpt, endpointid dest, int tag, const void
   node_send_locked(endpt->n,endpt->epid.localid,dest,tag,data,size);
 }
 
+/* Messages between endpoints in the same process, such as FISH and FETCH between co-located
+   tasks, are added directly to the destination's mailbox without taking the node lock. Only a read
+   lock on the endpoint table is needed, to stop the destination going away in the meantime. Link
+   management messages and messages to the I/O thread take the normal path. */
+static int can_send_fast(node *n, endpointid dest, uint32_t tag)
+{
+  return ((dest.ip == n->listenip) && (dest.port == n->listenport) && (IO_ID != dest.localid) &&
+          (MSG_LINK != tag) && (MSG_UNLINK != tag) && (MSG_ENDPOINT_EXIT != tag));
+}
+
+static int endpoint_send_fast(endpoint *endpt, endpointid dest, uint32_t tag, message *msg)
+{
+  node *n = endpt->n;
+  endpoint *destendpt;
+
+  pthread_rwlock_rdlock(&n->p->eplock);
+  if (NULL == (destendpt = find_endpoint(n,dest.localid))) {
+    pthread_rwlock_unlock(&n->p->eplock);
+    return 0;
+  }
+
+  lock_mutex(&n->clock_lock);
+  n->clock++;
+  unlock_mutex(&n->clock_lock);
+  msg->next = NULL;
+  msg->prev = NULL;
+  msg->source = endpt->epid;
+  msg->dest = dest;
+  msg->tag = tag;
+  endpoint_deliver(destendpt,msg);
+  pthread_rwlock_unlock(&n->p->eplock);
+  return 1;
+}
+
 void endpoint_send(endpoint *endpt, endpointid dest, uint32_t tag, const void *data, uint32_t size)
 {
+  if (can_send_fast(endpt->n,dest,tag)) {
+    message *msg = message_alloc(size);
+    memcpy(msg->data,data,size);
+    if (endpoint_send_fast(endpt,dest,tag,msg))
+      return;
+    message_free(msg); /* destination doesn't exist; let node_send_locked() deal with it */
+  }
+
   lock_node(endpt->n);
   node_send_locked(endpt->n,endpt->epid.localid,dest,tag,data,size);
   unlock_node(endpt->n);
 }
 
-message *endpoint_receive(endpoint *endpt, int delayms)
+/* Allocates a message with room for size bytes of data, which the caller fills in before passing
+   it to endpoint_send_message() or node_send_message_locked() */
+message *message_alloc(uint32_t size)
+{
+  message *msg = (message*)malloc(sizeof(message)+size);
+  memset(msg,0,sizeof(message));
+  msg->size = size;
+  return msg;
+}
+
+/* Like node_send_locked(), but takes ownership of a message obtained from message_alloc(). If
+   the destination is a local endpoint, the message is added to its mailbox directly, so the data
+   is never copied. This is used for I/O data passing between tasks and the I/O threads. */
+void node_send_message_locked(node *n, uint32_t sourcelocalid, endpointid dest,
+                              uint32_t tag, message *msg)
 {
-  message *msg;
-  lock_mutex(&endpt->p->mailbox.lock);
+  endpoint *endpt = NULL;
 
-  if ((NULL == endpt->p->mailbox.first) && (0 != delayms) && !endpt->p->closed) {
-    if (0 > delayms) {
-      pthread_cond_wait(&endpt->p->mailbox.cond,&endpt->p->mailbox.lock);
-    }
-    else if (0 < delayms) {
-      struct timeval now;
-      struct timespec abstime;
-      gettimeofday(&now,NULL);
-      now = timeval_addms(now,delayms);
-      abstime.tv_sec = now.tv_sec;
-      abstime.tv_nsec = now.tv_usec * 1000;
-      pthread_cond_timedwait(&endpt->p->mailbox.cond,&endpt->p->mailbox.lock,&abstime);
-    }
+  assert(NODE_ALREADY_LOCKED(n));
+
+  if ((dest.ip == n->listenip) && (dest.port == n->listenport) &&
+      (MSG_LINK != tag) && (MSG_UNLINK != tag))
+    endpt = find_endpoint(n,dest.localid);
+
+  if (NULL == endpt) {
+    node_send_locked(n,sourcelocalid,dest,tag,msg->data,msg->size);
+    message_free(msg);
+    return;
   }
 
-  msg = endpt->p->mailbox.first;
-  if (NULL != msg)
-    llist_remove(&endpt->p->mailbox,msg);
-  unlock_mutex(&endpt->p->mailbox.lock);
-  return msg;
+  lock_mutex(&n->clock_lock);
+  n->clock++;
+  unlock_mutex(&n->clock_lock);
+
+  msg->next = NULL;
+  msg->prev = NULL;
+  msg->source.ip = n->listenip;
+  msg->source.port = n->listenport;
+  msg->source.localid = sourcelocalid;
+  msg->dest = dest;
+  msg->tag = tag;
+  endpoint_add_message(endpt,msg);
+}
+
+void endpoint_send_message(endpoint *endpt, endpointid dest, uint32_t tag, message *msg)
+{
+  if (can_send_fast(endpt->n,dest,tag) && endpoint_send_fast(endpt,dest,tag,msg))
+    return;
+  lock_node(endpt->n);
+  node_send_message_locked(endpt->n,endpt->epid.localid,dest,tag,msg);
+  unlock_node(endpt->n);
+}
+
+message *endpoint_receive(endpoint *endpt, int delayms)
+{
+  return mailbox_receive(&endpt->p->mailbox,endpt->p->closed ? 0 : delayms);
 }
 
 int endpointid_equals(const endpointid *e1, const endpointid *e2)
@@ -1036,6 +1300,7 @@ serverinfo *get_serverinfo(node *n, in_addr_t ip)
 
   serverinfo *si = (serverinfo*)calloc(1,sizeof(serverinfo));
   si->ip = ip;
+  si->samehost = ((ip == n->listenip) || (127 == ((unsigned char*)&ip)[0]));
   list_push(&n->p->servers,si);
   return si;
 }
@@ -43,7 +43,8 @@
 #define MANAGER_ID      2
 #define MAIN_CHORD_ID   3
 #define JAVA_ID         4
-#define FIRST_ID        5
+#define FILEIO_ID       5
+#define FIRST_ID        6
 
 #define WORKER_PORT     6879
 
@@ -138,10 +139,12 @@ void endpoint_link(endpoint *endpt, endpointid to);
 void endpoint_unlink(endpoint *endpt, endpointid to);
 void endpoint_interrupt(endpoint *endpt);
 void endpoint_send(endpoint *endpt, endpointid dest, uint32_t tag, const void *data, uint32_t size);
+void endpoint_send_message(endpoint *endpt, endpointid dest, uint32_t tag, message *msg);
 message *endpoint_receive(endpoint *endpt, int delayms);
 int endpointid_equals(const endpointid *e1, const endpointid *e2);
 int endpointid_isnull(const endpointid *epid);
 
+message *message_alloc(uint32_t size);
 void message_free(message *msg);
 
 int socketid_equals(const socketid *a, const socketid *b);
@@ -177,6 +180,9 @@ extern const char *log_levels[LOG_COUNT];
 /* Console */
 #define MSG_CONSOLE_DATA        2147483628
 
+/* Shared memory transport; handled by the I/O thread of the receiving node */
+#define MSG_SHM_OFFER           2147483627
+
 /* I/O messages */
 
 typedef struct {
@@ -55,6 +55,7 @@ void notify_accept(node *n, connection *conn)
   conn->dontread = 1;
   conn->owner = l->owner;
   conn->isreg = 1;
+  watch_connection(conn);
 
   /* send message */
   assert(0 != l->accept_frameid);
@@ -69,6 +70,7 @@ void notify_accept(node *n, connection *conn)
   l->accept_frameid = 0;
   assert(!l->dontaccept);
   l->dontaccept = 1;
+  watch_listener(n,l);
   node_notify(n);
 }
 
@@ -99,20 +101,21 @@ void notify_connect(node *n, connection *conn, int error)
 void notify_read(node *n, connection *conn)
 {
   if (conn->isreg && (0 < conn->frameids[READ_FRAMEADDR])) {
-    int rrmlen = sizeof(read_response_msg)+conn->recvbuf->nbytes;
-    read_response_msg *rrm = (read_response_msg*)malloc(rrmlen);
+    message *msg = message_alloc(sizeof(read_response_msg)+conn->recvbuf->nbytes);
+    read_response_msg *rrm = (read_response_msg*)msg->data;
 
     rrm->ioid = conn->frameids[READ_FRAMEADDR];
     rrm->sockid = conn->sockid;
     rrm->len = conn->recvbuf->nbytes;
     memcpy(rrm->data,conn->recvbuf->data,conn->recvbuf->nbytes);
+    n->p->bytescopied += conn->recvbuf->nbytes;
 
-    node_send_locked(n,IO_ID,conn->owner,MSG_READ_RESPONSE,rrm,rrmlen);
+    node_send_message_locked(n,IO_ID,conn->owner,MSG_READ_RESPONSE,msg);
 
     conn->frameids[READ_FRAMEADDR] = 0;
     conn->recvbuf->nbytes = 0;
     conn->dontread = 1;
-    free(rrm);
+    watch_connection(conn);
   }
 }
 
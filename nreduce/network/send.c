@@ -74,16 +74,17 @@ void send_read(endpoint *endpt, socketid sid, int ioid)
   endpoint_send(endpt,sid.coordid,MSG_READ,&rm,sizeof(rm));
 }
 
+/* The data is copied directly into the message that is delivered to the I/O thread, which
+   will usually write it to the socket straight from there */
 void send_write(endpoint *endpt, socketid sockid, int ioid, const char *data, int len)
 {
-  int msglen = sizeof(write_msg)+len;
-  write_msg *wm = (write_msg*)malloc(msglen);
+  message *msg = message_alloc(sizeof(write_msg)+len);
+  write_msg *wm = (write_msg*)msg->data;
   wm->sockid = sockid;
   wm->ioid = ioid;
   wm->len = len;
   memcpy(wm->data,data,len);
-  endpoint_send(endpt,sockid.coordid,MSG_WRITE,wm,msglen);
-  free(wm);
+  endpoint_send_message(endpt,sockid.coordid,MSG_WRITE,msg);
 }
 
 void send_delete_connection(endpoint *endpt, socketid sockid)
@@ -0,0 +1,386 @@
+/*
+ * This file is part of the NReduce project
+ * Copyright (C) 2006-2010 Peter Kelly <kellypmk@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * $Id$
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "netprivate.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#ifdef USE_SHMRING
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Each direction of a connection between two nodes on the same host may be carried by a
+   single-producer single-consumer byte ring in a POSIX shared memory segment. The bytes that go
+   through it are exactly those that would otherwise have been written to the socket, so the
+   receiving side parses them with the same code.
+
+   Once a node has completed the handshake with a peer on the same host, it creates a ring for the
+   data it sends, and sends a SHM_OFFER message over the socket naming it. Everything it sends
+   after that goes through the ring. The receiver only starts reading from the ring once it has
+   processed the offer, so messages are delivered in the order they were sent.
+
+   Each ring has two FIFOs associated with it, which are used as doorbells. The sender writes to
+   one when it adds data to a ring that the receiver has found to be empty, and the receiver
+   writes to the other when it frees up space in a ring the sender has found to be full. The
+   read end of each is watched by the appropriate I/O thread's epoll set. The flags in the header
+   ensure that neither side makes a system call as long as the other is keeping up. */
+
+#ifdef USE_SHMRING
+
+/* The segment and FIFOs are named after the process that created them and the sid of the
+   connection, which together are unique on the host */
+static void shmring_names(shmring *ring, char *shmname, char *dname, char *sname)
+{
+  sprintf(shmname,"/nreduce-%d-%u",ring->pid,ring->sid);
+  sprintf(dname,SHMRING_DIR"/nreduce-%d-%u.d",ring->pid,ring->sid);
+  sprintf(sname,SHMRING_DIR"/nreduce-%d-%u.s",ring->pid,ring->sid);
+}
+
+static void shmring_unlink(shmring *ring)
+{
+  char shmname[100];
+  char dname[100];
+  char sname[100];
+  shmring_names(ring,shmname,dname,sname);
+  shm_unlink(shmname);
+  unlink(dname);
+  unlink(sname);
+}
+
+static void shmring_free(node *n, int ioth, shmring *ring)
+{
+  if (NULL != ring->hdr)
+    munmap(ring->hdr,sizeof(shmring_header)+ring->size);
+  if (0 <= ring->bellfd)
+    node_close_later(n,ioth,ring->bellfd);
+  if (0 <= ring->waitfd)
+    node_close_later(n,ioth,ring->waitfd);
+  if (ring->owner)
+    shmring_unlink(ring);
+  free(ring);
+}
+
+static shmring *shmring_new(void)
+{
+  shmring *ring = (shmring*)calloc(1,sizeof(shmring));
+  ring->bellfd = -1;
+  ring->waitfd = -1;
+  return ring;
+}
+
+/* Maps the segment and opens the doorbells. The FIFOs are opened for both reading and writing so
+   that neither end has to wait for the other to open them, and so that a doorbell rung before
+   the receiver has opened the FIFO is not lost. */
+static int shmring_open(shmring *ring, int create, int pid, uint32_t sid, uint32_t size,
+                        char *errmsg, int errlen)
+{
+  char shmname[100];
+  char dname[100];
+  char sname[100];
+  int fd;
+  struct stat statbuf;
+  int flags = create ? (O_RDWR|O_CREAT|O_EXCL) : O_RDWR;
+
+  ring->pid = pid;
+  ring->sid = sid;
+  ring->size = size;
+  shmring_names(ring,shmname,dname,sname);
+
+  /* Positions are running counts that wrap around at 2^32, so the size must divide this */
+  if ((0 == size) || (0 != (size & (size-1)))) {
+    snprintf(errmsg,errlen,"invalid ring size %u",size);
+    return -1;
+  }
+
+  if (0 > (fd = shm_open(shmname,flags,0600))) {
+    snprintf(errmsg,errlen,"shm_open(%s): %s",shmname,strerror(errno));
+    return -1;
+  }
+  ring->owner = create;
+
+  if (create && (0 > ftruncate(fd,sizeof(shmring_header)+size))) {
+    snprintf(errmsg,errlen,"ftruncate: %s",strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if ((0 > fstat(fd,&statbuf)) || (statbuf.st_size < (off_t)(sizeof(shmring_header)+size))) {
+    snprintf(errmsg,errlen,"%s is too small",shmname);
+    close(fd);
+    return -1;
+  }
+
+  ring->hdr = (shmring_header*)mmap(NULL,sizeof(shmring_header)+size,PROT_READ|PROT_WRITE,
+                                    MAP_SHARED,fd,0);
+  close(fd);
+  if (MAP_FAILED == ring->hdr) {
+    ring->hdr = NULL;
+    snprintf(errmsg,errlen,"mmap: %s",strerror(errno));
+    return -1;
+  }
+  ring->data = (char*)&ring->hdr[1];
+
+  if (create && ((0 > mkfifo(dname,0600)) || (0 > mkfifo(sname,0600)))) {
+    snprintf(errmsg,errlen,"mkfifo: %s",strerror(errno));
+    return -1;
+  }
+
+  /* The sender rings the data doorbell and waits on the space doorbell; the receiver does the
+     opposite */
+  ring->bellfd = open(create ? dname : sname,O_RDWR|O_NONBLOCK);
+  ring->waitfd = open(create ? sname : dname,O_RDWR|O_NONBLOCK);
+  if ((0 > ring->bellfd) || (0 > ring->waitfd)) {
+    snprintf(errmsg,errlen,"open fifo: %s",strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void shmring_ring(shmring *ring)
+{
+  char c = 0;
+  /* If the FIFO is full, the other side has plenty of wakeups pending already */
+  if ((0 > write(ring->bellfd,&c,1)) && (EAGAIN != errno))
+    fatal("write to doorbell: %s",strerror(errno));
+}
+
+/* Called once the handshake with a node on the same host has been completed. The offer is queued
+   behind whatever is already in the send buffer, and the ring only becomes active once all of that
+   has been written to the socket. If anything goes wrong we just carry on using TCP. */
+void shmring_offer(node *n, connection *conn)
+{
+  shmring *ring = shmring_new();
+  char errmsg[ERRMSG_MAX+1];
+  shm_offer_msg som;
+  msgheader hdr;
+
+  assert(NODE_ALREADY_LOCKED(n));
+  assert(NULL == conn->txring);
+
+  if (0 > shmring_open(ring,1,getpid(),conn->sockid.sid,SHMRING_SIZE,errmsg,ERRMSG_MAX)) {
+    errmsg[ERRMSG_MAX] = '\0';
+    node_log(n,LOG_WARNING,"Cannot use shared memory for %s:%d: %s",
+             conn->hostname,conn->port,errmsg);
+    shmring_free(n,conn->ioth,ring);
+    return;
+  }
+
+  ring->hdr->size = ring->size;
+  ring->hdr->readerwaiting = 1;
+
+  som.pid = getpid();
+  som.sid = conn->sockid.sid;
+  som.size = ring->size;
+
+  memset(&hdr,0,sizeof(msgheader));
+  hdr.size1 = sizeof(shm_offer_msg);
+  hdr.tag1 = MSG_SHM_OFFER;
+  array_append(conn->sendbuf,&hdr,sizeof(msgheader));
+  array_append(conn->sendbuf,&som,sizeof(shm_offer_msg));
+
+  ring->tcpbytes = conn->sendbuf->nbytes;
+  conn->txring = ring;
+  watch_connection(conn);
+}
+
+static int shmring_reject(node *n, connection *conn, const char *reason)
+{
+  node_log(n,LOG_ERROR,"Rejecting shared memory offer from %s:%d: %s",
+           conn->hostname,conn->port,reason);
+  snprintf(conn->errmsg,ERRMSG_MAX,"invalid shared memory offer: %s",reason);
+  conn->errmsg[ERRMSG_MAX] = '\0';
+  connection_fsm(conn,CE_ERROR);
+  return -1;
+}
+
+/* Called when the peer's offer is received. From this point on, anything else it sends us will
+   arrive through the ring. We remove the names straight away, since both of us have it open; the
+   segment and FIFOs will be freed once both nodes have closed them. An offer we did not expect is
+   treated as a protocol error, and the connection is closed. */
+int shmring_attach(node *n, connection *conn, const shm_offer_msg *som, uint32_t size)
+{
+  shmring *ring;
+  char errmsg[ERRMSG_MAX+1];
+
+  assert(NODE_ALREADY_LOCKED(n));
+
+  if (sizeof(shm_offer_msg) != size)
+    return shmring_reject(n,conn,"wrong message size");
+  if (!conn->si->samehost)
+    return shmring_reject(n,conn,"peer is not on this host");
+  if (NULL != conn->rxring)
+    return shmring_reject(n,conn,"already attached");
+
+  ring = shmring_new();
+  if (0 > shmring_open(ring,0,som->pid,som->sid,som->size,errmsg,ERRMSG_MAX)) {
+    errmsg[ERRMSG_MAX] = '\0';
+    node_log(n,LOG_ERROR,"Cannot attach to shared memory for %s:%d: %s",
+             conn->hostname,conn->port,errmsg);
+    shmring_free(n,conn->ioth,ring);
+    memcpy(conn->errmsg,errmsg,sizeof(conn->errmsg));
+    connection_fsm(conn,CE_ERROR);
+    return -1;
+  }
+  shmring_unlink(ring);
+
+  node_log(n,LOG_INFO,"Receiving from %s:%d through shared memory",conn->hostname,conn->port);
+  conn->rxring = ring;
+  watch_connection(conn);
+  return 0;
+}
+
+static void shmring_copy_in(shmring *ring, uint32_t pos, const char *src, uint32_t count)
+{
+  uint32_t offset = pos % ring->size;
+  uint32_t first = ring->size-offset;
+  if (first > count)
+    first = count;
+  memcpy(&ring->data[offset],src,first);
+  memcpy(ring->data,&src[first],count-first);
+}
+
+static void shmring_copy_out(shmring *ring, uint32_t pos, char *dest, uint32_t count)
+{
+  uint32_t offset = pos % ring->size;
+  uint32_t first = ring->size-offset;
+  if (first > count)
+    first = count;
+  memcpy(dest,&ring->data[offset],first);
+  memcpy(&dest[first],ring->data,count-first);
+}
+
+/* Moves as much of the send buffer into the ring as will fit. If the ring fills up, the rest is
+   left in the send buffer, and we will be called again when the receiver rings the space
+   doorbell. */
+void shmring_flush(node *n, connection *conn)
+{
+  shmring *ring = conn->txring;
+  shmring_header *hdr = ring->hdr;
+  array *buf = conn->sendbuf;
+  uint32_t total = 0;
+
+  assert(NODE_ALREADY_LOCKED(n));
+  assert(ring->active);
+
+  while (total < buf->nbytes) {
+    uint32_t head = hdr->head;
+    uint32_t space = ring->size-(head-hdr->tail);
+    uint32_t count = buf->nbytes-total;
+
+    if (0 == space) {
+      /* Ask to be told when there's room, then check once more in case the receiver made some
+         before it could see the flag */
+      hdr->writerwaiting = 1;
+      __sync_synchronize();
+      if (0 == ring->size-(head-hdr->tail))
+        break;
+      hdr->writerwaiting = 0;
+      continue;
+    }
+
+    if (count > space)
+      count = space;
+    shmring_copy_in(ring,head,&buf->data[total],count);
+    __sync_synchronize(); /* the data must be visible before the new head */
+    hdr->head = head+count;
+    total += count;
+  }
+
+  if (0 < total) {
+    array_remove_data(buf,total);
+    conn->totalwritten += total;
+    n->p->byteswritten += total;
+    __sync_synchronize();
+    if (hdr->readerwaiting && __sync_lock_test_and_set(&hdr->readerwaiting,0))
+      shmring_ring(ring);
+  }
+}
+
+/* Appends whatever is in the ring to the receive buffer, up to one ring's worth at a time. Returns
+   the number of bytes obtained; if this is 0, the ring was empty and the sender has been asked
+   to ring the data doorbell when it adds more. */
+int shmring_receive(node *n, connection *conn)
+{
+  shmring *ring = conn->rxring;
+  shmring_header *hdr = ring->hdr;
+  uint32_t tail = hdr->tail;
+  uint32_t avail;
+
+  assert(NODE_ALREADY_LOCKED(n));
+
+  while (0 == (avail = hdr->head-tail)) {
+    hdr->readerwaiting = 1;
+    __sync_synchronize();
+    if (hdr->head == tail)
+      return 0;
+    hdr->readerwaiting = 0;
+  }
+
+  __sync_synchronize(); /* don't read the data until we have seen the head that covers it */
+  array_mkroom(conn->recvbuf,avail);
+  shmring_copy_out(ring,tail,&conn->recvbuf->data[conn->recvbuf->nbytes],avail);
+  conn->recvbuf->nbytes += avail;
+  __sync_synchronize(); /* finish reading before the sender can overwrite the space */
+  hdr->tail = tail+avail;
+
+  conn->totalread += avail;
+  n->p->bytesread += avail;
+
+  __sync_synchronize();
+  if (hdr->writerwaiting && __sync_lock_test_and_set(&hdr->writerwaiting,0))
+    shmring_ring(ring);
+
+  return avail;
+}
+
+/* Discards the doorbell notifications that caused the FIFO to become readable */
+void shmring_clear_doorbell(shmring *ring)
+{
+  char buf[256];
+  while (0 < read(ring->waitfd,buf,sizeof(buf)))
+    ;
+}
+
+void shmring_close(node *n, connection *conn)
+{
+  assert(NODE_ALREADY_LOCKED(n));
+  if (NULL != conn->txring) {
+    shmring_free(n,conn->ioth,conn->txring);
+    conn->txring = NULL;
+  }
+  if (NULL != conn->rxring) {
+    shmring_free(n,conn->ioth,conn->rxring);
+    conn->rxring = NULL;
+  }
+}
+
+#endif
@@ -51,6 +51,7 @@
 #include <arpa/inet.h>
 
 extern int opt_postpone;
+extern int opt_readchunksize;
 
 static const char *numnames[4] = {"first", "second", "third", "fourth"};
 
@@ -677,6 +678,74 @@ int array_to_string(pntr refpntr, char **str)
   return ret;
 }
 
+/* Strings are normally built up as a chain of character arrays, each of which may be shared
+   between several strings (see b_arrayprefix). The following functions operate on such chains
+   directly, without converting them to another representation. */
+
+/* Returns the total length of a string that consists entirely of evaluated character arrays, or
+   -1 if it contains anything else */
+static int string_chunks_length(pntr p)
+{
+  int len = 0;
+  p = resolve_pntr(p);
+  while ((CELL_AREF == pntrtype(p)) && (1 == aref_array(p)->elemsize)) {
+    len += aref_array(p)->size-aref_index(p);
+    p = resolve_pntr(aref_tail(p));
+  }
+  return (CELL_NIL == pntrtype(p)) ? len : -1;
+}
+
+/* Returns the number of characters in the character arrays at the start of a string, counting
+   the first n characters and then as many whole arrays as have already been evaluated, up to a
+   total of max */
+static int evaluated_string_prefix(pntr p, int n, int max)
+{
+  int len = n;
+  if (n < aref_array(p)->size-aref_index(p))
+    return len;
+  p = resolve_pntr(aref_tail(p));
+  while ((CELL_AREF == pntrtype(p)) && (1 == aref_array(p)->elemsize)) {
+    int count = aref_array(p)->size-aref_index(p);
+    if (len+count > max)
+      break;
+    len += count;
+    p = resolve_pntr(aref_tail(p));
+  }
+  return len;
+}
+
+/* Copies the first n characters of a string, which must be made up of character arrays */
+static void copy_string_prefix(pntr p, int n, char *dest)
+{
+  while (0 < n) {
+    carray *arr = aref_array(p);
+    int index = aref_index(p);
+    int count = (n < arr->size-index) ? n : arr->size-index;
+    assert(1 == arr->elemsize);
+    memcpy(dest,&arr->elements[index],count);
+    dest += count;
+    n -= count;
+    p = resolve_pntr(aref_tail(p));
+  }
+}
+
+/* Returns the remainder of a string after the first n characters, which must be made up of
+   character arrays */
+static pntr skip_string_prefix(pntr p, int n)
+{
+  while (0 < n) {
+    carray *arr = aref_array(p);
+    int index = aref_index(p);
+    if (n < arr->size-index) {
+      make_aref_pntr(p,get_pntr(p),index+n);
+      break;
+    }
+    n -= arr->size-index;
+    p = resolve_pntr(aref_tail(p));
+  }
+  return p;
+}
+
 int flatten_list(pntr refpntr, pntr **data)
 {
   pntr p = refpntr;
@@ -907,6 +976,30 @@ static void b_restring(task *tsk, pntr *argstack)
      sent as a single unit. */
 
   char *str = NULL;
+  int len;
+
+  /* Common case: the string consists only of character arrays, which can be copied directly
+     into the new array */
+  if (0 <= (len = string_chunks_length(argstack[0]))) {
+    pntr p = resolve_pntr(argstack[0]);
+    cell *refcell;
+
+    if (0 == len) {
+      argstack[0] = tsk->globnilpntr;
+      return;
+    }
+
+    argstack[0] = create_array(tsk,1,len);
+    refcell = get_pntr(argstack[0]);
+    while (CELL_AREF == pntrtype(p)) {
+      carray *arr = aref_array(p);
+      int index = aref_index(p);
+      carray_append(tsk,&refcell,&arr->elements[index],arr->size-index,1);
+      p = resolve_pntr(aref_tail(p));
+    }
+    return;
+  }
+
   if (0 > array_to_string(argstack[0],&str)) {
 
     /* Check if the string ends in a REMOTEREF cell, and if so, send a fetch request for it */
@@ -998,11 +1091,14 @@ static void b_arrayprefix(task *tsk, pntr *argstack)
     if (n > arr->size-index)
       n = arr->size-index;
 
-    if ((n == arr->size-index) && (BUILDARRAY_THRESHOLD <= n)) {
+    if ((n == arr->size-index) &&
+        ((BUILDARRAY_THRESHOLD <= n) || ((1 == arr->elemsize) && (SHARESTRING_THRESHOLD <= n)))) {
       /* Optimisation: Instead of creating a new array with a copy of the data, simply
          create a new aref cell which references the existing array data. This means that
          the data can be shared, which is useful if the array is large and the copy is
-         part of another list. */
+         part of another list. For strings this is done for all but the smallest chunks, so
+         that append, which calls arrayprefix for each chunk, concatenates strings without
+         copying any characters. */
 
       cell *new_aref = alloc_cell(tsk);
       new_aref->type = CELL_AREF;
@@ -1032,43 +1128,62 @@ static void b_arraystrcmp(task *tsk, pntr *argstack)
   pntr a = argstack[1];
   pntr b = argstack[0];
 
-  /* If a and b are are both arrays with elemsize=1, and a nil tail, we can do a normal string
-     comparison */
-  if ((CELL_AREF == pntrtype(a)) && (CELL_AREF == pntrtype(b))) {
+  /* While a and b are both arrays with elemsize=1, we can do a normal string comparison. This
+     continues on to the next array in each string as long as it has already been evaluated. */
+  while ((CELL_AREF == pntrtype(a)) && (CELL_AREF == pntrtype(b))) {
     carray *aarr = aref_array(a);
     carray *barr = aref_array(b);
-    pntr atail = aref_tail(a);
-    pntr btail = aref_tail(b);
     int aindex = aref_index(a);
     int bindex = aref_index(b);
-    aref_resolve_tail(tsk,get_pntr(a));
-    aref_resolve_tail(tsk,get_pntr(b));
-    if ((1 == aarr->elemsize) && (1 == barr->elemsize) &&
-        (CELL_NIL == pntrtype(atail)) &&
-        (CELL_NIL == pntrtype(btail))) {
-
-      /* Compare character by character until we reach the end of either or both strings */
-      while ((aindex < aarr->size) && (bindex < barr->size)) {
-        if (aarr->elements[aindex] != barr->elements[bindex]) {
-          set_pntrdouble(argstack[0],(double)(aarr->elements[aindex] - barr->elements[bindex]));
-          return;
-        }
-        aindex++;
-        bindex++;
+    int count;
+    int i;
+
+    if ((1 != aarr->elemsize) || (1 != barr->elemsize))
+      break;
+
+    /* Compare character by character until we reach the end of either or both arrays */
+    count = aarr->size-aindex;
+    if (count > barr->size-bindex)
+      count = barr->size-bindex;
+    for (i = 0; i < count; i++) {
+      if (aarr->elements[aindex+i] != barr->elements[bindex+i]) {
+        set_pntrdouble(argstack[0],(double)(aarr->elements[aindex+i] - barr->elements[bindex+i]));
+        return;
       }
+    }
 
-      if (aindex < aarr->size)
-        set_pntrdouble(argstack[0],1);
-      else if (bindex < barr->size)
-        set_pntrdouble(argstack[0],-1);
-      else
-        set_pntrdouble(argstack[0],0);
-      return;
+    if (aindex+count < aarr->size) {
+      make_aref_pntr(a,get_pntr(a),aindex+count);
+    }
+    else {
+      aref_resolve_tail(tsk,get_pntr(a));
+      a = aref_tail(a);
+    }
+
+    if (bindex+count < barr->size) {
+      make_aref_pntr(b,get_pntr(b),bindex+count);
+    }
+    else {
+      aref_resolve_tail(tsk,get_pntr(b));
+      b = aref_tail(b);
     }
   }
 
-  /* Otherwise, have to fall back and treat them as cons lists */
-  argstack[0] = tsk->globnilpntr;
+  if ((CELL_NIL == pntrtype(a)) && (CELL_NIL == pntrtype(b))) {
+    set_pntrdouble(argstack[0],0);
+  }
+  else if ((CELL_NIL == pntrtype(b)) &&
+           ((CELL_AREF == pntrtype(a)) || (CELL_CONS == pntrtype(a)))) {
+    set_pntrdouble(argstack[0],1);
+  }
+  else if ((CELL_NIL == pntrtype(a)) &&
+           ((CELL_AREF == pntrtype(b)) || (CELL_CONS == pntrtype(b)))) {
+    set_pntrdouble(argstack[0],-1);
+  }
+  else {
+    /* Otherwise, have to fall back and treat them as cons lists */
+    argstack[0] = tsk->globnilpntr;
+  }
 }
 
 static void b_ntos(task *tsk, pntr *argstack)
@@ -1115,69 +1230,6 @@ static void b_testarray(task *tsk, pntr *argstack)
   argstack[0] = tsk->globnilpntr;
 }
 
-static void b_openfd(task *tsk, pntr *argstack)
-{
-  pntr filenamepntr = argstack[0];
-  char *filename;
-  int fd;
-  sysobject *so;
-
-  if (0 > array_to_string(filenamepntr,&filename)) {
-    set_error(tsk,"openfd: filename is not a string");
-    return;
-  }
-
-  if (0 > (fd = open(filename,O_RDONLY))) {
-    set_error(tsk,"%s: %s",filename,strerror(errno));
-    free(filename);
-    return;
-  }
-
-  so = new_sysobject(tsk,SYSOBJECT_FILE);
-  so->fd = fd;
-  make_pntr(argstack[0],so->c);
-
-  free(filename);
-}
-
-static void b_readchunk(task *tsk, pntr *argstack)
-{
-  pntr sopntr = argstack[1];
-  pntr nextpntr = argstack[0];
-  int r;
-  char buf[DEFAULT_IOSIZE];
-  sysobject *so;
-  cell *c;
-  int doclose = 0;
-
-  CHECK_SYSOBJECT_ARG(1,SYSOBJECT_FILE);
-  c = get_pntr(sopntr);
-  so = psysobject(sopntr);
-
-  /* FIXME: add migration check here? */
-  if (so->ownertid != tsk->tid) {
-    fatal("readchunk: should migrate to task %d",so->ownertid);
-  }
-
-  r = read(so->fd,buf,DEFAULT_IOSIZE);
-  if (0 == r) {
-    argstack[0] = tsk->globnilpntr;
-    doclose = 1;
-  }
-  if (0 > r) {
-    set_error(tsk,"Error reading file: %s",strerror(errno));
-    doclose = 1;
-  }
-
-  if (doclose) {
-    free_sysobject(tsk,so);
-    cell_make_ind(tsk,c,tsk->globnilpntr);
-    return;
-  }
-
-  argstack[0] = binary_data_to_list(tsk,buf,r,nextpntr);
-}
-
 static void b_readdir(task *tsk, pntr *argstack)
 {
   char *path;
@@ -1342,7 +1394,7 @@ static void migrate_to(task *tsk, int desttsk)
   node_log(tsk->n,LOG_DEBUG1,"send(%d->%d) SCHEDULE (migration: %s)",tsk->tid,desttsk,
            bc_function_name(tsk->bcdata,frame_fno(tsk,curf)));
 
-  newmsg = write_start();
+  newmsg = schedule_start(tsk,0);
   schedule_frame(tsk,curf,desttsk,newmsg);
   msg_send(tsk,desttsk,MSG_SCHEDULE,newmsg->data,newmsg->nbytes);
   write_end(newmsg);
@@ -1523,7 +1575,7 @@ Normal operation
 3. Manager records the ioid of the frame and enables reading on the connection
 4. Data arrives and is read from connection
 5. Worker sends READ_RESPONSE message to task
-6. Task handles READ_RESPONSE message, stores data in so->buf, and unblocks frame
+6. Task handles READ_RESPONSE message, keeps it in so->readmsg, and unblocks frame
 7. b_readcon() invoked again with curf->resume == 1, returns data to caller
 
 Error occurs during read
@@ -1587,7 +1639,8 @@ static void b_readcon(task *tsk, pntr *argstack)
 
       argstack[0] = binary_data_to_list(tsk,so->buf,so->len,nextpntr);
 
-      free(so->buf);
+      message_free(so->readmsg);
+      so->readmsg = NULL;
       so->buf = NULL;
       so->len = 0;
 
@@ -1599,6 +1652,218 @@ static void b_readcon(task *tsk, pntr *argstack)
   }
 }
 
+/* The reduction engine runs tasks without a node, and hence without the file I/O service, so in
+   that case files are opened and read directly */
+
+static void openfd_direct(task *tsk, pntr *argstack)
+{
+  pntr filenamepntr = argstack[0];
+  char *filename;
+  int fd;
+  sysobject *so;
+
+  if (0 > array_to_string(filenamepntr,&filename)) {
+    set_error(tsk,"openfd: filename is not a string");
+    return;
+  }
+
+  if (0 > (fd = open(filename,O_RDONLY))) {
+    set_error(tsk,"%s: %s",filename,strerror(errno));
+    free(filename);
+    return;
+  }
+
+  so = new_sysobject(tsk,SYSOBJECT_FILE);
+  so->fd = fd;
+  make_pntr(argstack[0],so->c);
+
+  free(filename);
+}
+
+static void readchunk_direct(task *tsk, pntr *argstack)
+{
+  pntr sopntr = argstack[1];
+  pntr nextpntr = argstack[0];
+  int r;
+  char buf[DEFAULT_IOSIZE];
+  sysobject *so;
+  cell *c;
+  int doclose = 0;
+
+  CHECK_SYSOBJECT_ARG(1,SYSOBJECT_FILE);
+  c = get_pntr(sopntr);
+  so = psysobject(sopntr);
+
+  /* FIXME: add migration check here? */
+  if (so->ownertid != tsk->tid) {
+    fatal("readchunk: should migrate to task %d",so->ownertid);
+  }
+
+  r = read(so->fd,buf,DEFAULT_IOSIZE);
+  if (0 == r) {
+    argstack[0] = tsk->globnilpntr;
+    doclose = 1;
+  }
+  if (0 > r) {
+    set_error(tsk,"Error reading file: %s",strerror(errno));
+    doclose = 1;
+  }
+
+  if (doclose) {
+    free_sysobject(tsk,so);
+    cell_make_ind(tsk,c,tsk->globnilpntr);
+    return;
+  }
+
+  argstack[0] = binary_data_to_list(tsk,buf,r,nextpntr);
+}
+
+static void b_openfd(task *tsk, pntr *argstack)
+{
+  frame *curf = *tsk->runptr;
+
+  if (NULL == tsk->endpt) {
+    openfd_direct(tsk,argstack);
+    return;
+  }
+
+  if (0 == curf->resume) {
+    pntr filenamepntr = argstack[0];
+    char *filename;
+    sysobject *so;
+    int ioid;
+
+    if (0 > array_to_string(filenamepntr,&filename)) {
+      set_error(tsk,"openfd: filename is not a string");
+      return;
+    }
+
+    /* The file is opened by the file I/O service; this frame is resumed once that is done */
+    so = new_sysobject(tsk,SYSOBJECT_FILE);
+    so->fd = -1;
+    make_pntr(argstack[0],so->c);
+
+    ioid = suspend_current_frame(tsk,curf);
+    send_openfile(tsk->endpt,ioid,filename);
+    so->frameids[READ_FRAMEADDR] = ioid;
+
+    free(filename);
+  }
+  else {
+    sysobject *so;
+    CHECK_SYSOBJECT_ARG(0,SYSOBJECT_FILE);
+    so = psysobject(argstack[0]);
+    curf->resume = 0;
+    if (so->error) {
+      set_error(tsk,"%s",so->errmsg);
+      free_sysobject(tsk,so);
+    }
+  }
+}
+
+static void b_readchunk(task *tsk, pntr *argstack)
+{
+  frame *curf = *tsk->runptr;
+  pntr sopntr = argstack[1];
+  pntr nextpntr = argstack[0];
+  sysobject *so;
+  cell *c;
+
+  if (NULL == tsk->endpt) {
+    readchunk_direct(tsk,argstack);
+    return;
+  }
+
+  CHECK_SYSOBJECT_ARG(1,SYSOBJECT_FILE);
+  c = get_pntr(sopntr);
+  so = psysobject(sopntr);
+
+  /* Migration check */
+  if (so->ownertid != tsk->tid) {
+    migrate_to(tsk,so->ownertid);
+    return;
+  }
+
+  if (0 == curf->resume) {
+    /* The read is done by the file I/O service, so other frames can run in the meantime */
+    int ioid = suspend_current_frame(tsk,curf);
+    send_readfile(tsk->endpt,ioid,so->fd,opt_readchunksize);
+
+    assert(0 == so->frameids[READ_FRAMEADDR]);
+    so->frameids[READ_FRAMEADDR] = ioid;
+    return;
+  }
+
+  curf->resume = 0;
+  if (so->error || (0 == so->len)) {
+    if (so->error)
+      set_error(tsk,"Error reading file: %s",strerror(so->errn));
+    else
+      argstack[0] = tsk->globnilpntr;
+    free_sysobject(tsk,so);
+    cell_make_ind(tsk,c,tsk->globnilpntr);
+    return;
+  }
+
+  argstack[0] = binary_data_to_list(tsk,so->buf,so->len,nextpntr);
+
+  message_free(so->readmsg);
+  so->readmsg = NULL;
+  so->buf = NULL;
+  so->len = 0;
+}
+
+/* Like readchunk, but maps the file into memory instead of reading it, and returns a string
+   that refers directly to the mapped data (see mapfile.c). Files that cannot be mapped are read
+   with readchunk instead. */
+static void b_mapchunk(task *tsk, pntr *argstack)
+{
+  pntr sopntr = argstack[1];
+  pntr nextpntr = argstack[0];
+  sysobject *so;
+  carray *arr;
+  cell *refcell;
+
+  CHECK_SYSOBJECT_ARG(1,SYSOBJECT_FILE);
+  so = psysobject(sopntr);
+
+  /* Migration check */
+  if ((NULL != tsk->endpt) && (so->ownertid != tsk->tid)) {
+    migrate_to(tsk,so->ownertid);
+    return;
+  }
+
+  if (NULL == so->mf)
+    so->mf = mapfile_new(so->fd);
+
+  if (so->mf->fallback) {
+    b_readchunk(tsk,argstack);
+    return;
+  }
+
+  if (mapfile_finished(so->mf)) {
+    argstack[0] = tsk->globnilpntr;
+    return;
+  }
+
+  if (NULL == (arr = mapfile_next_chunk(tsk,so->mf,so->fd))) {
+    set_error(tsk,"Error mapping file: %s",strerror(errno));
+    return;
+  }
+
+  /* The mappings remain valid after the file is closed */
+  if (mapfile_finished(so->mf)) {
+    close(so->fd);
+    so->fd = -1;
+  }
+
+  refcell = alloc_cell(tsk);
+  refcell->type = CELL_AREF;
+  make_pntr(refcell->field1,arr);
+  refcell->field2 = nextpntr;
+  make_pntr(argstack[0],refcell);
+}
+
 static void b_listen(task *tsk, pntr *argstack)
 {
   frame *curf = *tsk->runptr;
@@ -1766,14 +2031,22 @@ static void b_print(task *tsk, pntr *argstack)
   write_data(tsk,argstack,&c,1,destpntr);
 }
 
+/* Writes the first n characters of a string, and returns the remainder of the string. If the
+   string continues with other character arrays that have already been evaluated, these are
+   written at the same time (up to DEFAULT_IOSIZE bytes), saving a separate write for each. */
 static void b_printarray(task *tsk, pntr *argstack)
 {
+  frame *curf = *tsk->runptr;
   carray *arr;
   int index;
   int n;
   pntr destpntr = argstack[2];
   pntr npntr = argstack[1];
   pntr valpntr = argstack[0];
+  sysobject *so;
+  char *buf = NULL;
+  const char *data;
+  pntr rest;
 
   CHECK_ARG(0,CELL_AREF);
   CHECK_ARG(1,CELL_NUMBER);
@@ -1790,10 +2063,42 @@ static void b_printarray(task *tsk, pntr *argstack)
   index = aref_index(valpntr);
 
   assert(1 <= n);
-  assert(index+n <= arr->size);
   assert(1 == arr->elemsize);
 
-  write_data(tsk,argstack,arr->elements+index,n,destpntr);
+  /* Migration check. This is done before looking at the rest of the string, which is only
+     known to be evaluated on this task. */
+  so = psysobject(destpntr);
+  if (so->ownertid != tsk->tid) {
+    migrate_to(tsk,so->ownertid);
+    return;
+  }
+
+  /* The amount to write is saved in the frame, so that the same remainder is returned when the
+     frame is resumed after the write completes */
+  if (!curf->resume) {
+    assert(index+n <= arr->size);
+    n = evaluated_string_prefix(valpntr,n,DEFAULT_IOSIZE);
+    set_pntrdouble(argstack[1],n);
+  }
+
+  if (n <= arr->size-index) {
+    data = arr->elements+index;
+  }
+  else if (!curf->resume) {
+    buf = (char*)malloc(n);
+    copy_string_prefix(valpntr,n,buf);
+    data = buf;
+  }
+  else {
+    data = NULL; /* only the length is needed when resuming */
+  }
+
+  rest = skip_string_prefix(valpntr,n);
+  write_data(tsk,argstack,data,n,destpntr);
+  free(buf);
+
+  if (CELL_NIL == pntrtype(argstack[0]))
+    argstack[0] = rest;
 }
 
 static void b_printend(task *tsk, pntr *argstack)
@@ -2069,7 +2374,6 @@ static void b_spawn(task *tsk, pntr *argstack)
 
 static void b_compile(task *tsk, pntr *argstack)
 {
-  source *src;
   pntr codepntr = argstack[1];
   pntr filenamepntr = argstack[0];
   char *code;
@@ -2088,20 +2392,14 @@ static void b_compile(task *tsk, pntr *argstack)
     return;
   }
 
-  src = source_new();
-  if ((0 != source_parse_string(src,code,"(unknown)","")) ||
-      (0 != source_process(src,0,0,0,0)) ||
-      (0 != source_compile(src,&bcdata,&bcsize))) {
+  if (0 != source_compile_string_cached(code,"(unknown)",&bcdata,&bcsize))
     set_error(tsk,"compile error");
-  }
-  else {
+  else
     argstack[0] = binary_data_to_list(tsk,bcdata,bcsize,tsk->globnilpntr);
-  }
 
   free(bcdata);
   free(code);
   free(filename);
-  source_free(src);
 }
 
 static void b_isspace(task *tsk, pntr *argstack)
@@ -2237,5 +2535,6 @@ builtin builtin_info[NUM_BUILTINS] = {
 { "buildarray",     3, 2, ALWAYS_VALUE, MAYBE_FALSE,   PURE, b_buildarray     },
 { "parsexmlfile",   1, 1, ALWAYS_VALUE, MAYBE_FALSE,   PURE, b_parsexmlfile   },
 { "genstring",      1, 1, ALWAYS_VALUE, MAYBE_FALSE,   PURE, b_genstring      },
+{ "mapchunk",       2, 1, MAYBE_UNEVAL, MAYBE_FALSE, IMPURE, b_mapchunk       },
 
 };
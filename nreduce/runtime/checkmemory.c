@@ -335,7 +335,7 @@ void update_lifetimes(task *tsk, block *gen)
       unsigned int size;
 
       if (REF_FLAGS == h->flags) {
-        header *target = (header*)h->type;
+        header *target = forward_addr(h);
         assert(CELL_COUNT <= h->type);
         assert(REF_FLAGS != target->flags);
         assert(CELL_COUNT > target->type);
@@ -310,7 +310,6 @@ static int client_run(node *n, list *nodes, const char *filename, socketid out_s
 {
   int bcsize;
   char *bcdata;
-  source *src;
   int count = list_count(nodes);
   endpointid *managerids = (endpointid*)calloc(count,sizeof(endpointid));
   list *l;
@@ -324,14 +323,8 @@ static int client_run(node *n, list *nodes, const char *filename, socketid out_s
     i++;
   }
 
-  src = source_new();
-  if (0 != source_parse_file(src,filename,""))
+  if (0 != source_compile_file_cached(filename,0,&bcdata,&bcsize))
     return -1;
-  if (0 != source_process(src,0,0,0,0))
-    return -1;
-  if (0 != source_compile(src,&bcdata,&bcsize))
-    return -1;
-  source_free(src);
 
   node_log(n,LOG_INFO,"Compiled");
   start_launcher(n,bcdata,bcsize,managerids,count,&thread,out_sockid,argc,argv);
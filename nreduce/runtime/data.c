@@ -38,10 +38,33 @@
 #include <stdarg.h>
 #include <math.h>
 #include <errno.h>
+#include <limits.h>
 
 extern int opt_buildarray;
+extern int opt_prefetch;
+extern int opt_prefetchbytes;
 
-/* Write & read functions for basic types */
+#define BATCH_MAX_BYTES 65536
+
+/* Write & read functions for basic types
+
+   Integers are sent as base-128 varints, with signed values zigzag encoded so that small
+   negative numbers (such as the -1 used in null gaddrs) stay short. Type tags are only
+   included when DEBUG_WIRE_TAGS is defined; they make mismatched reads easy to spot, but
+   otherwise account for most of the size of a message. Any change to the encoding must be
+   accompanied by an increment of WIRE_VERSION. */
+
+static void write_varuint(array *wr, unsigned int u)
+{
+  unsigned char buf[5];
+  int n = 0;
+  while (0x80 <= u) {
+    buf[n++] = (u & 0x7F) | 0x80;
+    u >>= 7;
+  }
+  buf[n++] = u;
+  array_append(wr,buf,n);
+}
 
 array *write_start(void)
 {
@@ -50,7 +73,9 @@ array *write_start(void)
 
 void write_tag(array *wr, int tag)
 {
-/*   array_append(wr,&tag,sizeof(int)); */
+#ifdef DEBUG_WIRE_TAGS
+  array_append(wr,&tag,sizeof(int));
+#endif
 }
 
 void write_char(array *wr, char c)
@@ -62,13 +87,13 @@ void write_char(array *wr, char c)
 void write_int(array *wr, int i)
 {
   write_tag(wr,INT_TAG);
-  array_append(wr,&i,sizeof(int));
+  write_varuint(wr,((unsigned int)i << 1) ^ (unsigned int)(i >> 31));
 }
 
 void write_uint(array *wr, unsigned int i)
 {
   write_tag(wr,UINT_TAG);
-  array_append(wr,&i,sizeof(unsigned int));
+  write_varuint(wr,i);
 }
 
 void write_short(array *wr, short i)
@@ -93,20 +118,21 @@ void write_string(array *wr, char *s)
 {
   int len = strlen(s);
   write_tag(wr,STRING_TAG);
-  array_append(wr,&len,sizeof(int));
+  write_varuint(wr,len);
   array_append(wr,s,len);
 }
 
 void write_binary(array *wr, const void *b, int len)
 {
   write_tag(wr,BINARY_TAG);
-  array_append(wr,&len,sizeof(int));
+  write_varuint(wr,len);
   array_append(wr,b,len);
 }
 
 void write_socketid(array *wr, socketid sockid)
 {
-  write_uint(wr,sockid.coordid.ip);
+  write_tag(wr,UINT_TAG);
+  array_append(wr,&sockid.coordid.ip,sizeof(in_addr_t));
   write_ushort(wr,sockid.coordid.port);
   write_uint(wr,sockid.coordid.localid);
   write_uint(wr,sockid.sid);
@@ -115,8 +141,8 @@ void write_socketid(array *wr, socketid sockid)
 void write_gaddr(array *wr, task *tsk, gaddr a)
 {
   write_tag(wr,GADDR_TAG);
-  array_append(wr,&a.tid,sizeof(int));
-  array_append(wr,&a.lid,sizeof(int));
+  write_varuint(wr,((unsigned int)a.tid << 1) ^ (unsigned int)(a.tid >> 31));
+  write_varuint(wr,((unsigned int)a.lid << 1) ^ (unsigned int)(a.lid >> 31));
   add_gaddr(&tsk->inflight,a);
   event_add_inflight(tsk,a);
 }
@@ -143,11 +169,34 @@ static void read_bytes(reader *rd, void *data, int count)
   rd->pos += count;
 }
 
+static unsigned int read_varuint(reader *rd)
+{
+  unsigned int u = 0;
+  int shift = 0;
+  unsigned char b;
+  do {
+    assert(rd->pos < rd->size);
+    assert(35 > shift);
+    b = (unsigned char)rd->data[rd->pos++];
+    u |= (unsigned int)(b & 0x7F) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return u;
+}
+
+static int read_varint(reader *rd)
+{
+  unsigned int u = read_varuint(rd);
+  return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
 void read_check_tag(reader *rd, int tag)
 {
-/*   int got; */
-/*   read_bytes(rd,&got,sizeof(int)); */
-/*   assert(got == tag); */
+#ifdef DEBUG_WIRE_TAGS
+  int got;
+  read_bytes(rd,&got,sizeof(int));
+  assert(got == tag);
+#endif
 }
 
 static void read_tagged_bytes(reader *rd, int tag, void *data, int count)
@@ -163,12 +212,14 @@ void read_char(reader *rd, char *c)
 
 void read_int(reader *rd, int *i)
 {
-  read_tagged_bytes(rd,INT_TAG,i,sizeof(int));
+  read_check_tag(rd,INT_TAG);
+  *i = read_varint(rd);
 }
 
 void read_uint(reader *rd, unsigned int *i)
 {
-  read_tagged_bytes(rd,UINT_TAG,i,sizeof(unsigned int));
+  read_check_tag(rd,UINT_TAG);
+  *i = read_varuint(rd);
 }
 
 void read_short(reader *rd, short *i)
@@ -190,7 +241,7 @@ void read_string(reader *rd, char **s)
 {
   int len;
   read_check_tag(rd,STRING_TAG);
-  read_bytes(rd,&len,sizeof(int));
+  len = read_varuint(rd);
   assert(rd->pos+len <= rd->size);
   *s = (char*)malloc(len+1);
   memcpy(*s,&rd->data[rd->pos],len);
@@ -202,7 +253,7 @@ void read_binary(reader *rd, char *b, int len)
 {
   int blen;
   read_check_tag(rd,BINARY_TAG);
-  read_bytes(rd,&blen,sizeof(int));
+  blen = read_varuint(rd);
   assert(blen == len);
   assert(rd->pos+len <= rd->size);
   memcpy(b,&rd->data[rd->pos],len);
@@ -211,7 +262,7 @@ void read_binary(reader *rd, char *b, int len)
 
 void read_socketid(reader *rd, socketid *sockid)
 {
-  read_uint(rd,&sockid->coordid.ip);
+  read_tagged_bytes(rd,UINT_TAG,&sockid->coordid.ip,sizeof(in_addr_t));
   read_ushort(rd,&sockid->coordid.port);
   read_uint(rd,&sockid->coordid.localid);
   read_uint(rd,&sockid->sid);
@@ -220,8 +271,8 @@ void read_socketid(reader *rd, socketid *sockid)
 void read_gaddr(reader *rd, gaddr *a)
 {
   read_check_tag(rd,GADDR_TAG);
-  read_bytes(rd,&a->tid,sizeof(int));
-  read_bytes(rd,&a->lid,sizeof(int));
+  a->tid = read_varint(rd);
+  a->lid = read_varint(rd);
   if ((-1 != a->tid) || (-1 != a->lid))
     rd->tsk->naddrsread++;
 }
@@ -233,6 +284,44 @@ void read_end(reader *rd)
 
 /* Write & read functions for heap objects */
 
+/* Writes a field of an object being sent. Normally this is just a reference, which the recipient
+   must FETCH separately if it needs the value. When sending a RESPOND message with prefetching
+   enabled, fields which refer to lists or arrays that have already been evaluated are sent in
+   full instead, up to a limit on the number of objects and the size of the message. Each of
+   these gets its own address and is recorded as a target by the recipient, in the same manner
+   as the object that was actually requested.
+
+   An object is sent in full at most once per message; it is marked with FLAG_PREFETCHED, and any
+   further references to it are sent as references, which the recipient resolves to the copy it
+   has just read. The marks are cleared by write_prefetch() once the message is complete. */
+static int prefetchable(array *arr, task *tsk, pntr p)
+{
+  return ((0 < tsk->prefetchcells) && (arr->nbytes < tsk->prefetchlimit) &&
+          ((CELL_CONS == pntrtype(p)) || (CELL_AREF == pntrtype(p))) &&
+          !(get_pntr(p)->flags & FLAG_PREFETCHED));
+}
+
+static void mark_prefetched(task *tsk, pntr p)
+{
+  cell *c = get_pntr(p);
+  c->flags |= FLAG_PREFETCHED;
+  array_append(tsk->prefetchsent,&c,sizeof(cell*));
+}
+
+static void write_field(array *arr, task *tsk, pntr p)
+{
+  p = resolve_pntr(p);
+  if (prefetchable(arr,tsk,p)) {
+    tsk->prefetchcells--;
+    tsk->prefetched++;
+    mark_prefetched(tsk,p);
+    write_pntr(arr,tsk,p,0);
+  }
+  else {
+    write_ref(arr,tsk,p);
+  }
+}
+
 static void write_object_address(array *arr, task *tsk, pntr p)
 {
   global *target;
@@ -279,7 +368,9 @@ static void write_buildarray_frame(array *arr, task *tsk, pntr p)
   write_ref(arr,tsk,aref->field1);  /* First arg: carray object */
 }
 
-static void write_aref(array *arr, task *tsk, pntr p)
+/* Writes an AREF cell apart from its tail, which is stored in *tail for write_list() to send.
+   Returns 0 if the array was instead sent as a buildarray frame, which includes the tail. */
+static int write_aref(array *arr, task *tsk, pntr p, pntr *tail)
 {
   assert(CELL_AREF == pntrtype(p));
 
@@ -287,10 +378,13 @@ static void write_aref(array *arr, task *tsk, pntr p)
   int index = aref_index(p);
   int i;
 
-  /* If the array size is 1kb or greater, send a builarray frame so that the data is shared. */
-  if (opt_buildarray && (carr->size >= BUILDARRAY_THRESHOLD)) {
+  /* If the array size is 1kb or greater, send a builarray frame so that the data is shared,
+     unless we are prefetching and the whole array fits in the remaining budget. */
+  if (opt_buildarray && (carr->size >= BUILDARRAY_THRESHOLD) &&
+      ((0 >= tsk->prefetchcells) ||
+       (carr->size*carr->elemsize > tsk->prefetchlimit-arr->nbytes))) {
     write_buildarray_frame(arr,tsk,p);
-    return;
+    return 0;
   }
 
   /* Otherwise, just send the aref directly, and the recipient will make a copy of it. */
@@ -309,10 +403,11 @@ static void write_aref(array *arr, task *tsk, pntr p)
     write_binary(arr,carr->elements,carr->size);
   else {
     for (i = 0; i < carr->size; i++)
-      write_ref(arr,tsk,((pntr*)carr->elements)[i]);
+      write_field(arr,tsk,((pntr*)carr->elements)[i]);
   }
-  write_ref(arr,tsk,aref_tail(p));
+  *tail = aref_tail(p);
   carr->multiref = 1; /* prevent further expansion */
+  return 1;
 }
 
 static void read_aref(reader *rd, pntr *pout)
@@ -344,7 +439,6 @@ static void read_aref(reader *rd, pntr *pout)
     for (i = 0; i < size; i++)
       read_pntr(rd,&((pntr*)carr->elements)[i]);
   }
-  read_pntr(rd,&refcell->field2);
   make_aref_pntr(*pout,refcell,index);
 }
 
@@ -399,13 +493,14 @@ static void read_array(reader *rd, pntr *pout)
   make_pntr(*pout,carr);
 }
 
-static void write_cons(array *arr, task *tsk, pntr p)
+/* Writes a CONS cell apart from its tail, which is returned for write_list() to send */
+static pntr write_cons(array *arr, task *tsk, pntr p)
 {
   assert(CELL_CONS == pntrtype(p));
   write_int(arr,CELL_CONS);
   write_object_address(arr,tsk,p);
-  write_ref(arr,tsk,get_pntr(p)->field1);
-  write_ref(arr,tsk,get_pntr(p)->field2);
+  write_field(arr,tsk,get_pntr(p)->field1);
+  return get_pntr(p)->field2;
 }
 
 static void read_cons(reader *rd, pntr *pout)
@@ -413,18 +508,42 @@ static void read_cons(reader *rd, pntr *pout)
   task *tsk = rd->tsk;
   cell *c;
   pntr head;
-  pntr tail;
 
   read_pntr(rd,&head);
-  read_pntr(rd,&tail);
 
   c = alloc_cell(tsk);
   c->type = CELL_CONS;
   c->field1 = head;
-  c->field2 = tail;
+  c->field2 = tsk->globnilpntr;
   make_pntr(*pout,c);
 }
 
+/* Writes a list cell, followed by as much of the rest of the list as is being prefetched. The
+   tail is the last thing sent for each cell, so successive cells are written in a loop rather
+   than by recursion, and the stack depth does not depend on the length of the list. */
+static void write_list(array *arr, task *tsk, pntr p)
+{
+  pntr tail;
+  while (1) {
+    maybe_expand_array(tsk,p);
+    if (CELL_CONS == pntrtype(p))
+      tail = write_cons(arr,tsk,p);
+    else if (!write_aref(arr,tsk,p,&tail))
+      return;
+
+    tail = resolve_pntr(tail);
+    if (!prefetchable(arr,tsk,tail)) {
+      write_ref(arr,tsk,tail);
+      return;
+    }
+    tsk->prefetchcells--;
+    tsk->prefetched++;
+    mark_prefetched(tsk,tail);
+    write_tag(arr,PNTR_TAG);
+    p = tail;
+  }
+}
+
 static void write_frame(array *arr, task *tsk, pntr p)
 {
   write_int(arr,CELL_FRAME);
@@ -594,14 +713,119 @@ static void read_sysobject(reader *rd, pntr *pout, gaddr addr)
   make_pntr(*pout,so->c);
 }
 
-void read_pntr(reader *rd, pntr *pout)
+/* Records an object that has just been read from a message under the given address, replacing
+   any remote reference to it that we already have */
+static void got_object(task *tsk, int type, gaddr addr, pntr *pout)
+{
+  global *existing = addrhash_lookup(tsk,addr);
+
+  if ((CELL_SYSOBJECT == type) && (psysobject(*pout)->ownertid == tsk->tid)) {
+    /* If we've received a sysobject whose owner is this task, then this means
+       we should have the authorative copy of it. The data received isn't of
+       use to us, since other nodes just have a "proxy" for the main sysobject. */
+    assert(existing);
+    assert(CELL_SYSOBJECT == pntrtype(existing->p));
+    free_sysobject(tsk,psysobject(*pout));
+    *pout = existing->p;
+  }
+
+  int existing_type = existing ? pntrtype(existing->p) : CELL_EMPTY;
+  assert((NULL == existing) ||
+         ((existing->addr.lid == addr.lid) && (existing->addr.tid == addr.tid)));
+  if (NULL == existing) {
+    assert(addr.tid != tsk->tid);
+    assert(addr.lid >= 0);
+    assert(NULL == targethash_lookup(tsk,*pout));
+    add_target(tsk,addr,*pout);
+  }
+  else if (CELL_REMOTEREF == pntrtype(existing->p)) {
+    global *lookup = targethash_lookup(tsk,existing->p);
+    int inphys = 0;
+    if (NULL == lookup) {
+      /* If there is no target address associated with the existing object, it may be
+         because the existing object is the authoritative copy. In this case, there
+         will be an entry in the physical hash table instead of the target hash table. */
+      lookup = physhash_lookup(tsk,existing->p);
+      assert(lookup->addr.lid == addr.lid);
+      assert(lookup->addr.tid == addr.tid);
+      assert(lookup->addr.tid == tsk->tid);
+      inphys = 1;
+    }
+    assert(lookup);
+    assert(existing == lookup);
+
+    if (existing->fetching) {
+      node_log(tsk->n,LOG_WARNING,"read_pntr %d@%d: found fetching ref",addr.lid,addr.tid);
+      global *target = pglobal(existing->p);
+      response_for_fetching_ref(tsk,target,*pout);
+    }
+
+    existing->stale_replica = 0;
+
+    cell *refcell = get_pntr(existing->p);
+    cell_make_ind(tsk,refcell,*pout);
+    if (inphys)
+      physhash_remove(tsk,existing);
+    targethash_remove(tsk,existing);
+    existing->p = *pout;
+    if ((NULL == targethash_lookup(tsk,existing->p)) && (addr.tid != tsk->tid))
+      targethash_add(tsk,existing);
+    if (inphys)
+      physhash_add(tsk,existing);
+  }
+  else {
+    *pout = existing->p;
+    /* FIXME: work out if it's possible for us to receive a copy of an object we already have
+       that differs from our existing copy, and if this can cause problems */
+  }
+  event_got_object(tsk,addr,pntrtype(*pout),existing_type);
+}
+
+static void read_typed_pntr(reader *rd, int type, pntr *pout);
+
+/* Reads a list cell, together with the following cells of the list that were sent in full (see
+   write_list()). The cells are read in a loop, and then recorded starting from the end of the
+   list, in the same order as if each tail had been read recursively. tsk->listcells is used as
+   a stack, since the head of a cell may itself be a list. */
+static void read_list(reader *rd, int type, pntr *pout)
+{
+  task *tsk = rd->tsk;
+  int base = array_count(tsk->listcells);
+  int i;
+  pntr tail;
+
+  do {
+    listcell lc;
+    lc.type = type;
+    read_gaddr(rd,&lc.addr);
+    if (CELL_CONS == type)
+      read_cons(rd,&lc.p);
+    else
+      read_aref(rd,&lc.p);
+    array_append(tsk->listcells,&lc,sizeof(listcell));
+
+    read_check_tag(rd,PNTR_TAG);
+    read_int(rd,&type);
+  } while ((CELL_CONS == type) || (CELL_AREF == type));
+
+  read_typed_pntr(rd,type,&tail);
+
+  for (i = array_count(tsk->listcells)-1; i >= base; i--) {
+    listcell lc = array_item(tsk->listcells,i,listcell);
+    get_pntr(lc.p)->field2 = tail;
+    got_object(tsk,lc.type,lc.addr,&lc.p);
+    tail = lc.p;
+  }
+  tsk->listcells->nbytes = base*sizeof(listcell);
+  *pout = tail;
+}
+
+/* Reads the remainder of a pntr whose type has already been read */
+static void read_typed_pntr(reader *rd, int type, pntr *pout)
 {
   /* TODO: determine if this refers to an object we already have a copy of, and return
      that object instead. (see Trinder96 2.3.2) */
   task *tsk = rd->tsk;
-  int type;
-  read_check_tag(rd,PNTR_TAG);
-  read_int(rd,&type);
 
   if (CELL_NUMBER == type) {
     double d;
@@ -609,6 +833,11 @@ void read_pntr(reader *rd, pntr *pout)
     set_pntrdouble(*pout,d);
     assert(!is_pntr(*pout));
   }
+  else if (WIRE_INTEGER == type) {
+    int i;
+    read_int(rd,&i);
+    set_pntrdouble(*pout,(double)i);
+  }
   else if (CELL_NIL == type) {
     *pout = tsk->globnilpntr;
   }
@@ -630,86 +859,33 @@ void read_pntr(reader *rd, pntr *pout)
       event_got_remoteref(tsk,addr,CELL_EMPTY);
     }
   }
+  else if ((CELL_CONS == type) || (CELL_AREF == type)) {
+    read_list(rd,type,pout);
+  }
   else {
     gaddr addr;
-    global *existing;
     read_gaddr(rd,&addr);
 
     switch (type) {
-    case CELL_AREF:      read_aref(rd,pout); break;
     case CELL_O_ARRAY:   read_array(rd,pout); break;
-    case CELL_CONS:      read_cons(rd,pout); break;
     case CELL_FRAME:     read_frame(rd,pout); break;
     case CELL_CAP:       read_cap(rd,pout); break;
     case CELL_SYSOBJECT: read_sysobject(rd,pout,addr); break;
     default: fatal("read_pntr: got unexpected cell type %d",type);
     }
 
-    existing = addrhash_lookup(tsk,addr);
-
-    if ((CELL_SYSOBJECT == type) && (psysobject(*pout)->ownertid == tsk->tid)) {
-      /* If we've received a sysobject whose owner is this task, then this means
-         we should have the authorative copy of it. The data received isn't of
-         use to us, since other nodes just have a "proxy" for the main sysobject. */
-      assert(existing);
-      assert(CELL_SYSOBJECT == pntrtype(existing->p));
-      free_sysobject(tsk,psysobject(*pout));
-      *pout = existing->p;
-    }
-
-    int existing_type = existing ? pntrtype(existing->p) : CELL_EMPTY;
-    assert((NULL == existing) ||
-           ((existing->addr.lid == addr.lid) && (existing->addr.tid == addr.tid)));
-    if (NULL == existing) {
-      assert(addr.tid != tsk->tid);
-      assert(addr.lid >= 0);
-      assert(NULL == targethash_lookup(tsk,*pout));
-      add_target(tsk,addr,*pout);
-    }
-    else if (CELL_REMOTEREF == pntrtype(existing->p)) {
-      global *lookup = targethash_lookup(tsk,existing->p);
-      int inphys = 0;
-      if (NULL == lookup) {
-        /* If there is no target address associated with the existing object, it may be
-           because the existing object is the authoritative copy. In this case, there
-           will be an entry in the physical hash table instead of the target hash table. */
-        lookup = physhash_lookup(tsk,existing->p);
-        assert(lookup->addr.lid == addr.lid);
-        assert(lookup->addr.tid == addr.tid);
-        assert(lookup->addr.tid == tsk->tid);
-        inphys = 1;
-      }
-      assert(lookup);
-      assert(existing == lookup);
-
-      if (existing->fetching) {
-        node_log(tsk->n,LOG_WARNING,"read_pntr %d@%d: found fetching ref",addr.lid,addr.tid);
-        global *target = pglobal(existing->p);
-        response_for_fetching_ref(tsk,target,*pout);
-      }
-
-      existing->stale_replica = 0;
-
-      cell *refcell = get_pntr(existing->p);
-      cell_make_ind(tsk,refcell,*pout);
-      if (inphys)
-        physhash_remove(tsk,existing);
-      targethash_remove(tsk,existing);
-      existing->p = *pout;
-      if ((NULL == targethash_lookup(tsk,existing->p)) && (addr.tid != tsk->tid))
-        targethash_add(tsk,existing);
-      if (inphys)
-        physhash_add(tsk,existing);
-    }
-    else {
-      *pout = existing->p;
-      /* FIXME: work out if it's possible for us to receive a copy of an object we already have
-         that differs from our existing copy, and if this can cause problems */
-    }
-    event_got_object(tsk,addr,pntrtype(*pout),existing_type);
+    got_object(tsk,type,addr,pout);
   }
 }
 
+void read_pntr(reader *rd, pntr *pout)
+{
+  int type;
+  read_check_tag(rd,PNTR_TAG);
+  read_int(rd,&type);
+  read_typed_pntr(rd,type,pout);
+}
+
 void write_ref(array *arr, task *tsk, pntr p)
 {
   write_pntr(arr,tsk,p,1);
@@ -721,8 +897,16 @@ void write_pntr(array *arr, task *tsk, pntr p, int refonly)
   write_tag(arr,PNTR_TAG);
 
   if (CELL_NUMBER == pntrtype(p)) {
-    write_int(arr,CELL_NUMBER);
-    write_double(arr,pntrdouble(p));
+    double d = pntrdouble(p);
+    if ((INT_MIN <= d) && (INT_MAX >= d) && ((double)(int)d == d) && ((0.0 != d) || !signbit(d))) {
+      /* Integral values, which make up most numbers in practice, fit in a varint */
+      write_int(arr,WIRE_INTEGER);
+      write_int(arr,(int)d);
+    }
+    else {
+      write_int(arr,CELL_NUMBER);
+      write_double(arr,d);
+    }
   }
   else if (CELL_NIL == pntrtype(p)) {
     write_int(arr,CELL_NIL);
@@ -764,14 +948,10 @@ void write_pntr(array *arr, task *tsk, pntr p, int refonly)
     }
   }
   else {
-
-    if ((CELL_CONS == pntrtype(p)) || (CELL_AREF == pntrtype(p)))
-      maybe_expand_array(tsk,p);
-
     switch (pntrtype(p)) {
-    case CELL_AREF:      write_aref(arr,tsk,p); break;
+    case CELL_AREF:      write_list(arr,tsk,p); break;
     case CELL_O_ARRAY:   write_array(arr,tsk,p); break;
-    case CELL_CONS:      write_cons(arr,tsk,p); break;
+    case CELL_CONS:      write_list(arr,tsk,p); break;
     case CELL_FRAME:     write_frame(arr,tsk,p); break;
     case CELL_CAP:       write_cap(arr,tsk,p); break;
     case CELL_SYSOBJECT: write_sysobject(arr,tsk,p); break;
@@ -780,6 +960,24 @@ void write_pntr(array *arr, task *tsk, pntr p, int refonly)
   }
 }
 
+/* Writes an object in response to a FETCH, along with any already-evaluated list cells and
+   arrays reachable from it, within the limits set by OPT_PREFETCH and OPT_PREFETCHBYTES */
+void write_prefetch(array *arr, task *tsk, pntr p)
+{
+  int i;
+  tsk->prefetchcells = opt_prefetch;
+  tsk->prefetchlimit = arr->nbytes+opt_prefetchbytes;
+  p = resolve_pntr(p);
+  if ((CELL_CONS == pntrtype(p)) || (CELL_AREF == pntrtype(p)))
+    mark_prefetched(tsk,p);
+  write_pntr(arr,tsk,p,0);
+  tsk->prefetchcells = 0;
+
+  for (i = 0; i < array_count(tsk->prefetchsent); i++)
+    array_item(tsk->prefetchsent,i,cell*)->flags &= ~FLAG_PREFETCHED;
+  tsk->prefetchsent->nbytes = 0;
+}
+
 void write_vformat(array *wr, task *tsk, const char *fmt, va_list ap)
 {
   for (; *fmt; fmt++) {
@@ -808,6 +1006,9 @@ void write_vformat(array *wr, task *tsk, const char *fmt, va_list ap)
     case 'p':
       write_pntr(wr,tsk,va_arg(ap,pntr),0);
       break;
+    case 'f':
+      write_prefetch(wr,tsk,va_arg(ap,pntr));
+      break;
     case 'r':
       write_ref(wr,tsk,va_arg(ap,pntr));
       break;
@@ -825,6 +1026,44 @@ void write_format(array *wr, task *tsk, const char *fmt, ...)
   va_end(ap);
 }
 
+/* Messages to other tasks are not sent immediately, but added to a per-destination batch which
+   is sent as a single MSG_BUNDLE message when handle_interrupt() finishes, before the task blocks
+   waiting for a message, or when the batch reaches BATCH_MAX_BYTES. A batch consists of a
+   sequence of (tag, size, data) records, each padded to a multiple of BUNDLE_ALIGN bytes, which
+   the recipient processes in order. Anything sent directly with endpoint_send() to another task
+   or the GC must be preceded by a call to msg_flush(), so that it cannot overtake messages that
+   are still waiting in a batch. */
+void msg_flush_dest(task *tsk, int dest)
+{
+  array *batch = tsk->outbatch[dest];
+
+  if (0 == batch->nbytes)
+    return;
+
+  if (1 == tsk->outbatchcount[dest]) {
+    /* Just send the message itself */
+    int tag;
+    int size;
+    memcpy(&tag,batch->data,sizeof(int));
+    memcpy(&size,&batch->data[sizeof(int)],sizeof(int));
+    endpoint_send(tsk->endpt,tsk->idmap[dest],tag,&batch->data[2*sizeof(int)],size);
+  }
+  else {
+    endpoint_send(tsk->endpt,tsk->idmap[dest],MSG_BUNDLE,batch->data,batch->nbytes);
+  }
+  tsk->batches_sent++;
+
+  batch->nbytes = 0;
+  tsk->outbatchcount[dest] = 0;
+}
+
+void msg_flush(task *tsk)
+{
+  int dest;
+  for (dest = 0; dest < tsk->groupsize; dest++)
+    msg_flush_dest(tsk,dest);
+}
+
 void msg_send(task *tsk, int dest, int tag, char *data, int size)
 {
   if (NULL != tsk->inflight) {
@@ -840,7 +1079,30 @@ void msg_send(task *tsk, int dest, int tag, char *data, int size)
     tsk->inflight = NULL;
   }
 
-  endpoint_send(tsk->endpt,tsk->idmap[dest],tag,data,size);
+  if (BATCH_MAX_BYTES <= size) {
+    /* Too big to be worth copying into the batch */
+    msg_flush_dest(tsk,dest);
+    endpoint_send(tsk->endpt,tsk->idmap[dest],tag,data,size);
+    return;
+  }
+
+  /* Make sure handle_interrupt() gets called soon, so the message is not held up for long */
+  if ((0 == tsk->outbatch[dest]->nbytes) && !tsk->in_interrupt)
+    endpoint_interrupt(tsk->endpt);
+
+  array_append(tsk->outbatch[dest],&tag,sizeof(int));
+  array_append(tsk->outbatch[dest],&size,sizeof(int));
+  array_append(tsk->outbatch[dest],data,size);
+  if (0 != size%BUNDLE_ALIGN) {
+    char padding[BUNDLE_ALIGN];
+    memset(padding,0,BUNDLE_ALIGN);
+    array_append(tsk->outbatch[dest],padding,BUNDLE_ALIGN-size%BUNDLE_ALIGN);
+  }
+  tsk->outbatchcount[dest]++;
+  tsk->msgs_batched++;
+
+  if (BATCH_MAX_BYTES <= tsk->outbatch[dest]->nbytes)
+    msg_flush_dest(tsk,dest);
 }
 
 void msg_fsend(task *tsk, int dest, int tag, const char *fmt, ...)
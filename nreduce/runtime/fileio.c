@@ -0,0 +1,207 @@
+/*
+ * This file is part of the NReduce project
+ * Copyright (C) 2006-2010 Peter Kelly <kellypmk@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * $Id$
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/nreduce.h"
+#include "runtime.h"
+#include "network/node.h"
+#include "messages.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* File I/O service. Opening and reading files can block for an arbitrary amount of time (e.g. on
+   a slow disk or NFS server), so tasks do not do this themselves. Instead, openfd and readchunk
+   send a request to the FILEIO_ID endpoint on the local node and block only the calling frame;
+   the task carries on running other frames until the response arrives, as with socket I/O.
+
+   The FILEIO_ID thread hands each request to one of a pool of worker threads, which perform the
+   system call and reply directly to the task. Requests are queued while all workers are busy, so
+   a single slow file does not hold up reads of other files. The number of workers is set by
+   OPT_FILEIOTHREADS. */
+
+extern int opt_fileiothreads;
+
+typedef struct fileiodispatch {
+  endpointid *idle;
+  int nidle;
+  list *queue;
+} fileiodispatch;
+
+void send_openfile(endpoint *endpt, int ioid, const char *filename)
+{
+  endpointid fileioid = { ip: endpt->n->listenip, port: endpt->n->listenport, localid: FILEIO_ID };
+  int msglen = sizeof(openfile_msg)+strlen(filename)+1;
+  openfile_msg *ofm = (openfile_msg*)calloc(msglen,1);
+  ofm->ioid = ioid;
+  memcpy(ofm->filename,filename,strlen(filename)+1);
+  endpoint_send(endpt,fileioid,MSG_OPENFILE,ofm,msglen);
+  free(ofm);
+}
+
+void send_readfile(endpoint *endpt, int ioid, int fd, int size)
+{
+  endpointid fileioid = { ip: endpt->n->listenip, port: endpt->n->listenport, localid: FILEIO_ID };
+  readfile_msg rfm;
+  memset(&rfm,0,sizeof(rfm));
+  rfm.ioid = ioid;
+  rfm.fd = fd;
+  rfm.size = size;
+  endpoint_send(endpt,fileioid,MSG_READFILE,&rfm,sizeof(rfm));
+}
+
+static void fileio_open(endpoint *endpt, openfile_msg *m, int size)
+{
+  openfile_response_msg resp;
+  assert(sizeof(openfile_msg) < size);
+  assert('\0' == ((char*)m)[size-1]);
+
+  memset(&resp,0,sizeof(resp));
+  resp.ioid = m->ioid;
+  resp.fd = open(m->filename,O_RDONLY);
+  if (0 > resp.fd) {
+    resp.error = errno;
+    snprintf(resp.errmsg,ERRMSG_MAX,"%s: %s",m->filename,strerror(errno));
+  }
+  endpoint_send(endpt,m->replyto,MSG_OPENFILE_RESPONSE,&resp,sizeof(resp));
+}
+
+static void fileio_read(endpoint *endpt, readfile_msg *m)
+{
+  /* The data is read directly into the response message, which the task keeps until it has
+     converted the data into a list */
+  message *msg = message_alloc(sizeof(readfile_response_msg)+m->size);
+  readfile_response_msg *resp = (readfile_response_msg*)msg->data;
+  int r;
+
+  do {
+    r = read(m->fd,resp->data,m->size);
+  } while ((0 > r) && (EINTR == errno));
+
+  resp->ioid = m->ioid;
+  resp->error = (0 > r) ? errno : 0;
+  resp->len = (0 > r) ? 0 : r;
+  msg->size = sizeof(readfile_response_msg)+resp->len;
+  endpoint_send_message(endpt,m->replyto,MSG_READFILE_RESPONSE,msg);
+}
+
+static void fileio_worker(node *n, endpoint *endpt, void *arg)
+{
+  endpointid dispatcher = *(endpointid*)arg;
+  int done = 0;
+  free(arg);
+
+  while (!done) {
+    message *msg = endpoint_receive(endpt,-1);
+    switch (msg->tag) {
+    case MSG_OPENFILE:
+      fileio_open(endpt,(openfile_msg*)msg->data,msg->size);
+      endpoint_send(endpt,dispatcher,MSG_FILEIO_DONE,NULL,0);
+      break;
+    case MSG_READFILE:
+      assert(sizeof(readfile_msg) == msg->size);
+      fileio_read(endpt,(readfile_msg*)msg->data);
+      endpoint_send(endpt,dispatcher,MSG_FILEIO_DONE,NULL,0);
+      break;
+    case MSG_KILL:
+      done = 1;
+      break;
+    default:
+      fatal("fileio worker: unexpected message %d",msg->tag);
+      break;
+    }
+    message_free(msg);
+  }
+}
+
+/* Passes a request on to an idle worker, recording the task it came from so the worker can reply
+   to it directly */
+static void fileio_forward(endpoint *endpt, endpointid worker, message *msg)
+{
+  if (MSG_OPENFILE == msg->tag) {
+    assert(sizeof(openfile_msg) <= msg->size);
+    ((openfile_msg*)msg->data)->replyto = msg->source;
+  }
+  else {
+    assert(sizeof(readfile_msg) == msg->size);
+    ((readfile_msg*)msg->data)->replyto = msg->source;
+  }
+  endpoint_send(endpt,worker,msg->tag,msg->data,msg->size);
+  message_free(msg);
+}
+
+static void fileio_thread(node *n, endpoint *endpt, void *arg)
+{
+  fileiodispatch disp;
+  int nworkers = (0 < opt_fileiothreads) ? opt_fileiothreads : 1;
+  int done = 0;
+  int i;
+
+  memset(&disp,0,sizeof(disp));
+  disp.idle = (endpointid*)calloc(nworkers,sizeof(endpointid));
+  for (i = 0; i < nworkers; i++) {
+    endpointid *dispatcher = (endpointid*)malloc(sizeof(endpointid));
+    *dispatcher = endpt->epid;
+    disp.idle[disp.nidle++] = node_add_thread(n,"fileio",fileio_worker,dispatcher,NULL);
+  }
+
+  while (!done) {
+    message *msg = endpoint_receive(endpt,-1);
+    switch (msg->tag) {
+    case MSG_OPENFILE:
+    case MSG_READFILE:
+      if (0 < disp.nidle)
+        fileio_forward(endpt,disp.idle[--disp.nidle],msg);
+      else
+        list_append(&disp.queue,msg);
+      continue;
+    case MSG_FILEIO_DONE:
+      if (NULL != disp.queue)
+        fileio_forward(endpt,msg->source,(message*)list_pop(&disp.queue));
+      else
+        disp.idle[disp.nidle++] = msg->source;
+      break;
+    case MSG_KILL:
+      done = 1;
+      break;
+    default:
+      fatal("fileio thread: unexpected message %d",msg->tag);
+      break;
+    }
+    message_free(msg);
+  }
+
+  list_free(disp.queue,(list_d_t)message_free);
+  free(disp.idle);
+}
+
+void start_fileio(node *n)
+{
+  node_add_thread2(n,"fileio",fileio_thread,NULL,NULL,FILEIO_ID,0);
+}
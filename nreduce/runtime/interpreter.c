@@ -38,6 +38,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <math.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -46,13 +47,18 @@
 #include <time.h>
 #include <signal.h>
 
-#define FISH_DELAY_MS 250
+/* Idle tasks back off exponentially between FISH requests, starting at FISH_MIN_DELAY_MS,
+   until they receive some work */
+#define FISH_MIN_DELAY_MS 10
+#define FISH_MAX_DELAY_MS 1000
 #define GC_DELAY 2500
 //#define STANDALONE_NOFRAMES_ERROR
 
 extern int opt_postpone;
 extern int opt_fishframes;
 extern int opt_fishhalf;
+extern int opt_gctarget;
+extern int opt_prefetch;
 
 inline void op_begin(task *tsk, frame *runnable, const instruction *instr)
   __attribute__ ((always_inline));
@@ -100,6 +106,8 @@ inline void op_eval(task *tsk, frame *runnable, const instruction *instr)
   __attribute__ ((always_inline));
 inline void op_call(task *tsk, frame *runnable, const instruction *instr)
   __attribute__ ((always_inline));
+inline void op_arith(task *tsk, frame *runnable, const instruction *instr)
+  __attribute__ ((always_inline));
 
 void print_task_sourceloc(task *tsk, FILE *f, sourceloc sl)
 {
@@ -174,7 +182,7 @@ void resume_fetchers(task *tsk, waitqueue *wq, pntr obj) /* Can be called from n
     gaddr *ft = (gaddr*)l->data;
     event_send_respond(tsk,ft->tid,*ft,pntrtype(obj),FUN_RESUME_FETCHERS);
     assert(CELL_FRAME != pntrtype(obj));
-    msg_fsend(tsk,ft->tid,MSG_RESPOND,"ap",*ft,obj);
+    msg_fsend(tsk,ft->tid,MSG_RESPOND,"af",*ft,obj);
   }
   list_free(wq->fetchers,free);
   wq->fetchers = NULL;
@@ -317,6 +325,7 @@ static void send_update(task *tsk)
   um->gciter = tsk->gciter;
   memcpy(um->counts,tsk->gcsent,tsk->groupsize*sizeof(int));
 
+  msg_flush(tsk);
   endpoint_send(tsk->endpt,tsk->gc,MSG_UPDATE,um,msglen);
   for (i = 0; i < tsk->groupsize; i++)
     tsk->gcsent[i] = 0;
@@ -396,12 +405,16 @@ static sysobject *get_frame_sysobject(frame *f)
          (B_STARTLISTEN == f->instr->arg0) ||
          (B_JCALL == f->instr->arg0) ||
          (B_JNEW == f->instr->arg0) ||
-         (B_CONNPAIR == f->instr->arg0));
+         (B_CONNPAIR == f->instr->arg0) ||
+         (B_OPENFD == f->instr->arg0) ||
+         (B_READCHUNK == f->instr->arg0) ||
+         (B_MAPCHUNK == f->instr->arg0));
   assert(1 <= f->instr->expcount);
   objp = f->data[f->instr->expcount-1];
   assert(CELL_SYSOBJECT == pntrtype(objp));
   so = (sysobject*)get_pntr(get_pntr(objp)->field1);
-  assert((SYSOBJECT_CONNECTION == so->type) || (SYSOBJECT_LISTENER == so->type));
+  assert((SYSOBJECT_CONNECTION == so->type) || (SYSOBJECT_LISTENER == so->type) ||
+         (SYSOBJECT_FILE == so->type));
   return so;
 }
 
@@ -481,8 +494,11 @@ static void interpreter_connpair_response(task *tsk, connpair_response_msg *m)
                                            socketid_string(tsk,m->b));
 }
 
-static void interpreter_read_response(task *tsk, read_response_msg *m)
+/* The message is kept until b_readcon() has converted the data into an array, rather than
+   copying the data out of it */
+static void interpreter_read_response(task *tsk, message *msg)
 {
+  read_response_msg *m = (read_response_msg*)msg->data;
   frame *f2 = retrieve_blocked_frame(tsk,m->ioid);
   sysobject *so = get_frame_sysobject(f2);
   assert(SYSOBJECT_CONNECTION == so->type);
@@ -493,9 +509,62 @@ static void interpreter_read_response(task *tsk, read_response_msg *m)
   assert(m->ioid == so->frameids[READ_FRAMEADDR]);
   so->frameids[READ_FRAMEADDR] = 0;
 
+  assert(NULL == so->readmsg);
   so->len = m->len;
-  so->buf = (char*)malloc(m->len);
-  memcpy(so->buf,m->data,m->len);
+  if (0 < m->len) {
+    so->buf = m->data;
+    so->readmsg = msg;
+  }
+  else {
+    message_free(msg);
+  }
+}
+
+static void interpreter_openfile_response(task *tsk, openfile_response_msg *m)
+{
+  frame *f2 = retrieve_blocked_frame(tsk,m->ioid);
+  sysobject *so = get_frame_sysobject(f2);
+  assert(SYSOBJECT_FILE == so->type);
+  assert(B_OPENFD == f2->instr->arg0);
+
+  assert(m->ioid == so->frameids[READ_FRAMEADDR]);
+  so->frameids[READ_FRAMEADDR] = 0;
+
+  if (0 > m->fd) {
+    so->error = 1;
+    so->errn = m->error;
+    memcpy(so->errmsg,m->errmsg,sizeof(so->errmsg));
+  }
+  else {
+    so->fd = m->fd;
+  }
+}
+
+static void interpreter_readfile_response(task *tsk, message *msg)
+{
+  readfile_response_msg *m = (readfile_response_msg*)msg->data;
+  frame *f2 = retrieve_blocked_frame(tsk,m->ioid);
+  sysobject *so = get_frame_sysobject(f2);
+  assert(SYSOBJECT_FILE == so->type);
+  assert((B_READCHUNK == f2->instr->arg0) || (B_MAPCHUNK == f2->instr->arg0));
+  assert(0 == so->len);
+
+  assert(m->ioid == so->frameids[READ_FRAMEADDR]);
+  so->frameids[READ_FRAMEADDR] = 0;
+
+  assert(NULL == so->readmsg);
+  if (m->error) {
+    so->error = 1;
+    so->errn = m->error;
+  }
+  so->len = m->len;
+  if (0 < m->len) {
+    so->buf = m->data;
+    so->readmsg = msg;
+  }
+  else {
+    message_free(msg);
+  }
 }
 
 static void interpreter_write_response(task *tsk, write_response_msg *m)
@@ -567,6 +636,16 @@ static void interpreter_jcmd_response(task *tsk, jcmd_response_msg *m, endpointi
   }
 }
 
+static void get_globtable_stats(globtable *gt, globtable_stats *stats)
+{
+  stats->count = gt->count;
+  stats->size = gt->size;
+  stats->resizes = gt->resizes;
+  stats->maxprobe = gt->maxprobe;
+  stats->lookups = gt->lookups;
+  stats->probes = gt->probes;
+}
+
 static void interpreter_get_stats(task *tsk, get_stats_msg *m)
 {
   get_stats_response_msg gsrm;
@@ -590,10 +669,13 @@ static void interpreter_get_stats(task *tsk, get_stats_msg *m)
   }
 
   /* memory statistics */
-  /* FIXME */
-  assert(0);
+  /* FIXME: cells, bytes and alloc are not filled in */
 /*   memusage(tsk,&gsrm.cells,&gsrm.bytes,&gsrm.alloc,&connections,&listeners); */
 
+  get_globtable_stats(&tsk->targethash,&gsrm.targethash);
+  get_globtable_stats(&tsk->physhash,&gsrm.physhash);
+  get_globtable_stats(&tsk->addrhash,&gsrm.addrhash);
+
   endpoint_send(tsk->endpt,m->sender,MSG_GET_STATS_RESPONSE,&gsrm,sizeof(gsrm));
 }
 
@@ -608,13 +690,72 @@ static int get_idmap_index(task *tsk, endpointid epid)
 
 int count_sparks(task *tsk)
 {
-  int count = 0;
-  frame *spark = tsk->sparklist->sprev;
-  while (spark != tsk->sparklist) {
-    spark = spark->sprev;
-    count++;
+  return tsk->nsparks;
+}
+
+/* SCHEDULE messages start with the number of sparks the sender will have left after giving
+   away nframes of them, so the recipient knows whether it is worth fishing there again */
+array *schedule_start(task *tsk, int nframes)
+{
+  array *wr = write_start();
+  write_int(wr,max(0,tsk->nsparks-nframes));
+  return wr;
+}
+
+static int same_host(task *tsk, int tid)
+{
+  return (tsk->idmap[tid].ip == tsk->endpt->epid.ip);
+}
+
+/* Chooses which task to send a FISH request to. Tasks in the same process that are known to
+   have sparks come first, then the task with the highest spark count we have heard about
+   from other tasks' FISH and SCHEDULE messages, with tasks on the same host counting double.
+   If we have no information at all, the first request after becoming idle goes to another
+   task on this host, and subsequent ones to a random task. */
+static int choose_fish_victim(task *tsk, int exclude)
+{
+  int best = sparkboard_victim(tsk);
+  int bestscore = 0;
+  int nlocal = 0;
+  int i;
+
+  if ((0 <= best) && (best != exclude))
+    return best;
+
+  best = -1;
+  for (i = 0; i < tsk->groupsize; i++) {
+    int score;
+    if ((i == tsk->tid) || (i == exclude))
+      continue;
+    score = same_host(tsk,i) ? 2*tsk->sparkhints[i] : tsk->sparkhints[i];
+    if (score > bestscore) {
+      best = i;
+      bestscore = score;
+    }
+    if (same_host(tsk,i))
+      nlocal++;
+  }
+
+  if (0 <= best) {
+    /* Don't keep asking the same task until we hear from it again */
+    tsk->sparkhints[best] /= 2;
+    return best;
+  }
+
+  if ((0 < nlocal) && (FISH_MIN_DELAY_MS == tsk->fishdelay)) {
+    int n = rand() % nlocal;
+    for (i = 0; i < tsk->groupsize; i++)
+      if ((i != tsk->tid) && (i != exclude) && same_host(tsk,i) && (0 == n--))
+        return i;
   }
-  return count;
+
+  if ((2 >= tsk->groupsize) && (0 <= exclude))
+    return -1;
+
+  do {
+    best = rand() % tsk->groupsize;
+  } while ((best == tsk->tid) || (best == exclude));
+  return best;
 }
 
 static void interpreter_fish(task *tsk, message *msg)
@@ -622,7 +763,9 @@ static void interpreter_fish(task *tsk, message *msg)
   reader rd;
   int reqtsk;
   int age;
+  int hint;
   int scheduled = 0;
+  int dest;
   array *newmsg;
   int from = get_idmap_index(tsk,msg->source);
 
@@ -633,17 +776,22 @@ static void interpreter_fish(task *tsk, message *msg)
   start_address_reading(tsk,from,msg->tag);
   read_int(&rd,&reqtsk);
   read_int(&rd,&age);
+  read_int(&rd,&hint);
   read_end(&rd);
   event_recv_fish(tsk,from,reqtsk,age);
   finish_address_reading(tsk,from,msg->tag);
 
+  tsk->fish_recv++;
+  tsk->sparkhints[from] = hint;
+  tsk->sparkhints[reqtsk] = 0;
+
   if (opt_fishhalf) {
     /* Schedule half of all sparks to the requestor */
 
-    newmsg = write_start();
+    int nsparks = count_sparks(tsk);
+    int nframes = nsparks/2;
+    newmsg = schedule_start(tsk,nframes);
     if (reqtsk != tsk->tid) {
-      int nsparks = count_sparks(tsk);
-      int nframes = nsparks/2;
       while (0 < nframes) {
         frame *spark = tsk->sparklist->sprev;
 
@@ -666,7 +814,7 @@ static void interpreter_fish(task *tsk, message *msg)
     if (reqtsk == tsk->tid)
       return;
 
-    newmsg = write_start();
+    newmsg = schedule_start(tsk,opt_fishframes);
 
     int nframes = opt_fishframes;
     while (0 < nframes) {
@@ -686,17 +834,14 @@ static void interpreter_fish(task *tsk, message *msg)
   }
 
   if (0 < scheduled) {
+    tsk->frames_sent += scheduled;
     msg_send(tsk,reqtsk,MSG_SCHEDULE,newmsg->data,newmsg->nbytes);
   }
-  else if (0 < age--) {
-    int dest;
+  else if ((0 < age--) && (0 <= (dest = choose_fish_victim(tsk,reqtsk)))) {
     /*       dest = (tsk->tid+1) % tsk->groupsize; */
-    do {
-      dest = rand() % tsk->groupsize;
-    } while (dest == tsk->tid);
-
     event_send_fish(tsk,dest,reqtsk,age,FUN_INTERPRETER_FISH);
-    msg_fsend(tsk,dest,MSG_FISH,"ii",reqtsk,age);
+    msg_fsend(tsk,dest,MSG_FISH,"iii",reqtsk,age,tsk->nsparks);
+    tsk->fish_forwarded++;
   }
 
   write_end(newmsg);
@@ -786,7 +931,7 @@ static void interpreter_fetch(task *tsk, message *msg)
   }
   else {
     event_send_respond(tsk,from,storeaddr,pntrtype(obj),FUN_INTERPRETER_FETCH);
-    msg_fsend(tsk,from,MSG_RESPOND,"ap",storeaddr,obj);
+    msg_fsend(tsk,from,MSG_RESPOND,"af",storeaddr,obj);
   }
 }
 
@@ -983,6 +1128,7 @@ static void interpreter_schedule(task *tsk, message *msg)
   start_address_reading(tsk,from,msg->tag);
 
   reader rd = read_start(tsk,msg->data,msg->size);
+  read_int(&rd,&tsk->sparkhints[from]);
   while (rd.pos < rd.size) {
     /* Read the frame and originating address */
     gaddr srcaddr;
@@ -1009,11 +1155,13 @@ static void interpreter_schedule(task *tsk, message *msg)
     resolve_local_fetchers(tsk,newf);
 
     run_frame_after_first(tsk,newf);
+    tsk->frames_recv++;
   }
   read_end(&rd);
   finish_address_reading(tsk,from,msg->tag);
 
   tsk->newfish = 1;
+  tsk->fishdelay = FISH_MIN_DELAY_MS;
 }
 
 static void interpreter_ack(task *tsk, message *msg)
@@ -1076,6 +1224,7 @@ static void interpreter_startdistgc(task *tsk, startdistgc_msg *m)
   tsk->gciter = m->gciter;
 /*   clear_marks(tsk,FLAG_DMB); */
 
+  msg_flush(tsk);
   endpoint_send(tsk->endpt,tsk->gc,MSG_STARTDISTGCACK,NULL,0);
 }
 
@@ -1103,6 +1252,17 @@ static void interpreter_markroots(task *tsk)
   tsk->inmark = 0;
 }
 
+/* Sends the marks accumulated while processing one or more MARKENTRY messages, grouped into a
+   single MARKENTRY per destination task, followed by one UPDATE to the garbage collector */
+static void flush_marks(task *tsk)
+{
+  if (tsk->markspending) {
+    send_mark_messages(tsk);
+    send_update(tsk);
+    tsk->markspending = 0;
+  }
+}
+
 static void interpreter_markentry(task *tsk, message *msg)
 {
   /* A DAMT (Distributed Address Marking Task) */
@@ -1124,9 +1284,12 @@ static void interpreter_markentry(task *tsk, message *msg)
 
   assert(tsk->indistgc);
 
-  /* sanity check: shouldn't have any pending mark messages at this point */
-  for (pid = 0; pid < tsk->groupsize; pid++)
-    assert(0 == array_count(tsk->distmarks[pid]));
+  /* sanity check: shouldn't have any pending mark messages at this point, unless they are from
+     earlier MARKENTRY messages in the same bundle */
+  if (!tsk->markspending) {
+    for (pid = 0; pid < tsk->groupsize; pid++)
+      assert(0 == array_count(tsk->distmarks[pid]));
+  }
   tsk->inmark = 1;
 
   start_address_reading(tsk,from,tag);
@@ -1147,8 +1310,10 @@ static void interpreter_markentry(task *tsk, message *msg)
   mark_end(tsk,FLAG_DMB);
   finish_address_reading(tsk,from,tag);
 
-  send_mark_messages(tsk);
-  send_update(tsk);
+  /* Within a bundle, the marks are sent once all the MARKENTRY messages in it have been handled */
+  tsk->markspending = 1;
+  if (!tsk->inbundle)
+    flush_marks(tsk);
   tsk->inmark = 0;
 }
 
@@ -1169,6 +1334,7 @@ static void interpreter_sweep(task *tsk, message *msg)
   tsk->newcellflags &= ~FLAG_NEW;
 
   event_send_sweepack(tsk);
+  msg_flush(tsk);
   endpoint_send(tsk->endpt,tsk->gc,MSG_SWEEPACK,NULL,0);
 }
 
@@ -1176,6 +1342,7 @@ static void maybe_pauseack(task *tsk)
 {
   if (tsk->paused && (tsk->groupsize-1 == tsk->gotpause)) {
     event_send_pauseack(tsk);
+    msg_flush(tsk);
     endpoint_send(tsk->endpt,tsk->gc,MSG_PAUSEACK,NULL,0);
   }
 }
@@ -1189,6 +1356,7 @@ static void interpreter_pause(task *tsk, message *msg)
     endpoint_link(tsk->endpt,tsk->gc);
   }
   tsk->paused = 1;
+  msg_flush(tsk);
   int i;
   for (i = 0; i < tsk->groupsize; i++) {
     if (i != tsk->tid) {
@@ -1313,9 +1481,62 @@ static void interpreter_delete_replicas(task *tsk, message *msg)
   }
 }
 
-static void handle_message(task *tsk, message *msg)
+static int dispatch_message(task *tsk, message *msg);
+
+/* Handles each of the messages in a bundle in turn, without copying them out of it. Each
+   sub-message's header is written into the bytes just before its data, overwriting its tag and
+   size and the end of the records that have already been handled (or, for the first one, the
+   bundle's own header). Records are padded to BUNDLE_ALIGN bytes, so the header is aligned the
+   same way as that of any other message. None of the message types sent in bundles keep a
+   reference to the message once their handler returns. */
+static void interpreter_bundle(task *tsk, message *msg)
+{
+  endpointid source = msg->source;
+  endpointid dest = msg->dest;
+  uint32_t total = msg->size;
+  char *data = msg->data;
+  uint32_t pos = 0;
+
+  tsk->inbundle++;
+  while (pos < total) {
+    message *sub;
+    int tag;
+    int size;
+
+    assert(pos+2*sizeof(int) <= total);
+    assert(0 == pos%BUNDLE_ALIGN);
+    memcpy(&tag,&data[pos],sizeof(int));
+    memcpy(&size,&data[pos+sizeof(int)],sizeof(int));
+    pos += 2*sizeof(int);
+    assert(pos+size <= total);
+
+    sub = (message*)(&data[pos]-offsetof(message,data));
+    sub->next = NULL;
+    sub->prev = NULL;
+    sub->source = source;
+    sub->dest = dest;
+    sub->tag = tag;
+    sub->size = size;
+    pos += size;
+    if (0 != pos%BUNDLE_ALIGN)
+      pos += BUNDLE_ALIGN-pos%BUNDLE_ALIGN;
+
+    if (MSG_MARKENTRY != tag)
+      flush_marks(tsk);
+    if (dispatch_message(tsk,sub))
+      fatal("interpreter: message %d cannot be sent in a bundle",tag);
+  }
+  tsk->inbundle--;
+  flush_marks(tsk);
+}
+
+/* Returns 1 if the handler has kept the message, which it will free once it is finished with it */
+static int dispatch_message(task *tsk, message *msg)
 {
   switch (msg->tag) {
+  case MSG_BUNDLE:
+    interpreter_bundle(tsk,msg);
+    break;
   case MSG_FISH:
     interpreter_fish(tsk,msg);
     break;
@@ -1362,8 +1583,8 @@ static void handle_message(task *tsk, message *msg)
     break;
   case MSG_READ_RESPONSE:
     assert(sizeof(read_response_msg) <= msg->size);
-    interpreter_read_response(tsk,(read_response_msg*)msg->data);
-    break;
+    interpreter_read_response(tsk,msg);
+    return 1; /* message is freed once the data has been used */
   case MSG_WRITE_RESPONSE:
     assert(sizeof(write_response_msg) == msg->size);
     interpreter_write_response(tsk,(write_response_msg*)msg->data);
@@ -1372,6 +1593,14 @@ static void handle_message(task *tsk, message *msg)
     assert(sizeof(connection_closed_msg) == msg->size);
     interpreter_connection_closed(tsk,(connection_closed_msg*)msg->data);
     break;
+  case MSG_OPENFILE_RESPONSE:
+    assert(sizeof(openfile_response_msg) == msg->size);
+    interpreter_openfile_response(tsk,(openfile_response_msg*)msg->data);
+    break;
+  case MSG_READFILE_RESPONSE:
+    assert(sizeof(readfile_response_msg) <= msg->size);
+    interpreter_readfile_response(tsk,msg);
+    return 1; /* message is freed once the data has been used */
   case MSG_JCMD_RESPONSE:
     assert(sizeof(jcmd_response_msg) <= msg->size);
     interpreter_jcmd_response(tsk,(jcmd_response_msg*)msg->data,msg->source);
@@ -1422,7 +1651,13 @@ static void handle_message(task *tsk, message *msg)
     fatal("interpreter: unexpected message %d",msg->tag);
     break;
   }
-  message_free(msg);
+  return 0;
+}
+
+static void handle_message(task *tsk, message *msg)
+{
+  if (!dispatch_message(tsk,msg))
+    message_free(msg);
 }
 
 #ifdef STANDALONE_NOFRAMES_ERROR
@@ -1512,12 +1747,7 @@ int find_spark(task *tsk)
   return 0;
 }
 
-/* Note: handle_interrupt() should never change the frame at the head of the runnable queue
-   unless the queue is empty. This is because when handle_trap() returns, it will go back to
-   an EIP which is within the code for the current frame. If the current frame changes, EBP
-   will be updated to have its new value, and the program will be running the code for one frame
-   with the EBP set to another. */
-int handle_interrupt(task *tsk)
+static int process_interrupt(task *tsk)
 {
   struct timeval now;
   message *msg;
@@ -1527,6 +1757,8 @@ int handle_interrupt(task *tsk)
   if (tsk->done)
     return 1;
 
+  sparkboard_publish(tsk);
+
   if (tsk->need_minor) {
     local_collect(tsk);
 
@@ -1562,6 +1794,7 @@ int handle_interrupt(task *tsk)
   }
 
   while (tsk->paused) {
+    msg_flush(tsk);
     msg = endpoint_receive(tsk->endpt,-1);
     handle_message(tsk,msg);
     if (tsk->done)
@@ -1592,6 +1825,13 @@ int handle_interrupt(task *tsk)
     if (find_spark(tsk))
       return 0;
 
+    /* Now is a good time to do any major collection that was put off to keep pause
+       times low */
+    if (tsk->major_deferred) {
+      force_major_collection(tsk);
+      return 0;
+    }
+
     gettimeofday(&now,NULL);
     diffms = timeval_diffms(now,tsk->nextfish);
 
@@ -1602,18 +1842,19 @@ int handle_interrupt(task *tsk)
         (1 < tsk->groupsize)) {
       int dest;
 
-      /* avoid sending another until after the sleep period */
+      /* avoid sending another until after the sleep period, which doubles each time we
+         go without getting any work */
 
-      int delay = FISH_DELAY_MS + ((rand() % 1000) * FISH_DELAY_MS / 1000);
-      tsk->nextfish = timeval_addms(tsk->nextfish,delay);
+      int delay = tsk->fishdelay + ((rand() % 1000) * tsk->fishdelay / 1000);
+      tsk->nextfish = timeval_addms(now,delay);
+      tsk->fishdelay = min(2*tsk->fishdelay,FISH_MAX_DELAY_MS);
 
 /*       dest = (tsk->tid+1) % tsk->groupsize; */
-      do {
-        dest = rand() % tsk->groupsize;
-      } while (dest == tsk->tid);
+      dest = choose_fish_victim(tsk,-1);
 
       event_send_fish(tsk,dest,tsk->tid,tsk->groupsize,FUN_HANDLE_INTERRUPT);
-      msg_fsend(tsk,dest,MSG_FISH,"ii",tsk->tid,tsk->groupsize);
+      msg_fsend(tsk,dest,MSG_FISH,"iii",tsk->tid,tsk->groupsize,tsk->nsparks);
+      tsk->fish_sent++;
       tsk->newfish = 0;
     }
 
@@ -1627,7 +1868,8 @@ int handle_interrupt(task *tsk)
       endpoint_interrupt(tsk->endpt); /* may be another one */
     }
 
-    msg = endpoint_receive(tsk->endpt,FISH_DELAY_MS);
+    msg_flush(tsk);
+    msg = endpoint_receive(tsk->endpt,tsk->fishdelay);
 
     if (NULL != msg)
       handle_message(tsk,msg);
@@ -1638,6 +1880,21 @@ int handle_interrupt(task *tsk)
   return 0;
 }
 
+/* Note: handle_interrupt() should never change the frame at the head of the runnable queue
+   unless the queue is empty. This is because when handle_trap() returns, it will go back to
+   an EIP which is within the code for the current frame. If the current frame changes, EBP
+   will be updated to have its new value, and the program will be running the code for one frame
+   with the EBP set to another. */
+int handle_interrupt(task *tsk)
+{
+  int r;
+  tsk->in_interrupt = 1;
+  r = process_interrupt(tsk);
+  tsk->in_interrupt = 0;
+  msg_flush(tsk);
+  return r;
+}
+
 inline void op_begin(task *tsk, frame *runnable, const instruction *instr)
 {
 }
@@ -2155,6 +2412,37 @@ void make_item_frame(task *tsk, frame *runnable, int expcount, int pos)
   make_pntr(runnable->data[expcount-1],newfholder);
 }
 
+inline void op_arith(task *tsk, frame *runnable, const instruction *instr)
+{
+  pntr *argstack = &runnable->data[instr->expcount-2];
+  double a;
+  double b;
+  double r;
+
+  if ((CELL_NUMBER != pntrtype(argstack[1])) || (CELL_NUMBER != pntrtype(argstack[0]))) {
+    builtin_info[instr->arg0].f(tsk,argstack);
+    return;
+  }
+
+  a = pntrdouble(argstack[1]);
+  b = pntrdouble(argstack[0]);
+
+  switch (instr->arg0) {
+  case B_ADD:      r = a + b;       break;
+  case B_SUBTRACT: r = a - b;       break;
+  case B_MULTIPLY: r = a * b;       break;
+  case B_DIVIDE:   r = a / b;       break;
+  case B_MOD:      r = fmod(a,b);   break;
+  default:         abort();         break;
+  }
+
+  /* NaNs must be stored in the canonical form, which the builtin takes care of */
+  if (isnan(r))
+    builtin_info[instr->arg0].f(tsk,argstack);
+  else
+    set_pntrdouble(argstack[0],r);
+}
+
 inline void op_itemn(task *tsk, frame *runnable, const instruction *instr)
 {
   int pos = instr->arg0;
@@ -2202,8 +2490,8 @@ void interpreter_sigfpe(int sig, siginfo_t *ino, void *uc1)
   frame *f = *tsk->runptr;
   const instruction *instr = f->instr-1;
 
-  if ((OP_BIF == instr->opcode) || (OP_JCMP == instr->opcode)) {
-    int bif = (OP_BIF == instr->opcode) ? instr->arg0 : instr->arg1;
+  if ((OP_BIF == instr->opcode) || (OP_ARITH == instr->opcode) || (OP_JCMP == instr->opcode)) {
+    int bif = (OP_JCMP == instr->opcode) ? instr->arg1 : instr->arg0;
     pntr *argstack = &f->data[instr->expcount-2];
     if ((2 == builtin_info[bif].nargs) &&
         ((CELL_NUMBER != pntrtype(argstack[1])) || (CELL_NUMBER != pntrtype(argstack[0]))))
@@ -2261,6 +2549,29 @@ static void idmap_setup(node *n, endpoint *endpt, task *tsk)
   }
 }
 
+#ifdef THREADED_DISPATCH
+/* Prepares the task's copy of the bytecode for the threaded engine, by storing the address
+   of the code that implements each instruction in its code field. Common sequences are
+   replaced by superinstructions, which execute both instructions without an intervening
+   dispatch. Only the first instruction of a pair is changed, so a jump to (or a retry of)
+   the second one still executes it on its own. */
+static void threaded_decode(task *tsk, void **labels, void *pusheval, void *mkframespark)
+{
+  instruction *program_ops = (instruction*)bc_instructions(tsk->bcdata);
+  int nops = ((bcheader*)tsk->bcdata)->nops;
+  int i;
+  for (i = 0; i < nops; i++) {
+    int next = (i+1 < nops) ? program_ops[i+1].opcode : OP_INVALID;
+    if ((OP_PUSH == program_ops[i].opcode) && (OP_EVAL == next))
+      program_ops[i].code = pusheval;
+    else if ((OP_MKFRAME == program_ops[i].opcode) && (OP_SPARK == next))
+      program_ops[i].code = mkframespark;
+    else
+      program_ops[i].code = labels[program_ops[i].opcode];
+  }
+}
+#endif
+
 void interpreter_thread(node *n, endpoint *endpt, void *arg)
 {
   task *tsk = (task*)arg;
@@ -2281,12 +2592,14 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg)
 
   node_log(tsk->n,LOG_INFO,"opt_postpone = %d",opt_postpone);
   node_log(tsk->n,LOG_INFO,"opt_fishframes = %d",opt_fishframes);
+  node_log(tsk->n,LOG_INFO,"opt_prefetch = %d",opt_prefetch);
 
   write(tsk->threadrunningfds[1],&semdata,1);
 
   idmap_setup(n,endpt,tsk);
 
   tsk->newfish = 1;
+  tsk->fishdelay = FISH_MIN_DELAY_MS;
 
   gettimeofday(&tsk->nextfish,NULL);
   gettimeofday(&tsk->nextgc,NULL);
@@ -2299,6 +2612,7 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg)
   gettimeofday(&start,NULL);
 
   event_task_start(tsk);
+  sparkboard_register(tsk);
 
   if (0 == tsk->tid) {
     frame *initial = frame_new(tsk);
@@ -2312,6 +2626,7 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg)
     run_frame(tsk,initial);
   }
 
+#ifdef NATIVE_SUPPORTED
   if (ENGINE_NATIVE == engine_type) {
 
     native_compile(tsk->bcdata,tsk->bcsize,tsk);
@@ -2330,10 +2645,117 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg)
        Linux for some reason, otherwise SIGFPEs get re-raised. */
     asm("fnclex");
   }
-  else if (0 != setjmp(tsk->jbuf)) {
+  else
+#endif
+  if (0 != setjmp(tsk->jbuf)) {
     /* skip any futher interpretation */
     handle_error(tsk);
   }
+#ifdef THREADED_DISPATCH
+  else if (ENGINE_THREADED == engine_type) {
+    static void *labels[OP_COUNT] = {
+      [OP_BEGIN] = &&do_begin,
+      [OP_END] = &&do_end,
+      [OP_GLOBSTART] = &&do_globstart,
+      [OP_SPARK] = &&do_spark,
+      [OP_RETURN] = &&do_return,
+      [OP_DO] = &&do_do,
+      [OP_JFUN] = &&do_jfun,
+      [OP_JFALSE] = &&do_jfalse,
+      [OP_JUMP] = &&do_jump,
+      [OP_PUSH] = &&do_push,
+      [OP_UPDATE] = &&do_update,
+      [OP_ALLOC] = &&do_alloc,
+      [OP_SQUEEZE] = &&do_squeeze,
+      [OP_MKCAP] = &&do_mkcap,
+      [OP_MKFRAME] = &&do_mkframe,
+      [OP_BIF] = &&do_bif,
+      [OP_PUSHNIL] = &&do_pushnil,
+      [OP_PUSHNUMBER] = &&do_pushnumber,
+      [OP_PUSHSTRING] = &&do_pushstring,
+      [OP_POP] = &&do_pop,
+      [OP_ERROR] = &&do_error,
+      [OP_EVAL] = &&do_eval,
+      [OP_CALL] = &&do_call,
+      [OP_JCMP] = &&do_jcmp,
+      [OP_CONSN] = &&do_consn,
+      [OP_ITEMN] = &&do_itemn,
+      [OP_JEQ] = &&do_jeq,
+      [OP_ARITH] = &&do_arith,
+      [OP_INVALID] = &&do_invalid,
+    };
+
+#ifdef PROFILING
+#define THREADED_COUNT { tsk->stats.ninstrs++; \
+                         tsk->stats.usage[runnable->instr-program_ops-1]++; }
+#else
+#define THREADED_COUNT
+#endif
+
+#define THREADED_NEXT { if (endpt->interrupt) goto do_interrupt; \
+                        instr = runnable->instr++; \
+                        THREADED_COUNT \
+                        goto *instr->code; }
+
+    threaded_decode(tsk,labels,&&do_push_eval,&&do_mkframe_spark);
+    THREADED_NEXT;
+
+  do_interrupt:
+    endpt->interrupt = 0;
+    if (handle_interrupt(tsk))
+      goto do_finished;
+    assert(runnable || endpt->interrupt);
+    THREADED_NEXT;
+
+  do_begin:      op_begin(tsk,runnable,instr);      THREADED_NEXT;
+  do_end:        op_end(tsk,runnable,instr);        THREADED_NEXT;
+  do_globstart:  abort();
+  do_spark:      op_spark(tsk,runnable,instr);      THREADED_NEXT;
+  do_return:     op_return(tsk,runnable,instr);     THREADED_NEXT;
+  do_do:         op_do(tsk,runnable,instr);         THREADED_NEXT;
+  do_jfun:       op_jfun(tsk,runnable,instr);       THREADED_NEXT;
+  do_jfalse:     op_jfalse(tsk,runnable,instr);     THREADED_NEXT;
+  do_jump:       op_jump(tsk,runnable,instr);       THREADED_NEXT;
+  do_push:       op_push(tsk,runnable,instr);       THREADED_NEXT;
+  do_update:     op_update(tsk,runnable,instr);     THREADED_NEXT;
+  do_alloc:      op_alloc(tsk,runnable,instr);      THREADED_NEXT;
+  do_squeeze:    op_squeeze(tsk,runnable,instr);    THREADED_NEXT;
+  do_mkcap:      op_mkcap(tsk,runnable,instr);      THREADED_NEXT;
+  do_mkframe:    op_mkframe(tsk,runnable,instr);    THREADED_NEXT;
+  do_bif:        op_bif(tsk,runnable,instr);        THREADED_NEXT;
+  do_pushnil:    op_pushnil(tsk,runnable,instr);    THREADED_NEXT;
+  do_pushnumber: op_pushnumber(tsk,runnable,instr); THREADED_NEXT;
+  do_pushstring: op_pushstring(tsk,runnable,instr); THREADED_NEXT;
+  do_pop:        op_pop(tsk,runnable,instr);        THREADED_NEXT;
+  do_error:      op_error(tsk,runnable,instr);      THREADED_NEXT;
+  do_eval:       op_eval(tsk,runnable,instr);       THREADED_NEXT;
+  do_call:       op_call(tsk,runnable,instr);       THREADED_NEXT;
+  do_jcmp:       op_jcmp(tsk,runnable,instr);       THREADED_NEXT;
+  do_consn:      op_consn(tsk,runnable,instr);      THREADED_NEXT;
+  do_itemn:      op_itemn(tsk,runnable,instr);      THREADED_NEXT;
+  do_jeq:        op_jeq(tsk,runnable,instr);        THREADED_NEXT;
+  do_arith:      op_arith(tsk,runnable,instr);      THREADED_NEXT;
+  do_invalid:    op_invalid(tsk,runnable,instr);    THREADED_NEXT;
+
+    /* Superinstructions. Neither PUSH nor MKFRAME change the current frame or the
+       instruction pointer, so the second instruction can always follow on directly. */
+  do_push_eval:
+    op_push(tsk,runnable,instr);
+    instr = runnable->instr++;
+    THREADED_COUNT
+    op_eval(tsk,runnable,instr);
+    THREADED_NEXT;
+  do_mkframe_spark:
+    op_mkframe(tsk,runnable,instr);
+    instr = runnable->instr++;
+    THREADED_COUNT
+    op_spark(tsk,runnable,instr);
+    THREADED_NEXT;
+
+  do_finished:
+    ;
+  }
+#endif
   else {
 
     while (1) {
@@ -2432,6 +2854,9 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg)
       case OP_JEQ:
         op_jeq(tsk,runnable,instr);
         break;
+      case OP_ARITH:
+        op_arith(tsk,runnable,instr);
+        break;
       case OP_CONSN:
         op_consn(tsk,runnable,instr);
         break;
@@ -2460,8 +2885,15 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg)
   double majorpct = 100.0*((double)tsk->majorms)/((double)totalms);
 
   node_log(tsk->n,LOG_INFO,"Task completed; total %d run %d gc %d gcpct %.2f%%"
-           " minor %.2f%% major %.2f%%",
-           totalms,runms,gcms,gcpct,minorpct,majorpct);
+           " minor %.2f%% major %.2f%% gctarget %d%% nursery %dkb skipmajors %d",
+           totalms,runms,gcms,gcpct,minorpct,majorpct,
+           opt_gctarget,tsk->nurserybytes/1024,tsk->skipmajors);
+  node_log(tsk->n,LOG_INFO,"Fishing: fish sent %d received %d forwarded %d"
+           " frames sent %d received %d",tsk->fish_sent,tsk->fish_recv,tsk->fish_forwarded,
+           tsk->frames_sent,tsk->frames_recv);
+  node_log(tsk->n,LOG_INFO,"Prefetch: objects sent %d",tsk->prefetched);
+  node_log(tsk->n,LOG_INFO,"Batching: messages %d batches sent %d",
+           tsk->msgs_batched,tsk->batches_sent);
   #ifdef OBJECT_LIFETIMES
   int bucket;
   node_log(tsk->n,LOG_INFO,"Task ages: (mb/count)");
@@ -2471,10 +2903,12 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg)
   }
   #endif
   #ifdef PROFILING
-  if (ENGINE_INTERPRETER == engine_type)
+  if ((ENGINE_INTERPRETER == engine_type) || (ENGINE_THREADED == engine_type))
     print_profile(tsk);
   #endif
   tsk->done = 1;
+  msg_flush(tsk);
   event_task_end(tsk);
+  sparkboard_unregister(tsk);
   task_free(tsk);
 }
@@ -46,7 +46,7 @@
 #define DISTGC_DELAY 30000
 #define DEBUG_DISTGC
 
-#define PAUSE_DURING_GC
+extern int opt_distgcpause;
 
 void pause_all(node *n, endpoint *endpt, gcarg *ga)
 {
@@ -81,6 +81,42 @@ void check_all_refs(node *n, endpoint *endpt, gcarg *ga)
   node_log(n,LOG_DEBUG1,"gc_thread: sent checkallrefs message to all tasks");
 }
 
+/* How long each phase of a distributed collection took, reported once the cycle completes. With
+   opt_distgcpause set to DISTGC_PAUSE_MARK (the default), tasks are paused only until marking
+   has finished; sweeping runs concurrently with the program, since anything left unmarked at that
+   point can no longer be reached by it. Marking itself is still stop-the-world in this mode. Once
+   the sweep is done tasks are paused again briefly so that all remaining references can be
+   checked, as check_all_refs cannot give a meaningful answer while objects are being created and
+   sent. DISTGC_PAUSE_ALL keeps tasks paused until the sweep has
+   completed and all references have been checked, and DISTGC_PAUSE_NONE does not pause tasks at
+   all, relying on FLAG_NEW and in-flight address tracking to protect objects created or sent
+   while marking is in progress. */
+typedef struct {
+  struct timeval start;
+  struct timeval paused;
+  struct timeval started;
+  struct timeval marked;
+  struct timeval resumed;
+  struct timeval checkstart;
+  int updates;
+} gctimes;
+
+static void log_gc_times(node *n, int gciter, gctimes *gt, struct timeval end)
+{
+  int stopped = 0;
+  if (DISTGC_PAUSE_NONE != opt_distgcpause)
+    stopped = timeval_diffms(gt->start,gt->resumed);
+  if (DISTGC_PAUSE_MARK == opt_distgcpause)
+    stopped += timeval_diffms(gt->checkstart,end);
+  node_log(n,LOG_INFO,"gc_thread: collection %d took %dms: pause %dms, start %dms, "
+           "mark %dms (%d updates), sweep %dms, tasks stopped for %dms",gciter,
+           timeval_diffms(gt->start,end),
+           timeval_diffms(gt->start,gt->paused),
+           timeval_diffms(gt->paused,gt->started),
+           timeval_diffms(gt->started,gt->marked),gt->updates,
+           timeval_diffms(gt->marked,end),stopped);
+}
+
 static void gc_thread(node *n, endpoint *endpt, void *arg)
 {
   gcarg *ga = (gcarg*)arg;
@@ -92,6 +128,7 @@ static void gc_thread(node *n, endpoint *endpt, void *arg)
   int rem_startacks = 0;
   int rem_sweepacks = 0;
   int gciter = 0;
+  gctimes gt;
 
   #ifdef DEBUG_DISTGC
   node_log(n,LOG_DEBUG1,"gc_thread");
@@ -114,9 +151,11 @@ static void gc_thread(node *n, endpoint *endpt, void *arg)
       assert(!ingc);
       ingc = 1;
 
-      #ifdef PAUSE_DURING_GC
-      pause_all(n,endpt,ga);
-      #endif
+      memset(&gt,0,sizeof(gt));
+      gettimeofday(&gt.start,NULL);
+      if (DISTGC_PAUSE_NONE != opt_distgcpause)
+        pause_all(n,endpt,ga);
+      gettimeofday(&gt.paused,NULL);
 
       for (i = 0; i < ga->ntasks; i++)
         endpoint_send(endpt,ga->idmap[i],MSG_STARTDISTGC,&sm,sizeof(sm));
@@ -134,6 +173,7 @@ static void gc_thread(node *n, endpoint *endpt, void *arg)
         #ifdef DEBUG_DISTGC
         node_log(n,LOG_DEBUG1,"gc_thread: All tasks have received STARTDISTGC");
         #endif
+        gettimeofday(&gt.started,NULL);
         memset(count,0,ga->ntasks*sizeof(int));
 
         for (i = 0; i < ga->ntasks; i++) {
@@ -152,6 +192,7 @@ static void gc_thread(node *n, endpoint *endpt, void *arg)
 
       for (i = 0; i < ga->ntasks; i++)
         count[i] += m->counts[i];
+      gt.updates++;
 
       #ifdef DEBUG_DISTGC
       array *tmp = array_new(1,0);
@@ -171,6 +212,11 @@ static void gc_thread(node *n, endpoint *endpt, void *arg)
         #ifdef DEBUG_DISTGC
         node_log(n,LOG_DEBUG1,"gc_thread: Mark done");
         #endif
+        gettimeofday(&gt.marked,NULL);
+        if (DISTGC_PAUSE_MARK == opt_distgcpause) {
+          resume_all(n,endpt,ga);
+          gettimeofday(&gt.resumed,NULL);
+        }
         for (i = 0; i < ga->ntasks; i++)
           endpoint_send(endpt,ga->idmap[i],MSG_SWEEP,NULL,0);
         rem_sweepacks = ga->ntasks;
@@ -183,6 +229,7 @@ static void gc_thread(node *n, endpoint *endpt, void *arg)
       assert(0 < rem_sweepacks);
       rem_sweepacks--;
       if (0 == rem_sweepacks) {
+        struct timeval end;
         #ifdef DEBUG_DISTGC
         node_log(n,LOG_DEBUG1,"gc_thread: Distributed garbage collection completed");
         #endif
@@ -192,10 +239,19 @@ static void gc_thread(node *n, endpoint *endpt, void *arg)
           assert(0 == count[i]);
         }
 
-        #ifdef PAUSE_DURING_GC
-        check_all_refs(n,endpt,ga);
-        resume_all(n,endpt,ga);
-        #endif
+        if (DISTGC_PAUSE_MARK == opt_distgcpause) {
+          gettimeofday(&gt.checkstart,NULL);
+          pause_all(n,endpt,ga);
+          check_all_refs(n,endpt,ga);
+          resume_all(n,endpt,ga);
+        }
+        else if (DISTGC_PAUSE_ALL == opt_distgcpause) {
+          check_all_refs(n,endpt,ga);
+          resume_all(n,endpt,ga);
+          gettimeofday(&gt.resumed,NULL);
+        }
+        gettimeofday(&end,NULL);
+        log_gc_times(n,gciter,&gt,end);
       }
       break;
     }
@@ -0,0 +1,168 @@
+/*
+ * This file is part of the NReduce project
+ * Copyright (C) 2006-2010 Peter Kelly <kellypmk@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * $Id$
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/nreduce.h"
+#include "runtime.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Memory-mapped files. Rather than reading a file into the heap, the mapchunk builtin maps it
+   into memory one chunk at a time, and returns each chunk as a string whose array object refers
+   directly to the mapped data. Scanning through the file thus allocates only one AREF cell per
+   chunk, and the data itself is paged in by the kernel as it is accessed.
+
+   Each chunk is placed in its own region of the heap arena (so that it can be referenced by a
+   pntr), consisting of a writable page followed by the read-only mapping of the file. The carray
+   header goes at the end of the first page, so that its elements are the file's data. These
+   arrays are marked with FLAG_PINNED, which tells the garbage collector never to copy them, and
+   with multiref, so they are never appended to.
+
+   Once the end of the file has been reached, the file is closed but the chunks remain mapped
+   until a major collection finds that none of them are referenced any more (see
+   sweep_mapped_files()). The file must not be truncated while it is being used. */
+
+#define MAPCHUNK_BYTES MAX_ARRAY_SIZE
+
+static long page_size(void)
+{
+  static long size = 0;
+  if (0 == size)
+    size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+static carray *chunk_array(mappedfile *mf, int chunkno)
+{
+  return (carray*)(mf->regions[chunkno]+page_size()-sizeof(carray));
+}
+
+/* Returns the mapping state for a file. If the file cannot be mapped (e.g. because it is a pipe
+   or terminal), fallback is set and the caller should read it in the normal way instead. */
+mappedfile *mapfile_new(int fd)
+{
+  mappedfile *mf = (mappedfile*)calloc(1,sizeof(mappedfile));
+  struct stat statbuf;
+
+  /* The array header must be aligned for it to sit directly before the data */
+  if ((0 != sizeof(carray)%8) || (0 != MAPCHUNK_BYTES%page_size()) ||
+      (0 > fd) || (0 > fstat(fd,&statbuf)) || !S_ISREG(statbuf.st_mode) ||
+      (0 == statbuf.st_size)) {
+    mf->fallback = 1;
+    return mf;
+  }
+
+  mf->size = statbuf.st_size;
+  mf->nchunks = (mf->size+MAPCHUNK_BYTES-1)/MAPCHUNK_BYTES;
+  mf->regions = (char**)calloc(mf->nchunks,sizeof(char*));
+  return mf;
+}
+
+void mapfile_free(mappedfile *mf)
+{
+  int i;
+  for (i = 0; i < mf->nextchunk; i++)
+    arena_region_free(mf->regions[i],page_size()+MAPCHUNK_BYTES);
+  free(mf->regions);
+  free(mf);
+}
+
+/* Maps the next chunk of the file, returning NULL (with errno set) on failure */
+carray *mapfile_next_chunk(task *tsk, mappedfile *mf, int fd)
+{
+  int chunkno = mf->nextchunk;
+  long long offset = ((long long)chunkno)*MAPCHUNK_BYTES;
+  int size = (mf->size-offset < MAPCHUNK_BYTES) ? (int)(mf->size-offset) : MAPCHUNK_BYTES;
+  long hdrbytes = page_size();
+  char *region;
+  carray *arr;
+
+  assert(!mf->fallback);
+  assert(chunkno < mf->nchunks);
+
+  if (NULL == (region = (char*)arena_region_alloc(hdrbytes+MAPCHUNK_BYTES))) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if ((MAP_FAILED == mmap(region,hdrbytes,PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,-1,0)) ||
+      (MAP_FAILED == mmap(region+hdrbytes,size,PROT_READ,MAP_PRIVATE|MAP_FIXED,fd,(off_t)offset))) {
+    int err = errno;
+    arena_region_free(region,hdrbytes+MAPCHUNK_BYTES);
+    errno = err;
+    return NULL;
+  }
+
+  mf->regions[chunkno] = region;
+  mf->nextchunk++;
+
+  arr = chunk_array(mf,chunkno);
+  assert(arr->elements == region+hdrbytes);
+  arr->type = CELL_O_ARRAY;
+  arr->flags = tsk->newcellflags|FLAG_PINNED|FLAG_MATURE;
+  arr->nbytes = sizeof(carray)+size;
+  arr->alloc = size;
+  arr->size = size;
+  arr->elemsize = 1;
+  arr->multiref = 1;
+  arr->nchars = 0;
+
+  #ifdef PROFILING
+  tsk->stats.array_allocs++;
+  #endif
+
+  return arr;
+}
+
+int mapfile_finished(mappedfile *mf)
+{
+  return (!mf->fallback && (mf->nextchunk == mf->nchunks));
+}
+
+/* Must only be called after the mark phase of a major collection */
+int mapfile_referenced(mappedfile *mf)
+{
+  int i;
+  for (i = 0; i < mf->nextchunk; i++) {
+    if (chunk_array(mf,i)->flags & FLAG_MARKED)
+      return 1;
+  }
+  return 0;
+}
+
+void mapfile_clear_marks(mappedfile *mf, unsigned int bit)
+{
+  int i;
+  for (i = 0; i < mf->nextchunk; i++)
+    chunk_array(mf,i)->flags &= ~bit;
+}
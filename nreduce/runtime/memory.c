@@ -43,13 +43,24 @@
 #include <stdarg.h>
 #include <math.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sched.h>
 
 static void *add_to_oldgen(task *tsk, void *mem);
 
 extern int opt_maxheap;
+extern int opt_gcthreads;
+extern int opt_deferpause;
+extern int opt_nursery;
+extern int opt_gctarget;
 
+#ifdef __LP64__
+unsigned char NULL_PNTR_BITS[8] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF4, 0xFF };
+#else
 unsigned char NULL_PNTR_BITS[8] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF0, 0xFF };
+#endif
 
 const char *cell_types[CELL_COUNT] = {
   "EMPTY",
@@ -94,13 +105,13 @@ const char *frame_states[5] = {
 
 #define REPLACE_PNTR(p) { if (check) { \
                             if (is_pntr(p)) { \
-                              assert(REF_FLAGS != ((cell*)(p).data[0])->flags); \
-                              assert(0 != ((cell*)(p).data[0])->type); \
-                              check_valid_object(((cell*)(p).data[0])); \
+                              assert(REF_FLAGS != get_pntr(p)->flags); \
+                              assert(0 != get_pntr(p)->type); \
+                              check_valid_object(get_pntr(p)); \
                             } \
                          } else if (is_pntr(p)) { \
-                             if (REF_FLAGS == (unsigned int)((cell*)(p).data[0])->flags) {     \
-                               (p).data[0] = (unsigned int)((cell*)(p).data[0])->type; } \
+                             if (REF_FLAGS == (unsigned int)get_pntr(p)->flags) {     \
+                               (p).data[0] = get_pntr(p)->type; } \
                          } }
 
 #define REPLACE_CELL(c) { if (check) { \
@@ -108,7 +119,7 @@ const char *frame_states[5] = {
                             assert(0 != (c)->type); \
                             check_valid_object((c));              \
                           } else if (REF_FLAGS == (c)->flags) {                    \
-                            (c) = (cell*)(c)->type; }     \
+                            (c) = (cell*)forward_addr(c); }     \
                         }
 
 #ifndef INLINE_RESOLVE_PNTR
@@ -130,8 +141,210 @@ unsigned int object_size(void *ptr)
     return ((objheader*)ptr)->nbytes;
 }
 
+/* Heap blocks
+
+   On 64-bit platforms, pntrs refer to heap objects by their offset from heap_base (see the
+   comments about pointer representation in runtime.h), so every block must come from the
+   same region of the address space. We reserve HEAP_ARENA_BYTES of address space at
+   startup without committing any memory to it, and hand out blocks from this region,
+   keeping freed blocks on a list for reuse. The pages of a freed block are returned to
+   the system, and read back as zero when the block is next used, as for a fresh mapping. */
+
+#ifdef __LP64__
+
+#define ARENA_BLOCK_BYTES ((sizeof(block)+4095) & ~((unsigned long)4095))
+
+char *heap_base = NULL;
+static unsigned long arena_used = 0;
+static block *arena_free = NULL;
+static pthread_mutex_t arena_lock;
+
+static void __attribute__ ((constructor)) arena_init(void)
+{
+  void *mem = mmap(NULL,HEAP_ARENA_BYTES,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+  if (MAP_FAILED == mem) {
+    perror("mmap");
+    exit(1);
+  }
+  heap_base = (char*)mem;
+  /* Keep the first page unused, so that forwarding offsets never look like cell types */
+  arena_used = 4096;
+  init_mutex(&arena_lock);
+}
+
+block *block_alloc(void)
+{
+  block *bl;
+  lock_mutex(&arena_lock);
+  if (arena_free) {
+    bl = arena_free;
+    arena_free = bl->next;
+  }
+  else {
+    if (arena_used+ARENA_BLOCK_BYTES > HEAP_ARENA_BYTES)
+      fatal("Heap arena exhausted (%lu bytes)",HEAP_ARENA_BYTES);
+    bl = (block*)(heap_base+arena_used);
+    if (0 != mprotect(bl,ARENA_BLOCK_BYTES,PROT_READ|PROT_WRITE))
+      fatal("mprotect: %s",strerror(errno));
+    arena_used += ARENA_BLOCK_BYTES;
+  }
+  unlock_mutex(&arena_lock);
+  bl->next = NULL;
+  bl->used = 0;
+  return bl;
+}
+
+void block_free(block *bl)
+{
+  madvise(bl,ARENA_BLOCK_BYTES,MADV_DONTNEED);
+  lock_mutex(&arena_lock);
+  bl->next = arena_free;
+  arena_free = bl;
+  unlock_mutex(&arena_lock);
+}
+
+/* Regions of the arena that are not heap blocks, used for objects whose memory is managed
+   separately (see mapfile.c). A region is returned to the caller with no access permitted; the
+   caller maps whatever it needs over the top of it. Freed regions are kept for reuse by later
+   requests of the same size, which is all that the current users need. */
+
+typedef struct arenaregion {
+  char *mem;
+  unsigned long nbytes;
+  struct arenaregion *next;
+} arenaregion;
+
+static arenaregion *arena_free_regions = NULL;
+
+void *arena_region_alloc(unsigned long nbytes)
+{
+  arenaregion **rptr;
+  char *mem = NULL;
+
+  nbytes = (nbytes+4095) & ~((unsigned long)4095);
+  lock_mutex(&arena_lock);
+  for (rptr = &arena_free_regions; *rptr; rptr = &(*rptr)->next) {
+    if ((*rptr)->nbytes == nbytes) {
+      arenaregion *r = *rptr;
+      *rptr = r->next;
+      mem = r->mem;
+      free(r);
+      break;
+    }
+  }
+  if ((NULL == mem) && (arena_used+nbytes <= HEAP_ARENA_BYTES)) {
+    mem = heap_base+arena_used;
+    arena_used += nbytes;
+  }
+  unlock_mutex(&arena_lock);
+  return mem;
+}
+
+void arena_region_free(void *mem, unsigned long nbytes)
+{
+  arenaregion *r = (arenaregion*)malloc(sizeof(arenaregion));
+
+  /* Replace anything that was mapped into the region with a fresh reservation */
+  nbytes = (nbytes+4095) & ~((unsigned long)4095);
+  if (MAP_FAILED == mmap(mem,nbytes,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED,
+                         -1,0))
+    fatal("mmap: %s",strerror(errno));
+
+  r->mem = (char*)mem;
+  r->nbytes = nbytes;
+  lock_mutex(&arena_lock);
+  r->next = arena_free_regions;
+  arena_free_regions = r;
+  unlock_mutex(&arena_lock);
+}
+
+#else
+
+block *block_alloc(void)
+{
+  block *bl = (block*)malloc(sizeof(block));
+  bl->next = NULL;
+  bl->used = 0;
+  return bl;
+}
+
+void block_free(block *bl)
+{
+  free(bl);
+}
+
+void *arena_region_alloc(unsigned long nbytes)
+{
+  void *mem = mmap(NULL,nbytes,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+  return (MAP_FAILED == mem) ? NULL : mem;
+}
+
+void arena_region_free(void *mem, unsigned long nbytes)
+{
+  munmap(mem,nbytes);
+}
+
+#endif
+
 static void mark(task *tsk, pntr p, unsigned int bit, int depth);
 
+/* Parallel marking
+
+   When OPT_GCTHREADS is set, the mark phase of a major collection is shared between the
+   interpreter thread and the helper threads. Each thread has a private mark stack, from which
+   it takes objects to mark and to which it pushes objects found below PARALLEL_MARK_DEPTH, and a
+   shared stack that other threads may steal from. While some thread is idle, a thread with more
+   than one object on its private stack moves the older half of it to its shared stack. Idle
+   threads take work from their own shared stack first, then steal half of another thread's;
+   marking is complete once every thread is idle, since only the owner adds to a shared stack.
+
+   An object is claimed by atomically setting the mark bit, so exactly one thread copies it.
+   Each thread copies objects into its own chain of old generation blocks, and the chains are
+   linked into tsk->oldgen at the end of the mark phase. The forwarding address is written to
+   the original object before its flags are set to REF_FLAGS, so a thread that sees REF_FLAGS
+   will always see the new address. Another thread may still see the original object after it
+   has been copied; that is harmless, as references to it are fixed up by replace_refs().
+
+   Only the FLAG_MARKED marking of a major collection is done in parallel. Minor collections
+   promote objects into a single contiguous region of the old generation, and the distributed
+   (FLAG_DMB) marking updates the remembered set and target hash, so both stay sequential. */
+
+#define PARALLEL_MARK_DEPTH 8
+
+struct parmark;
+
+typedef struct markworker {
+  struct parmark *pm;
+  stack *local;
+  stack *shared;
+  pthread_mutex_t lock;
+  int nshared;
+  block *oldgen;
+  unsigned int oldgenoffset;
+  int oldgenbytes;
+} markworker;
+
+typedef struct parmark {
+  int nworkers;
+  markworker *workers;
+  int idle;
+  int deferring;
+} parmark;
+
+/* The mark state of the current thread, if it is taking part in a parallel mark */
+static __thread markworker *curworker = NULL;
+
+static inline int claim_object(header *v, unsigned int bit)
+{
+  unsigned int flags;
+  do {
+    flags = *(volatile unsigned int*)&v->flags;
+    if ((REF_FLAGS == flags) || (flags & bit))
+      return 0;
+  } while (!__sync_bool_compare_and_swap(&v->flags,flags,flags|bit));
+  return 1;
+}
+
 static inline pntr resolve_copy_pntr(task *tsk, cell *refcell, int bit, pntr p2)
 {
   pntr p = p2;
@@ -141,10 +354,10 @@ static inline pntr resolve_copy_pntr(task *tsk, cell *refcell, int bit, pntr p2)
     if (!is_pntr(p))
       break;
     c = get_pntr(p);
-    if (CELL_IND == c->type)
+    if (CELL_IND == __atomic_load_n(&c->type,__ATOMIC_RELAXED))
       p = c->field1;
-    else if (REF_FLAGS == c->flags)
-      p.data[0] = (unsigned int)c->type;
+    else if (REF_FLAGS == __atomic_load_n(&c->flags,__ATOMIC_ACQUIRE))
+      p.data[0] = c->type;
     else
       break;
     changed = 1;
@@ -158,14 +371,17 @@ static inline pntr resolve_copy_pntr(task *tsk, cell *refcell, int bit, pntr p2)
 
 void mark_global(task *tsk, global *glo, unsigned int bit, int depth)
 {
+  int already;
   assert(glo);
 /*   if (glo->flags & bit) */ // FIXME?
 /*     return; */
 
-  glo->flags |= bit;
+  already = (__sync_fetch_and_or(&glo->flags,bit) & bit);
   mark(tsk,glo->p,bit,depth);
 
-  if ((FLAG_DMB == bit) && (0 <= glo->addr.lid) && (tsk->tid != glo->addr.tid))
+  /* The owner only needs to be asked to mark a remote object once per distributed collection;
+     FLAG_DMB stays set on the global until the sweep */
+  if ((FLAG_DMB == bit) && !already && (0 <= glo->addr.lid) && (tsk->tid != glo->addr.tid))
     add_pending_mark(tsk,glo->addr);
 }
 
@@ -302,13 +518,20 @@ static void mark_or_copy(task *tsk, header *v, unsigned int bit, int depth)
   assert((FLAG_MARKED == bit) || (FLAG_DMB == bit));
 
   while (v && (REF_FLAGS != v->flags) && !(v->flags & bit)) {
-    check_valid_object(v);
-
     if (FLAG_MARKED == bit) {
-      v->flags |= bit;
+      /* Another thread may get to the object first if marking is being done in parallel */
+      if (curworker) {
+        if (!claim_object(v,bit))
+          break;
+      }
+      else {
+        v->flags |= bit;
+      }
+      check_valid_object(v);
       v = add_to_oldgen(tsk,v);
     }
     else {
+      check_valid_object(v);
       v->flags |= bit;
       global *target;
       pntr p;
@@ -327,7 +550,15 @@ static void mark(task *tsk, pntr p, unsigned int bit, int depth)
   assert(tsk->markstack);
   if (!is_pntr(p))
     return;
-  if (depth > 100) {
+  if (curworker) {
+    /* While the roots are being found, just collect them for parallel_mark_end(); beyond
+       PARALLEL_MARK_DEPTH, leave objects on the stack where other threads can get to them */
+    if (curworker->pm->deferring || (depth > PARALLEL_MARK_DEPTH)) {
+      stack_push(curworker->local,get_pntr(p));
+      return;
+    }
+  }
+  else if (depth > 100) {
     stack_push(tsk->markstack,get_pntr(p));
     return;
   }
@@ -354,6 +585,91 @@ void mark_end(task *tsk, unsigned int bit)
   tsk->markstack = NULL;
 }
 
+static void markworker_publish(markworker *w)
+{
+  int n = w->local->count/2;
+  int i;
+
+  lock_mutex(&w->lock);
+  for (i = 0; i < n; i++)
+    stack_push(w->shared,w->local->data[i]);
+  __atomic_store_n(&w->nshared,w->shared->count,__ATOMIC_RELAXED);
+  unlock_mutex(&w->lock);
+
+  memmove(w->local->data,w->local->data+n,(w->local->count-n)*sizeof(void*));
+  w->local->count -= n;
+}
+
+/* Move objects from victim's shared stack to w's private stack: all of them if they are w's
+   own, otherwise half */
+static int markworker_take(markworker *w, markworker *victim)
+{
+  int n;
+
+  if (0 == __atomic_load_n(&victim->nshared,__ATOMIC_RELAXED))
+    return 0;
+  lock_mutex(&victim->lock);
+  n = (victim == w) ? victim->shared->count : (victim->shared->count+1)/2;
+  while (0 < n--)
+    stack_push(w->local,victim->shared->data[--victim->shared->count]);
+  __atomic_store_n(&victim->nshared,victim->shared->count,__ATOMIC_RELAXED);
+  unlock_mutex(&victim->lock);
+  return (0 < w->local->count);
+}
+
+static int markworker_find_work(markworker *w)
+{
+  parmark *pm = w->pm;
+  int index = w-pm->workers;
+  int i;
+
+  for (i = 0; i < pm->nworkers; i++)
+    if (markworker_take(w,&pm->workers[(index+i)%pm->nworkers]))
+      return 1;
+  return 0;
+}
+
+/* Called when a thread has run out of work. Returns 0 once all threads are idle, which means
+   marking is complete, or 1 if another thread has made some work available. */
+static int markworker_wait(markworker *w)
+{
+  parmark *pm = w->pm;
+  int i;
+
+  __sync_fetch_and_add(&pm->idle,1);
+  while (1) {
+    if (pm->nworkers == __atomic_load_n(&pm->idle,__ATOMIC_RELAXED))
+      return 0;
+    for (i = 0; i < pm->nworkers; i++) {
+      if (0 < __atomic_load_n(&pm->workers[i].nshared,__ATOMIC_RELAXED)) {
+        __sync_fetch_and_sub(&pm->idle,1);
+        return 1;
+      }
+    }
+    sched_yield();
+  }
+}
+
+static void parallel_mark_thread(task *tsk, void *arg, int index)
+{
+  parmark *pm = (parmark*)arg;
+  markworker *w = &pm->workers[index];
+
+  curworker = w;
+  do {
+    do {
+      while (0 < w->local->count) {
+        header *v = (header*)w->local->data[--w->local->count];
+        mark_or_copy(tsk,v,FLAG_MARKED,0);
+        if ((1 < w->local->count) && (0 == __atomic_load_n(&w->nshared,__ATOMIC_RELAXED)) &&
+            (0 < __atomic_load_n(&pm->idle,__ATOMIC_RELAXED)))
+          markworker_publish(w);
+      }
+    } while (markworker_find_work(w));
+  } while (markworker_wait(w));
+  curworker = NULL;
+}
+
 void force_minor_collection(task *tsk)
 {
   if (tsk->need_minor)
@@ -363,6 +679,19 @@ void force_minor_collection(task *tsk)
     endpoint_interrupt(tsk->endpt);
 }
 
+/* Returns the offset within a new nursery block at which a minor collection should be
+   requested. By default this is the whole block; a smaller nursery (OPT_NURSERY, in mb) keeps
+   the allocation area in cache, at the cost of more frequent minor collections. The size may
+   be changed while the task is running by adapt_collection_policy(). If the nursery already
+   spans more than one block, a collection is already pending. */
+static unsigned int nursery_limit(task *tsk, block *prev)
+{
+  if (prev || (0 >= tsk->nurserybytes) || (tsk->nurserybytes >= BLOCK_END-BLOCK_START))
+    return sizeof(block);
+  else
+    return BLOCK_START+tsk->nurserybytes;
+}
+
 /* FIXME: setting FLAG_DMB on newly created objects is not sufficient to ensure they
    survive beyond the end of the current distributed garbage collection cycle. This is
    because object retention is no longer based on marks, but on them being referenced
@@ -381,21 +710,30 @@ void *alloc_mem(task *tsk, unsigned int nbytes)
   if (opt_maxheap && tsk->newgen && (tsk->oldgenbytes + tsk->newgenoffset >= opt_maxheap))
     force_minor_collection(tsk);
 
-  if (tsk->newgenoffset >= sizeof(block)-nbytes) {
-    /* If filled up the first block... request a minor collection */
+  if (tsk->newgenoffset >= tsk->newgenlimit-nbytes) {
+    /* If filled up the nursery... request a minor collection. This won't happen until the
+       next interrupt is handled, so until then we just keep allocating from the rest of the
+       block (or another one, if that fills up too). */
     if (tsk->newgen)
       force_minor_collection(tsk);
 
-    block *bl = (block*)malloc(sizeof(block));
-    bl->next = tsk->newgen;
-    bl->used = tsk->newgenoffset;
-    tsk->newgen = bl;
-    tsk->newgenoffset = BLOCK_START;
-  }
-  else {
-/*     fprintf(stderr,"allocated cell\n"); */
+    if (tsk->newgenoffset >= sizeof(block)-nbytes) {
+      block *bl = tsk->sparenursery;
+      if (bl)
+        tsk->sparenursery = NULL;
+      else
+        bl = block_alloc();
+      bl->next = tsk->newgen;
+      bl->used = tsk->newgenoffset;
+      tsk->newgen = bl;
+      tsk->newgenoffset = BLOCK_START;
+      tsk->newgenlimit = nursery_limit(tsk,bl->next);
+    }
+    else {
+      tsk->newgenlimit = sizeof(block);
+    }
   }
-  h = (header*)(tsk->newgenoffset+(unsigned int)tsk->newgen);
+  h = (header*)(((char*)tsk->newgen)+tsk->newgenoffset);
   tsk->newgenoffset += nbytes;
 
   h->flags = tsk->newcellflags;
@@ -533,7 +871,10 @@ void free_sysobject(task *tsk, sysobject *so)
   if (so->ownertid == tsk->tid) {
     switch (so->type) {
     case SYSOBJECT_FILE:
-      close(so->fd);
+      if (0 <= so->fd)
+        close(so->fd);
+      if (so->mf)
+        mapfile_free(so->mf);
       break;
     case SYSOBJECT_CONNECTION: {
       sysobject_done_connect(so);
@@ -569,7 +910,8 @@ void free_sysobject(task *tsk, sysobject *so)
     }
   }
   free(so->hostname);
-  free(so->buf);
+  if (so->readmsg)
+    message_free(so->readmsg);
   free(so);
 }
 
@@ -699,11 +1041,9 @@ static void mark_roots(task *tsk, unsigned int bit)
      (e.g. scheduled frames) */
   int h;
   global *glo;
-  for (h = 0; h < GLOBAL_HASH_SIZE; h++) {
-    for (glo = tsk->targethash[h]; glo; glo = glo->targetnext) {
-      if (glo->fetching)
-        mark_global(tsk,glo,bit,0);
-    }
+  for (h = 0; h < tsk->targethash.size; h++) {
+    if ((NULL != (glo = tsk->targethash.slots[h])) && glo->fetching)
+      mark_global(tsk,glo,bit,0);
   }
 }
 
@@ -711,15 +1051,13 @@ static void mark_mature_remoteref_globals(task *tsk, unsigned int bit)
 {
   int h;
   global *glo;
-  for (h = 0; h < GLOBAL_HASH_SIZE; h++) {
-    for (glo = tsk->addrhash[h]; glo; glo = glo->addrnext) {
-      if (is_pntr(glo->p)) {
-        header *v = (header*)get_pntr(glo->p);
-        if (REF_FLAGS == v->flags)
-          v = (header*)v->type;
-        if (has_been_copied(tsk,v))
-          mark_global(tsk,glo,bit,0);
-      }
+  for (h = 0; h < tsk->addrhash.size; h++) {
+    if ((NULL != (glo = tsk->addrhash.slots[h])) && is_pntr(glo->p)) {
+      header *v = (header*)get_pntr(glo->p);
+      if (REF_FLAGS == v->flags)
+        v = forward_addr(v);
+      if (has_been_copied(tsk,v))
+        mark_global(tsk,glo,bit,0);
     }
   }
 }
@@ -754,8 +1092,9 @@ static void preserve_targets(task *tsk)
     if (!(glo->flags & FLAG_MARKED)) {
       int check = 0;
       REPLACE_PNTR(glo->p);
-      check_valid_object(((cell*)(glo->p).data[0]));
-      if (is_pntr(glo->p) && ((cell*)(glo->p).data[0])->flags & FLAG_MARKED) {
+      if (is_pntr(glo->p))
+        check_valid_object(get_pntr(glo->p));
+      if (is_pntr(glo->p) && get_pntr(glo->p)->flags & FLAG_MARKED) {
         event_preserve_target(tsk,glo->addr,pntrtype(glo->p));
         glo->flags |= FLAG_MARKED;
       }
@@ -817,20 +1156,278 @@ static void sweep_globals(task *tsk)
   }
 }
 
-static void clear_marks(task *tsk, unsigned int bit)
+/* Helper threads
+
+   The helper threads used for parallel garbage collection are started the first time they are
+   needed and kept until the task is freed. Each job is run on every helper thread, and on the
+   interpreter thread as index 0, which waits for all of the helpers to finish before returning.
+   The number of helper threads is set by OPT_GCTHREADS; with the default of 0, everything is
+   done on the interpreter thread. */
+
+typedef void (*gcjob_fun)(task *tsk, void *arg, int index);
+
+typedef struct gcpool gcpool;
+
+typedef struct gchelper {
+  struct gcpool *pool;
+  int index;
+  pthread_t thread;
+} gchelper;
+
+struct gcpool {
+  task *tsk;
+  int nhelpers;
+  gchelper *helpers;
+  pthread_mutex_t lock;
+  pthread_cond_t startcond;
+  pthread_cond_t donecond;
+  int generation;
+  int busy;
+  int shutdown;
+  gcjob_fun fun;
+  void *arg;
+};
+
+static void *gchelper_thread(void *data)
+{
+  gchelper *h = (gchelper*)data;
+  gcpool *pool = h->pool;
+  int generation = 0;
+
+  lock_mutex(&pool->lock);
+  while (1) {
+    while (!pool->shutdown && (generation == pool->generation))
+      pthread_cond_wait(&pool->startcond,&pool->lock);
+    if (pool->shutdown)
+      break;
+    generation = pool->generation;
+    unlock_mutex(&pool->lock);
+
+    pool->fun(pool->tsk,pool->arg,h->index);
+
+    lock_mutex(&pool->lock);
+    if (0 == --pool->busy)
+      pthread_cond_signal(&pool->donecond);
+  }
+  unlock_mutex(&pool->lock);
+  return NULL;
+}
+
+/* Returns the number of helper threads available, starting them if necessary */
+static int gcpool_helpers(task *tsk)
+{
+  gcpool *pool = tsk->gcpool;
+  int i;
+
+  if (0 >= opt_gcthreads)
+    return 0;
+  if (pool)
+    return pool->nhelpers;
+
+  pool = (gcpool*)calloc(1,sizeof(gcpool));
+  pool->tsk = tsk;
+  pool->helpers = (gchelper*)calloc(opt_gcthreads,sizeof(gchelper));
+  init_mutex(&pool->lock);
+  pthread_cond_init(&pool->startcond,NULL);
+  pthread_cond_init(&pool->donecond,NULL);
+  for (i = 0; i < opt_gcthreads; i++) {
+    gchelper *h = &pool->helpers[pool->nhelpers];
+    h->pool = pool;
+    h->index = pool->nhelpers+1;
+    if (0 != pthread_create(&h->thread,NULL,gchelper_thread,h)) {
+      node_log(tsk->n,LOG_WARNING,"gc: pthread_create: %s",strerror(errno));
+      break;
+    }
+    pool->nhelpers++;
+  }
+  tsk->gcpool = pool;
+  return pool->nhelpers;
+}
+
+static void gcpool_run(task *tsk, gcjob_fun fun, void *arg)
+{
+  gcpool *pool = tsk->gcpool;
+
+  lock_mutex(&pool->lock);
+  pool->fun = fun;
+  pool->arg = arg;
+  pool->busy = pool->nhelpers;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->startcond);
+  unlock_mutex(&pool->lock);
+
+  fun(tsk,arg,0);
+
+  lock_mutex(&pool->lock);
+  while (0 < pool->busy)
+    pthread_cond_wait(&pool->donecond,&pool->lock);
+  unlock_mutex(&pool->lock);
+}
+
+void gcpool_free(task *tsk)
+{
+  gcpool *pool = tsk->gcpool;
+  int i;
+
+  if (NULL == pool)
+    return;
+  lock_mutex(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->startcond);
+  unlock_mutex(&pool->lock);
+  for (i = 0; i < pool->nhelpers; i++)
+    pthread_join(pool->helpers[i].thread,NULL);
+
+  pthread_cond_destroy(&pool->startcond);
+  pthread_cond_destroy(&pool->donecond);
+  destroy_mutex(&pool->lock);
+  free(pool->helpers);
+  free(pool);
+  tsk->gcpool = NULL;
+}
+
+/* Parallel block processing
+
+   Several passes over the old generation (clearing marks, fixing up references after a
+   copy, resetting the distributed mark bits) visit each object exactly once and only modify
+   that object, plus any frame/cap/sysobject/global that is owned exclusively by it. Since
+   blocks are independent of each other, these passes can be split across the helper threads,
+   with each thread repeatedly claiming the next unprocessed block from the list. */
+
+typedef void (*block_fun)(task *tsk, block *bl, unsigned int arg);
+
+typedef struct blockwork {
+  block_fun fun;
+  unsigned int arg;
+  pthread_mutex_t lock;
+  block *next;
+} blockwork;
+
+static block *blockwork_claim(blockwork *bw)
 {
   block *bl;
-  global *glo;
+  lock_mutex(&bw->lock);
+  bl = bw->next;
+  if (bl)
+    bw->next = bl->next;
+  unlock_mutex(&bw->lock);
+  return bl;
+}
 
-  for (bl = tsk->oldgen; bl; bl = bl->next) {
-    unsigned int off;
-    for (off = BLOCK_START; off < BLOCK_END; off += object_size(off+(char*)bl)) {
-      header *h = (header*)(off+(char*)bl);
-      assert(REF_FLAGS != h->flags);
-      check_valid_object(h);
-      h->flags &= ~bit;
+static void blockwork_thread(task *tsk, void *arg, int index)
+{
+  blockwork *bw = (blockwork*)arg;
+  block *bl;
+  while (NULL != (bl = blockwork_claim(bw)))
+    bw->fun(tsk,bl,bw->arg);
+}
+
+static void parallel_blocks(task *tsk, block *first, block_fun fun, unsigned int arg)
+{
+  blockwork bw;
+
+  if ((NULL == first) || (NULL == first->next) || (0 == gcpool_helpers(tsk))) {
+    block *bl;
+    for (bl = first; bl; bl = bl->next)
+      fun(tsk,bl,arg);
+    return;
+  }
+
+  bw.fun = fun;
+  bw.arg = arg;
+  bw.next = first;
+  init_mutex(&bw.lock);
+  gcpool_run(tsk,blockwork_thread,&bw);
+  destroy_mutex(&bw.lock);
+}
+
+/* Starts a parallel mark, if there are any helper threads. The roots are then marked on the
+   interpreter thread as usual, but only collected on its private stack; parallel_mark_end()
+   does the actual marking. Returns NULL if the mark is to be done sequentially. */
+static parmark *parallel_mark_start(task *tsk)
+{
+  parmark *pm;
+  int i;
+
+  if (0 == gcpool_helpers(tsk))
+    return NULL;
+
+  pm = (parmark*)calloc(1,sizeof(parmark));
+  pm->nworkers = tsk->gcpool->nhelpers+1;
+  pm->workers = (markworker*)calloc(pm->nworkers,sizeof(markworker));
+  for (i = 0; i < pm->nworkers; i++) {
+    markworker *w = &pm->workers[i];
+    w->pm = pm;
+    w->local = stack_new();
+    w->local->limit = -1;
+    w->shared = stack_new();
+    w->shared->limit = -1;
+    init_mutex(&w->lock);
+    w->oldgenoffset = sizeof(block);
+  }
+  pm->deferring = 1;
+  curworker = &pm->workers[0];
+  return pm;
+}
+
+static void parallel_mark_end(task *tsk, parmark *pm)
+{
+  int i;
+
+  curworker = NULL;
+  pm->deferring = 0;
+  gcpool_run(tsk,parallel_mark_thread,pm);
+
+  /* Link the blocks each thread copied objects into behind the current allocation block, which
+     later promotions carry on filling */
+  for (i = 0; i < pm->nworkers; i++) {
+    markworker *w = &pm->workers[i];
+    assert(0 == w->local->count);
+    assert(0 == w->shared->count);
+    if (w->oldgen) {
+      block *last = w->oldgen;
+      w->oldgen->used = w->oldgenoffset;
+      while (last->next)
+        last = last->next;
+      last->next = tsk->oldgen->next;
+      tsk->oldgen->next = w->oldgen;
+      tsk->oldgenbytes += w->oldgenbytes;
     }
+    stack_free(w->local);
+    stack_free(w->shared);
+    destroy_mutex(&w->lock);
+  }
+  free(pm->workers);
+  free(pm);
+}
+
+static void clear_marks_block(task *tsk, block *bl, unsigned int bit)
+{
+  unsigned int off;
+  for (off = BLOCK_START; off < BLOCK_END; off += object_size(off+(char*)bl)) {
+    header *h = (header*)(off+(char*)bl);
+    assert(REF_FLAGS != h->flags);
+    check_valid_object(h);
+    h->flags &= ~bit;
+  }
+}
+
+static void clear_pinned_marks(task *tsk, unsigned int bit)
+{
+  sysobject *so;
+  for (so = tsk->sysobjects.first; so; so = so->next) {
+    if (so->mf)
+      mapfile_clear_marks(so->mf,bit);
   }
+}
+
+static void clear_marks(task *tsk, unsigned int bit)
+{
+  global *glo;
+
+  parallel_blocks(tsk,tsk->oldgen,clear_marks_block,bit);
+  clear_pinned_marks(tsk,bit);
+
   /* This should only be called after a major collection, so the new generation
      should be empty */
   assert(NULL == tsk->newgen);
@@ -848,28 +1445,47 @@ static void *add_to_oldgen(task *tsk, void *mem)
   if (has_been_copied(tsk,mem))
     return mem;
 
+  /* Pinned objects live outside the heap blocks and are never moved */
+  if (((header*)mem)->flags & FLAG_PINNED)
+    return mem;
+
   unsigned int size = object_size(mem);
+  char *newmem;
+
+  if (curworker) {
+    markworker *w = curworker;
+    if (w->oldgenoffset >= sizeof(block)-size) {
+      block *bl = block_alloc();
+      if (w->oldgen)
+        w->oldgen->used = w->oldgenoffset;
+      bl->next = w->oldgen;
+      w->oldgen = bl;
+      w->oldgenoffset = BLOCK_START;
+    }
+    newmem = (char*)(((char*)w->oldgen)+w->oldgenoffset);
+    w->oldgenbytes += size;
+    w->oldgenoffset += size;
+  }
+  else {
+    if (tsk->oldgenoffset >= sizeof(block)-size) {
+      block *bl = block_alloc();
+      bl->next = tsk->oldgen;
+      bl->used = tsk->oldgenoffset;
+      tsk->oldgen = bl;
+      tsk->oldgenoffset = BLOCK_START;
+      tsk->need_major = 1;
+    }
+    assert(tsk->oldgenoffset+object_size(mem) <= sizeof(block));
 
-  if (tsk->oldgenoffset >= sizeof(block)-size) {
-    block *bl = (block*)malloc(sizeof(block));
-    bl->next = tsk->oldgen;
-    bl->used = tsk->oldgenoffset;
-    tsk->oldgen = bl;
-    tsk->oldgenoffset = BLOCK_START;
-    tsk->need_major = 1;
+    newmem = (char*)(((char*)tsk->oldgen)+tsk->oldgenoffset);
+    tsk->oldgenbytes += size;
+    tsk->oldgenoffset += size;
   }
-  assert(tsk->oldgenoffset+object_size(mem) <= sizeof(block));
 
-  char *newmem = (char*)(((char*)tsk->oldgen)+tsk->oldgenoffset);
   if (((header*)mem)->type < CELL_OBJS)
     *((cell*)newmem) = *((cell*)mem);
   else
     memcpy(newmem,mem,size);
-  tsk->oldgenbytes += size;
-  tsk->oldgenoffset += size;
-
-  ((header*)mem)->type = (unsigned int)newmem;
-  ((header*)mem)->flags = REF_FLAGS;
 
   if (tsk->altspace)
     ((header*)newmem)->flags |= FLAG_ALTSPACE;
@@ -877,6 +1493,10 @@ static void *add_to_oldgen(task *tsk, void *mem)
     ((header*)newmem)->flags &= ~FLAG_ALTSPACE;
   ((header*)newmem)->flags |= FLAG_MATURE;
 
+  /* The copy must be complete before other threads can see the forwarding address */
+  ((header*)mem)->type = heap_offset(newmem);
+  __atomic_store_n(&((header*)mem)->flags,REF_FLAGS,__ATOMIC_RELEASE);
+
   return (char*)newmem;
 }
 
@@ -950,35 +1570,30 @@ static void replace_refs_globals(task *tsk, int check)
   global *glo;
   if (check) {
     /* Just verification - REPLACE_PNTR only does a check here */
-    for (h = 0; h < GLOBAL_HASH_SIZE; h++) {
-      for (glo = tsk->physhash[h]; glo; glo = glo->physnext)
+    for (h = 0; h < tsk->physhash.size; h++)
+      if (NULL != (glo = tsk->physhash.slots[h]))
         REPLACE_PNTR(glo->p);
-      for (glo = tsk->targethash[h]; glo; glo = glo->targetnext)
+    for (h = 0; h < tsk->targethash.size; h++)
+      if (NULL != (glo = tsk->targethash.slots[h]))
         REPLACE_PNTR(glo->p);
-    }
   }
   else {
     /* Note that we need to rebuild the target and physical hash tables here,
        sine the pointers have changed */
-    global *next;
-    global **oldphyshash = tsk->physhash;
-    global **oldtargethash = tsk->targethash;
-    tsk->physhash = (global**)calloc(GLOBAL_HASH_SIZE,sizeof(global*));
-    tsk->targethash = (global**)calloc(GLOBAL_HASH_SIZE,sizeof(global*));
-
-    for (h = 0; h < GLOBAL_HASH_SIZE; h++) {
-      for (glo = oldphyshash[h]; glo; glo = next) {
-        next = glo->physnext;
-        glo->physnext = NULL;
+    int physsize = tsk->physhash.size;
+    int targetsize = tsk->targethash.size;
+    global **oldphyshash = globtable_reset(&tsk->physhash);
+    global **oldtargethash = globtable_reset(&tsk->targethash);
+
+    for (h = 0; h < physsize; h++) {
+      if (NULL != (glo = oldphyshash[h])) {
         REPLACE_PNTR(glo->p);
         physhash_add(tsk,glo);
       }
     }
 
-    for (h = 0; h < GLOBAL_HASH_SIZE; h++) {
-      for (glo = oldtargethash[h]; glo; glo = next) {
-        next = glo->targetnext;
-        glo->targetnext = NULL;
+    for (h = 0; h < targetsize; h++) {
+      if (NULL != (glo = oldtargethash[h])) {
         REPLACE_PNTR(glo->p);
         targethash_add(tsk,glo);
       }
@@ -1030,24 +1645,25 @@ static void replace_refs_other(task *tsk, int check)
   replace_refs_globals(tsk,check);
 }
 
-static void replace_refs(task *tsk, int check)
+static void replace_refs_block(task *tsk, block *bl, unsigned int check)
 {
-  block *bl;
-  for (bl = tsk->oldgen; bl; bl = bl->next) {
-    unsigned int off;
-    for (off = BLOCK_START; off < BLOCK_END; off += object_size(off+(char*)bl)) {
-      header *h = (header*)(off+(char*)bl);
-      replace_refs_cell(tsk,(cell*)h,check);
-    }
+  unsigned int off;
+  for (off = BLOCK_START; off < BLOCK_END; off += object_size(off+(char*)bl)) {
+    header *h = (header*)(off+(char*)bl);
+    replace_refs_cell(tsk,(cell*)h,check);
   }
+}
 
+static void replace_refs(task *tsk, int check)
+{
+  parallel_blocks(tsk,tsk->oldgen,replace_refs_block,check);
   replace_refs_other(tsk,check);
 }
 
 static void init_oldgen(task *tsk)
 {
   if (NULL == tsk->oldgen) {
-    tsk->oldgen = (block*)malloc(sizeof(block));
+    tsk->oldgen = block_alloc();
     tsk->oldgen->used = 0;
     tsk->oldgen->next = NULL;
     tsk->oldgenoffset = BLOCK_START;
@@ -1061,7 +1677,7 @@ void free_blocks(block *bl)
 #ifdef DONT_FREE_BLOCKS
     memset(bl,0,sizeof(block));
 #else
-    free(bl);
+    block_free(bl);
 #endif
     bl = next;
   }
@@ -1141,7 +1757,6 @@ static block *copy_heap_start(task *tsk)
 
 static void copy_heap_finish(task *tsk, block *prevgen)
 {
-  replace_refs(tsk,0);
   sweep_frames(tsk);
   update_lifetimes(tsk,prevgen);
   free_blocks(prevgen);
@@ -1223,11 +1838,28 @@ static void replace_refs_for_newgen(task *tsk, block *prevstart, unsigned int pr
   replace_refs_other(tsk,0);
 }
 
+/* Rather than freeing all of the nursery blocks after a minor collection and allocating a
+   new one straight afterwards, we keep the most recent block around for reuse. Returning a
+   block of this size to the system and getting it back again means unmapping it and then
+   taking a page fault for every page as it is filled, which is considerably more expensive
+   than clearing the portion that was used. The block has to be cleared, since the heap
+   walking code relies on unused space being zero. */
 static void reset_newgen(task *tsk)
 {
-  free_blocks(tsk->newgen);
+  block *keep = tsk->newgen;
+  if (keep && !tsk->sparenursery) {
+    memset(&keep->data,0,tsk->newgenoffset-BLOCK_START);
+    free_blocks(keep->next);
+    keep->next = NULL;
+    keep->used = 0;
+    tsk->sparenursery = keep;
+  }
+  else {
+    free_blocks(tsk->newgen);
+  }
   tsk->newgen = NULL;
   tsk->newgenoffset = sizeof(block);
+  tsk->newgenlimit = sizeof(block);
 }
 
 static void finish_promotion(task *tsk, block *prevstart, unsigned int prevoffset)
@@ -1263,14 +1895,72 @@ void sweep_sysobjects(task *tsk, int all)
   }
 }
 
+/* A memory-mapped file that has been read to the end is only needed for as long as some of its
+   chunks are still referenced. Since chunks are never copied, this is determined from the mark
+   bits set on them during a major collection. */
+static void sweep_mapped_files(task *tsk)
+{
+  sysobject *so = tsk->sysobjects.first;
+  while (so) {
+    sysobject *next = so->next;
+    if (so->mf && mapfile_finished(so->mf) && !mapfile_referenced(so->mf))
+      free_sysobject(tsk,so);
+    so = next;
+  }
+}
+
 void force_major_collection(task *tsk)
 {
   tsk->need_minor = 1;
   tsk->need_major = 1;
+  tsk->major_forced = 1;
   tsk->skipremaining = 0;
   endpoint_interrupt(tsk->endpt);
 }
 
+/* Deferral of long major collections
+
+   A major collection copies every live object in the old generation, so its duration is
+   roughly proportional to the size of the old generation. When OPT_DEFERPAUSE is set, we keep
+   an estimate of the cost per kb from previous major collections, and if a major collection
+   that has been requested by the allocator is expected to take longer than this many ms, it is
+   deferred until the task next runs out of runnable frames (e.g. a server waiting for
+   requests).
+
+   This is only a scheduling hint, not a bound on pause times: the collection itself is still
+   done in one go, and the deferral is limited. Once the old generation has grown to twice the
+   size it was after the last major collection, or the heap limit is reached, the collection
+   happens regardless of how long it will take. Explicit requests via force_major_collection()
+   are never deferred.
+
+   Incremental or concurrent marking is not implemented. Marking copies objects and leaves
+   forwarding headers in the old blocks, so a mutator running between marking slices would
+   need a read barrier on every object access, not just the write barrier on the remembered
+   set. */
+static int defer_major_collection(task *tsk)
+{
+  int estimate;
+
+  if ((0 >= opt_deferpause) || tsk->major_forced || (0.0 >= tsk->majorms_per_kb))
+    return 0;
+
+  if (opt_maxheap && (tsk->oldgenbytes >= opt_maxheap))
+    return 0;
+
+  if ((0 < tsk->lastmajorbytes) && (tsk->oldgenbytes >= 2*tsk->lastmajorbytes))
+    return 0;
+
+  estimate = (int)(tsk->majorms_per_kb*(double)(tsk->oldgenbytes/1024));
+  if (estimate <= opt_deferpause)
+    return 0;
+
+  if (!tsk->major_deferred)
+    node_log(tsk->n,LOG_INFO,"Deferring major collection until idle (estimated %dms, threshold %dms)",
+             estimate,opt_deferpause);
+  tsk->major_deferred = 1;
+  return 1;
+}
+
 /* When a local collection is performed during a distributed collection cycle, all objects
    that have the FLAG_NEW bit set must be copied. */
 static void mark_new_objects(task *tsk, block *from)
@@ -1288,7 +1978,7 @@ static void mark_new_objects(task *tsk, block *from)
         mark(tsk,p,FLAG_MARKED,0);
       }
       if (REF_FLAGS == h->flags)
-        h = (header*)h->type;
+        h = forward_addr(h);
       off += object_size(h);
     }
   }
@@ -1301,6 +1991,76 @@ static void mark_new_objects(task *tsk, block *from)
       mark_global(tsk,glo,FLAG_MARKED,0);
 }
 
+/* Adaptive collection policy
+
+   When OPT_GCTARGET is set to a percentage, the nursery size and the frequency of major
+   collections are adjusted after each collection so that the proportion of time spent in
+   garbage collection stays near the target. The overhead is measured over the interval since
+   the end of the previous collection of the same kind.
+
+   If minor collections are taking too large a share, the nursery is doubled, which gives
+   objects more time to die before they are copied. If there is plenty of headroom and few
+   objects are surviving, the nursery is halved so the allocation area stays in cache.
+
+   Major collections are skipped (as with the fixed heuristic used otherwise) while they are
+   over budget, and the number of skips is reduced again when they are cheap, or when a large
+   portion of the old generation turned out to be garbage. */
+#define MIN_NURSERY_BYTES MB
+#define MAX_SKIPMAJORS    8
+
+static int gc_overhead(struct timeval prevend, struct timeval start, struct timeval end)
+{
+  int gcms = timeval_diffms(start,end);
+  int runms = timeval_diffms(prevend,start);
+  if (0 >= gcms+runms)
+    return 0;
+  return (int)(100.0*((double)gcms)/((double)(gcms+runms)));
+}
+
+static void adapt_nursery(task *tsk, struct timeval start, struct timeval end, int survived)
+{
+  int overhead = gc_overhead(tsk->lastminorend,start,end);
+  int maxnursery = BLOCK_END-BLOCK_START;
+  int nursery = tsk->nurserybytes;
+
+  tsk->lastminorend = end;
+  if (0 >= opt_gctarget)
+    return;
+
+  if ((0 >= nursery) || (nursery > maxnursery))
+    nursery = maxnursery;
+
+  if ((overhead > opt_gctarget) && (nursery < maxnursery))
+    nursery = min(2*nursery,maxnursery);
+  else if ((2*overhead < opt_gctarget) && (10 > survived) && (nursery > MIN_NURSERY_BYTES))
+    nursery = max(nursery/2,MIN_NURSERY_BYTES);
+
+  if (nursery != tsk->nurserybytes) {
+    node_log(tsk->n,LOG_INFO,"gc overhead %d%% (target %d%%), survival %d%%; nursery now %dkb",
+             overhead,opt_gctarget,survived,nursery/1024);
+    tsk->nurserybytes = nursery;
+  }
+}
+
+static void adapt_major_frequency(task *tsk, struct timeval start, struct timeval end,
+                                  double survived)
+{
+  int overhead = gc_overhead(tsk->lastmajorend,start,end);
+
+  tsk->lastmajorend = end;
+
+  if ((overhead > opt_gctarget) && (0.5 <= survived)) {
+    if (tsk->skipmajors < MAX_SKIPMAJORS)
+      tsk->skipmajors++;
+  }
+  else if ((2*overhead < opt_gctarget) || (0.5 > survived)) {
+    if (tsk->skipmajors > 0)
+      tsk->skipmajors--;
+  }
+  node_log(tsk->n,LOG_INFO,"major gc overhead %d%% (target %d%%); skipmajors now %d",
+           overhead,opt_gctarget,tsk->skipmajors);
+}
+
 void local_collect(task *tsk)
 {
 /*   fprintf(stderr,"local_collect\n"); */
@@ -1363,6 +2123,7 @@ void local_collect(task *tsk)
            opt_maxheap/1024);
   tsk->minorms += timeval_diffms(start,end);
   tsk->gcms += timeval_diffms(start,end);
+  adapt_nursery(tsk,start,end,survived);
 
   if (opt_maxheap && (tsk->oldgenbytes >= opt_maxheap)) {
     tsk->need_major = 1;
@@ -1371,31 +2132,45 @@ void local_collect(task *tsk)
 
   /* Major collection cycle */
   if (tsk->need_major) {
-    if (tsk->skipremaining > 0) {
+    if (defer_major_collection(tsk)) {
+      /* Will be done later by handle_interrupt() when the task is idle */
+    }
+    else if (tsk->skipremaining > 0) {
       tsk->skipremaining--;
       node_log(tsk->n,LOG_INFO,"Skipping major collection (%d skips remaining)",
                tsk->skipremaining);
     }
     else {
 
+      struct timeval clearend;
+      struct timeval markend;
+      struct timeval fixupend;
+      parmark *pm;
       assert(NULL == tsk->newgen);
       prev_oldgenbytes = tsk->oldgenbytes;
       gettimeofday(&start,NULL);
       /* Mark phase */
       clear_marks(tsk,FLAG_MARKED);
+      gettimeofday(&clearend,NULL);
 
       block *prevgen = copy_heap_start(tsk);
 
       mark_start(tsk,FLAG_MARKED);
+      pm = parallel_mark_start(tsk);
       mark_roots(tsk,FLAG_MARKED);
       mark_incoming_global_refs(tsk,FLAG_MARKED);
       mark_new_objects(tsk,prevgen);
       mark_replicas(tsk,FLAG_MARKED);
+      if (pm)
+        parallel_mark_end(tsk,pm);
       mark_end(tsk,FLAG_MARKED);
+      gettimeofday(&markend,NULL);
 
       /* Copy phase */
       preserve_targets(tsk);
       sweep_globals(tsk);
+      replace_refs(tsk,0);
+      gettimeofday(&fixupend,NULL);
       copy_heap_finish(tsk,prevgen);
       #ifdef CHECK_HEAP_INTEGRITY
       check_all_refs_in_oldgen(tsk);
@@ -1406,14 +2181,20 @@ void local_collect(task *tsk)
 #endif
       #endif
       sweep_sysobjects(tsk,0);
+      sweep_mapped_files(tsk);
 
       double survived = ((double)tsk->oldgenbytes)/((double)prev_oldgenbytes);
 
+      gettimeofday(&end,NULL);
+
+      if (0 < opt_gctarget) {
+        adapt_major_frequency(tsk,start,end,survived);
+      }
       /* Each time we have a major collection and at least 90% of the objects
          survive, increment the number of major collections that are skipped
          (up to a maximum of 8).
          If less than 90% survived, we reset this number to 0. */
-      if (survived >= 0.9) {
+      else if (survived >= 0.9) {
         if (tsk->skipmajors < 4) {
           tsk->skipmajors++;
           node_log(tsk->n,LOG_INFO,"More than 90%% survived in a major collection; setting "
@@ -1426,16 +2207,25 @@ void local_collect(task *tsk)
 
       /* Skip the next n major collections */
       tsk->skipremaining = tsk->skipmajors;
-
-      gettimeofday(&end,NULL);
-      node_log(tsk->n,LOG_INFO,"MAJOR: %dms; %dkb of %dkb survived (%d%%)",
+      node_log(tsk->n,LOG_INFO,"MAJOR: %dms (clear %dms, mark/copy %dms, fixup %dms, sweep %dms, "
+               "%d helper threads); %dkb of %dkb survived (%d%%)",
                timeval_diffms(start,end),
+               timeval_diffms(start,clearend),
+               timeval_diffms(clearend,markend),
+               timeval_diffms(markend,fixupend),
+               timeval_diffms(fixupend,end),
+               tsk->gcpool ? tsk->gcpool->nhelpers : 0,
                tsk->oldgenbytes/1024,
                prev_oldgenbytes/1024,
                (int)(100.0*survived));
       tsk->majorms += timeval_diffms(start,end);
       tsk->gcms += timeval_diffms(start,end);
 
+      if (0 < prev_oldgenbytes/1024)
+        tsk->majorms_per_kb = ((double)timeval_diffms(start,end))/((double)(prev_oldgenbytes/1024));
+      tsk->lastmajorbytes = tsk->oldgenbytes;
+      tsk->major_deferred = 0;
+
       /* If, after a major collection, we still have more data than we're supposed to, abort. */
       if (opt_maxheap && (tsk->oldgenbytes >= opt_maxheap)) {
         fprintf(stderr,"Out of heap space!\n");
@@ -1444,6 +2234,7 @@ void local_collect(task *tsk)
 
     }
     tsk->need_major = 0;
+    tsk->major_forced = 0;
   }
 
   /* End */
@@ -1545,15 +2336,8 @@ static void sweep_incoming_references(task *tsk)
 static void reset_dmb(task *tsk)
 {
   assert(NULL == tsk->newgen);
-  block *bl;
-  for (bl = tsk->oldgen; bl; bl = bl->next) {
-    unsigned int off;
-    for (off = BLOCK_START; off < BLOCK_END; off += object_size(off+(char*)bl)) {
-      header *h = (header*)(off+(char*)bl);
-      h->flags &= ~FLAG_DMB;
-      h->flags &= ~FLAG_NEW;
-    }
-  }
+  parallel_blocks(tsk,tsk->oldgen,clear_marks_block,FLAG_DMB|FLAG_NEW);
+  clear_pinned_marks(tsk,FLAG_DMB|FLAG_NEW);
 
   global *glo;
   for (glo = tsk->globals.first; glo; glo = glo->next) {
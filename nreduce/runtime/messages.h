@@ -25,6 +25,14 @@
 
 #include "network/node.h"
 
+/* Version of the encoding used for the contents of messages between tasks (see data.c). Nodes
+   exchange this when they first connect to each other, and connections between nodes using
+   different versions are refused. */
+#define WIRE_VERSION            4
+
+/* Records within a MSG_BUNDLE are padded to a multiple of this many bytes */
+#define BUNDLE_ALIGN            8
+
 /* Distributed execution */
 #define MSG_DONE                0
 #define MSG_FISH                1
@@ -49,7 +57,8 @@
 #define MSG_COUNT_SPARKS        20
 #define MSG_NUM_SPARKS          21
 #define MSG_DISTRIBUTE          22
-#define MSG_HISTMAX             23
+#define MSG_BUNDLE              23
+#define MSG_HISTMAX             24
 
 /* Process startup */
 #define MSG_NEWTASK             100
@@ -74,6 +83,13 @@
 #define MSG_JCMD                400
 #define MSG_JCMD_RESPONSE       401
 
+/* File I/O */
+#define MSG_OPENFILE            500
+#define MSG_OPENFILE_RESPONSE   501
+#define MSG_READFILE            502
+#define MSG_READFILE_RESPONSE   503
+#define MSG_FILEIO_DONE         504
+
 /* Chord */
 #define MSG_FIND_SUCCESSOR      600
 #define MSG_GOT_SUCCESSOR       601
@@ -159,10 +175,46 @@ typedef struct {
   char data[0];
 } __attribute__ ((__packed__)) jcmd_response_msg;
 
+typedef struct {
+  int ioid;
+  endpointid replyto;
+  char filename[0];
+} __attribute__ ((__packed__)) openfile_msg;
+
+typedef struct {
+  int ioid;
+  int fd;
+  int error;
+  char errmsg[ERRMSG_MAX+1];
+} __attribute__ ((__packed__)) openfile_response_msg;
+
+typedef struct {
+  int ioid;
+  endpointid replyto;
+  int fd;
+  int size;
+} __attribute__ ((__packed__)) readfile_msg;
+
+typedef struct {
+  int ioid;
+  int error;
+  int len;
+  char data[0];
+} __attribute__ ((__packed__)) readfile_response_msg;
+
 typedef struct get_stats_msg {
   endpointid sender;
 } __attribute__ ((__packed__)) get_stats_msg;
 
+typedef struct globtable_stats {
+  int count;
+  int size;
+  int resizes;
+  int maxprobe;
+  long long lookups;
+  long long probes;
+} __attribute__ ((__packed__)) globtable_stats;
+
 typedef struct get_stats_response_msg {
   endpointid epid;
   /* frames */
@@ -173,6 +225,10 @@ typedef struct get_stats_response_msg {
   int cells;
   int bytes;
   int alloc;
+  /* global tables */
+  globtable_stats targethash;
+  globtable_stats physhash;
+  globtable_stats addrhash;
 } __attribute__ ((__packed__)) get_stats_response_msg;
 
 #endif
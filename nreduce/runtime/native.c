@@ -48,6 +48,8 @@
 #include <execinfo.h>
 #endif
 
+#ifdef NATIVE_SUPPORTED
+
 #define NATIVE_BEGIN
 #define NATIVE_END
 #define NATIVE_GLOBSTART
@@ -106,6 +108,7 @@ void op_jcmp(task *tsk, frame *runnable, const instruction *instr);
 void op_consn(task *tsk, frame *runnable, const instruction *instr);
 void op_itemn(task *tsk, frame *runnable, const instruction *instr);
 void op_jeq(task *tsk, frame *runnable, const instruction *instr);
+void op_arith(task *tsk, frame *runnable, const instruction *instr);
 void op_invalid(task *tsk, frame *runnable, const instruction *instr);
 int handle_interrupt(task *tsk);
 
@@ -137,6 +140,7 @@ op_fun *op_handlers[OP_COUNT] = {
   op_consn,
   op_itemn,
   op_jeq,
+  op_arith,
   op_invalid,
 };
 
@@ -313,7 +317,7 @@ void print_eip_bytecode(task *tsk, void *eip, char *str)
   if ((0 <= eip_addr) && (tsk->codesize > eip_addr)) {
     int addr = tsk->cpu_to_bcaddr[eip_addr];
     const instruction *instr = &program_ops[addr];
-    if (OP_BIF == instr->opcode)
+    if ((OP_BIF == instr->opcode) || (OP_ARITH == instr->opcode))
       snprintf(str,100,"%-6d %-12s",addr,builtin_info[instr->arg0].name);
     else
       snprintf(str,100,"%-6d %-12s",addr,opcodes[instr->opcode]);
@@ -620,8 +624,8 @@ void native_sigfpe(int sig, siginfo_t *ino, void *uc1)
 
   curf->instr = instr;
 
-  if ((OP_BIF == instr->opcode) || (OP_JCMP == instr->opcode)) {
-    int bif = (OP_BIF == instr->opcode) ? instr->arg0 : instr->arg1;
+  if ((OP_BIF == instr->opcode) || (OP_ARITH == instr->opcode) || (OP_JCMP == instr->opcode)) {
+    int bif = (OP_JCMP == instr->opcode) ? instr->arg1 : instr->arg0;
     int set = 0;
     if ((0 == stackoffset) && (2 == builtin_info[bif].nargs)) {
       pntr *argstack = &curf->data[instr->expcount-2];
@@ -844,7 +848,8 @@ void asm_alloc_cell_to_esi(task *tsk, x86_assembly *as)
   int Lcellallocated = as->labels++;
 
   I_MOV(reg(ESI),absmem((int)&tsk->newgenoffset));
-  I_CMP(reg(ESI),imm(sizeof(block)-sizeof(cell)));
+  I_LEA(reg(EAX),regmem(ESI,sizeof(cell)));
+  I_CMP(reg(EAX),absmem((int)&tsk->newgenlimit));
   I_JL(label(Lhavefreecell));
 
   /* Fall back to C version */
@@ -862,8 +867,7 @@ void asm_alloc_cell_to_esi(task *tsk, x86_assembly *as)
 
   LABEL(Lhavefreecell);
 
-  // newgenoffset += sizeof(cell)
-  I_LEA(reg(EAX),regmem(ESI,sizeof(cell)));
+  // newgenoffset += sizeof(cell) (EAX was computed above)
   I_MOV(absmem((int)&tsk->newgenoffset),reg(EAX));
 
   // get correct cell position
@@ -1085,6 +1089,8 @@ void native_compile(char *bcdata, int bcsize, task *tsk)
       I_MOV(regmem(EBX,FRAME_SPREV),reg(EAX));
       // tsk->sparklist->snext = f;
       I_MOV(absmem(((int)tsk->sparklist)+FRAME_SNEXT),reg(EAX));
+      // tsk->nsparks++;
+      I_ADD(absmem((int)&tsk->nsparks),imm(1));
 
       LABEL(Ldone);
       LABEL(bplabels[0][addr]);
@@ -1366,6 +1372,7 @@ void native_compile(char *bcdata, int bcsize, task *tsk)
     }
     #endif
     #ifdef NATIVE_BIF
+    case OP_ARITH:
     case OP_BIF: {
       int bif = instr->arg0;
       int nargs = builtin_info[bif].nargs;
@@ -1647,6 +1654,8 @@ void native_compile(char *bcdata, int bcsize, task *tsk)
       I_MOV(regmem(EDI,FRAME_SPREV),imm(0));
       // f->snext = NULL;
       I_MOV(regmem(EDI,FRAME_SNEXT),imm(0));
+      // tsk->nsparks--;
+      I_ADD(absmem((int)&tsk->nsparks),imm(-1));
 
       LABEL(Lnotsparked);
 #endif
@@ -2042,3 +2051,5 @@ void native_compile(char *bcdata, int bcsize, task *tsk)
   free(instrlabels);
   x86_assembly_free(as);
 }
+
+#endif /* NATIVE_SUPPORTED */
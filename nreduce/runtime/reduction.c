@@ -297,7 +297,7 @@ void reduce(task *tsk, pntrstack *s)
          execute the built-in function and overwrite the root of the redex with the result. */
     case CELL_BUILTIN: {
 
-      int bif = (int)get_pntr(get_pntr(target)->field1);
+      int bif = (long)get_pntr(get_pntr(target)->field1);
       int reqargs;
       int strictargs;
       int i;
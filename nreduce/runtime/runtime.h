@@ -32,6 +32,7 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <assert.h>
+#include <stddef.h>
 #include <setjmp.h>
 #include <signal.h>
 
@@ -51,6 +52,29 @@ struct gaddr;
 #define ENGINE_INTERPRETER 0
 #define ENGINE_NATIVE      1
 #define ENGINE_REDUCER     2
+#define ENGINE_THREADED    3
+
+/* The threaded engine relies on GCC's labels as values extension */
+#ifdef __GNUC__
+#define THREADED_DISPATCH
+#endif
+
+/* The native code generator (native.c) only produces IA-32 code, and the code it generates
+   depends on the 32-bit pntr layout, so the native engine is not available in other builds.
+   There is no x86-64 backend yet: porting it means changing the generated code to use the
+   LP64 pntr representation, SSE instead of x87, and 64-bit addressing of task fields, and
+   reworking the trap and swap_in patching to match. */
+#ifdef __i386__
+#define NATIVE_SUPPORTED
+#define DEFAULT_ENGINE ENGINE_NATIVE
+#define DEFAULT_ENGINE_NAME "native"
+#elif defined(THREADED_DISPATCH)
+#define DEFAULT_ENGINE ENGINE_THREADED
+#define DEFAULT_ENGINE_NAME "threaded"
+#else
+#define DEFAULT_ENGINE ENGINE_INTERPRETER
+#define DEFAULT_ENGINE_NAME "interpreter"
+#endif
 
 #define MAX_FRAME_SIZE   1024
 #define MAX_CAP_SIZE     1024
@@ -153,8 +177,9 @@ struct gaddr;
 #define B_BUILDARRAY     69
 #define B_PARSEXMLFILE   70
 #define B_GENSTRING      71
+#define B_MAPCHUNK       72
 
-#define NUM_BUILTINS     72
+#define NUM_BUILTINS     73
 
 #ifdef NDEBUG
 #define checkcell(_c) (_c)
@@ -197,6 +222,12 @@ typedef struct {
 
 #define BUILDARRAY_THRESHOLD 1024
 
+/* arrayprefix shares, rather than copies, any string chunk of at least this many characters.
+   The shared array is marked multiref so it is never extended in place, and a short suffix that
+   is still referenced keeps the whole array alive: a 32-byte tail of a 256 KB string read from a
+   file holds on to all 256 KB. Shorter chunks are copied, since sharing them saves little. */
+#define SHARESTRING_THRESHOLD 32
+
 #define HEADER_FIELDS \
   unsigned int type; \
   unsigned int flags; \
@@ -221,12 +252,81 @@ typedef struct cell {
   pntr field2;
 } __attribute__ ((__packed__)) cell;
 
+/* Pointer representation
+
+   A pntr is 8 bytes, and is either a double, or a NaN whose upper 13 bits are PNTR_VALUE,
+   with the remaining 51 bits identifying an object (these NaNs are never produced by
+   arithmetic operations).
+
+   On 32-bit platforms, data[0] holds the address, and the low 19 bits of data[1] hold the
+   index into the array for pntrs that reference an AREF cell.
+
+   On 64-bit platforms there is not enough room for a full address as well as an array
+   index, so all heap blocks are allocated from a single reserved region of HEAP_ARENA_BYTES
+   (see block_alloc()), and objects within it are referenced by their offset from heap_base
+   in units of 8 bytes, held in data[0]. The low 18 bits of data[1] hold the array index.
+   Objects outside the heap (frames, globals, sysobjects, and the small integers stored in
+   BUILTIN cells) are "raw" pntrs with PNTR_RAW set; these store the full 48-bit address,
+   with the upper 16 bits in data[1]. The same object always has the same encoding, so
+   pntrequal() can still compare the bits directly. */
+
 #define PNTR_MASK  0xFFF80000
-#define INDEX_MASK 0x0007FFFF
 #define PNTR_VALUE 0xFFF00000
 #define NULL_PNTR (*(pntr*)NULL_PNTR_BITS)
+
+#ifdef __LP64__
+
+#define PNTR_RAW   0x00040000
+#define INDEX_MASK 0x0003FFFF
+#define RAW_MASK   0x0000FFFF
+#define MAX_ARRAY_SIZE (1 << 18)
+#define HEAP_ARENA_BYTES (((unsigned long)1) << 35)
+
+#define in_heap_arena(__a) (((unsigned long)(__a))-((unsigned long)heap_base) < HEAP_ARENA_BYTES)
+#define heap_offset(__a) ((unsigned int)((((unsigned long)(__a))-((unsigned long)heap_base)) >> 3))
+#define heap_addr(__o) ((void*)(heap_base+(((unsigned long)(__o)) << 3)))
+
+#define make_pntr(__p,__c) { if (in_heap_arena(__c)) { \
+                               (__p).data[0] = heap_offset(__c); \
+                               (__p).data[1] = PNTR_VALUE; \
+                             } \
+                             else { \
+                               (__p).data[0] = (unsigned int)((unsigned long)(__c)); \
+                               (__p).data[1] = PNTR_VALUE | PNTR_RAW | \
+                                 (unsigned int)((((unsigned long)(__c)) >> 32) & RAW_MASK); \
+                             } }
+#define make_aref_pntr(__p,__c,__i) { assert((__i) < MAX_ARRAY_SIZE); \
+                            assert(in_heap_arena(__c)); \
+                            (__p).data[0] = heap_offset(__c); \
+                            (__p).data[1] = (PNTR_VALUE | (__i)); }
+#define aref_index(__p) ((__p).data[1] & INDEX_MASK)
+#define get_pntr(__p) (assert(is_pntr(__p)), \
+                       (((__p).data[1] & PNTR_RAW) ? \
+                        ((cell*)((((unsigned long)((__p).data[1] & RAW_MASK)) << 32) | \
+                                 (unsigned long)(__p).data[0])) : \
+                        ((cell*)heap_addr((__p).data[0]))))
+
+#else
+
+#define INDEX_MASK 0x0007FFFF
 #define MAX_ARRAY_SIZE (1 << 19)
 
+#define heap_offset(__a) ((unsigned int)(__a))
+#define heap_addr(__o) ((void*)(__o))
+
+#define make_pntr(__p,__c) { (__p).data[0] = (unsigned int)(__c); \
+                             (__p).data[1] = PNTR_VALUE; }
+#define make_aref_pntr(__p,__c,__i) { assert((__i) < MAX_ARRAY_SIZE); \
+                            (__p).data[0] = (unsigned int)(__c); \
+                            (__p).data[1] = (PNTR_VALUE | (__i)); }
+#define aref_index(__p) ((__p).data[1] & ~PNTR_MASK)
+#define get_pntr(__p) (assert(is_pntr(__p)), ((cell*)(*((unsigned int*)&(__p)))))
+
+#endif
+
+/* Changes the object a heap pntr refers to, keeping any array index */
+#define repoint_pntr(__p,__c) ((__p).data[0] = heap_offset(__c))
+
 #define pfield1(__p) (get_pntr(__p)->field1)
 #define pfield2(__p) (get_pntr(__p)->field2)
 #define ppfield1(__p) (get_pntr(pfield1(__p)))
@@ -237,15 +337,8 @@ typedef struct cell {
 #define pntrdouble(__p) (*(double*)&(__p))
 #define set_pntrdouble(__p,__val) ({ (*(double*)&(__p)) = (__val); })
 #define is_pntr(__p) (((__p).data[1] & PNTR_MASK) == PNTR_VALUE)
-#define make_pntr(__p,__c) { (__p).data[0] = (unsigned int)(__c); \
-                             (__p).data[1] = PNTR_VALUE; }
-#define make_aref_pntr(__p,__c,__i) { assert((__i) < MAX_ARRAY_SIZE); \
-                            (__p).data[0] = (unsigned int)(__c); \
-                            (__p).data[1] = (PNTR_VALUE | (__i)); }
-#define aref_index(__p) ((__p).data[1] & ~PNTR_MASK)
 #define aref_array(__p) ((carray*)get_pntr(get_pntr(__p)->field1))
 #define aref_tail(__p) (get_pntr(__p)->field2)
-#define get_pntr(__p) (assert(is_pntr(__p)), ((cell*)(*((unsigned int*)&(__p)))))
 #define pntrequal(__a,__b) (((__a).data[0] == (__b).data[0]) && ((__a).data[1] == (__b).data[1]))
 
 #define is_nullpntr(__p) (is_pntr(__p) && ((cell*)1 == get_pntr(__p)))
@@ -301,6 +394,15 @@ typedef struct {
   unsigned int jid;
 } javaid;
 
+/* A file that is read by mapping it into memory; see mapfile.c */
+typedef struct mappedfile {
+  long long size;
+  int nchunks;
+  int nextchunk;
+  int fallback;
+  char **regions;
+} mappedfile;
+
 typedef struct sysobject {
   int type;
   int marked;
@@ -311,6 +413,7 @@ typedef struct sysobject {
   int connected;
   char *buf;
   int len;
+  message *readmsg;
   int closed;
   int retry;
   int error;
@@ -333,6 +436,7 @@ typedef struct sysobject {
   struct sysobject *next;
   int from_network;
   int outgoing_connection;
+  mappedfile *mf;
 } sysobject;
 
 typedef struct carray {
@@ -476,9 +580,6 @@ typedef struct global {
   int fetching;
   waitqueue wq;
   unsigned int flags;
-  struct global *targetnext; /* for targethash entries */
-  struct global *physnext; /* for physhash entries */
-  struct global *addrnext; /* for addrhash entries */
   struct global *next; /* for tsk->globals */
   struct global *prev; /* for tsk->globals */
   int stale_replica;
@@ -487,19 +588,40 @@ typedef struct global {
   int deleteme;
 } global;
 
+/* Tables of globals, indexed either by their object pointer (targethash and physhash) or by their
+   global address (addrhash). These use open addressing with linear probing, and double in size
+   whenever they become more than GLOBTABLE_MAXLOAD percent full, so that lookups remain cheap
+   with millions of globals. */
+
+#define GLOBTABLE_BYPNTR        0
+#define GLOBTABLE_BYADDR        1
+#define GLOBTABLE_INITSIZE      1024
+#define GLOBTABLE_MAXLOAD       70
+
+typedef struct globtable {
+  global **slots;
+  int size;
+  int count;
+  int key;
+  int resizes;
+  int maxprobe;
+  long long lookups;
+  long long probes;
+} globtable;
+
 /* task */
 
 typedef struct block {
   struct block *next;
-  int used; /* only set on full blocks */
+  long used; /* only set on full blocks */
   char data[BLOCK_BYTES];
 } block;
-#define BLOCK_START ((unsigned int)&((block*)0)->data[0])
-#define BLOCK_END ((unsigned int)&((block*)0)->data[BLOCK_BYTES])
+#define BLOCK_START ((unsigned int)offsetof(block,data))
+#define BLOCK_END (BLOCK_START+BLOCK_BYTES)
 
 typedef struct frameblock {
   struct frameblock *next;
-  int pad;
+  long pad;
   char mem[FRAMEBLOCK_SIZE];
 } frameblock;
 
@@ -508,6 +630,13 @@ typedef struct ioframe {
   int freelnk;
 } ioframe;
 
+/* A list cell that has been received, but whose tail has not yet been read (see read_list()) */
+typedef struct listcell {
+  gaddr addr;
+  int type;
+  pntr p;
+} listcell;
+
 typedef struct task {
 
   /* general */
@@ -534,9 +663,9 @@ typedef struct task {
   int paused;
 
   /* distributed memory management */
-  global **targethash;
-  global **physhash;
-  global **addrhash;
+  globtable targethash;
+  globtable physhash;
+  globtable addrhash;
   struct {
     global *first;
     global *last;
@@ -547,7 +676,17 @@ typedef struct task {
   int gciter;
   array **inflight_addrs;
   array **unack_msg_acount;
+  array **outbatch;
+  int *outbatchcount;
+  int in_interrupt;
+  int msgs_batched;
+  int batches_sent;
   int nfetching;
+  int prefetchcells;
+  int prefetchlimit;
+  int prefetched;
+  array *prefetchsent;
+  array *listcells;
 
   /* I/O requests */
   int ioalloc;
@@ -561,6 +700,15 @@ typedef struct task {
   frame **runptr;
   frame *rtemp;
   frame *sparklist;
+  int nsparks;
+  struct sparkslot *sparkslot;
+  int *sparkhints;
+  int fishdelay;
+  int fish_sent;
+  int fish_recv;
+  int fish_forwarded;
+  int frames_sent;
+  int frames_recv;
   int nextlid;
   int *gcsent;
   list *inflight;
@@ -577,10 +725,13 @@ typedef struct task {
   block *newgen;
   unsigned int oldgenoffset;
   unsigned int newgenoffset;
+  unsigned int newgenlimit;
+  block *sparenursery;
+  int nurserybytes;
+  struct timeval lastminorend;
+  struct timeval lastmajorend;
   int oldgenbytes;
   frameblock *frameblocks;
-  frameblock *searchfb;
-  int searchpos;
   cell *freeptr;
   pntr globnilpntr;
   pntr globtruepntr;
@@ -588,9 +739,12 @@ typedef struct task {
   int nstrings;
   pntrstack *streamstack;
   stack *markstack;
+  struct gcpool *gcpool;
   int indistgc;
   unsigned int newcellflags;
   int inmark;
+  int inbundle;
+  int markspending;
   int indcstart;
   int alloc_bytes;
   int framesize;
@@ -604,6 +758,10 @@ typedef struct task {
   int altspace;
   int skipmajors;
   int skipremaining;
+  int major_forced;
+  int major_deferred;
+  int lastmajorbytes;
+  double majorms_per_kb;
   array *lifetimes;
   unsigned int total_bytes_allocated;
   list *wakeup_after_collect;
@@ -672,6 +830,9 @@ void addrhash_add(task *tsk, global *glo);
 void targethash_remove(task *tsk, global *glo);
 void physhash_remove(task *tsk, global *glo);
 void addrhash_remove(task *tsk, global *glo);
+void globtable_init(globtable *gt, int key);
+void globtable_destroy(globtable *gt);
+global **globtable_reset(globtable *gt);
 
 global *add_target(task *tsk, gaddr addr, pntr p);
 gaddr get_physical_address(task *tsk, pntr p);
@@ -738,6 +899,9 @@ typedef struct reader {
 #define GADDR_TAG  0x85113B1C
 #define PNTR_TAG   0xE901FA12
 
+/* Type sent in place of CELL_NUMBER for numbers that are exact integers */
+#define WIRE_INTEGER CELL_COUNT
+
 reader read_start(task *tsk, const char *data, int size);
 void read_check_tag(reader *rd, int tag);
 void read_char(reader *rd, char *c);
@@ -766,13 +930,20 @@ void write_binary(array *wr, const void *b, int len);
 void write_gaddr(array *wr, task *tsk, gaddr a);
 void write_ref(array *arr, task *tsk, pntr p);
 void write_pntr(array *arr, task *tsk, pntr p, int refonly);
+void write_prefetch(array *arr, task *tsk, pntr p);
 void write_vformat(array *wr, task *tsk, const char *fmt, va_list ap);
 void write_format(array *wr, task *tsk, const char *fmt, ...);
 void write_end(array *wr);
 
+void msg_flush_dest(task *tsk, int dest);
+void msg_flush(task *tsk);
 void msg_send(task *tsk, int dest, int tag, char *data, int size);
 void msg_fsend(task *tsk, int dest, int tag, const char *fmt, ...);
 
+/* testwire */
+
+void run_wirebench(void);
+
 /* reduction */
 
 pntr instantiate_scomb(task *tsk, pntrstack *s, scomb *sc);
@@ -794,6 +965,7 @@ pntr mkcons(task *tsk, pntr head, pntr tail);
 
 int get_builtin(const char *name);
 void maybe_expand_array(task *tsk, pntr p);
+pntr binary_data_to_list(task *tsk, const char *data, int size, pntr tail);
 pntr string_to_array(task *tsk, const char *str);
 int array_to_string(pntr refpntr, char **str);
 int flatten_list(pntr refpntr, pntr **data);
@@ -811,6 +983,7 @@ int count_sparks(task *tsk);
 void response_for_fetching_ref(task *tsk, global *target, pntr obj);
 void add_waiter_frame(waitqueue *wq, frame *f);
 void schedule_frame(task *tsk, frame *f, int desttsk, array *msg);
+array *schedule_start(task *tsk, int nframes);
 void eval_remoteref(task *tsk, frame *f2, pntr p);
 void resume_local_waiters(task *tsk, waitqueue *wq);
 void resume_fetchers(task *tsk, waitqueue *wq, pntr obj);
@@ -826,10 +999,16 @@ void interpreter_thread(node *n, endpoint *endpt, void *arg);
 /* memory */
 
 #define REF_FLAGS 0xFFFFFFFF
+#define forward_addr(__h) ((header*)heap_addr((__h)->type))
 unsigned int object_size(void *ptr);
+block *block_alloc(void);
+void block_free(block *bl);
+void *arena_region_alloc(unsigned long nbytes);
+void arena_region_free(void *mem, unsigned long nbytes);
 void mark_global(task *tsk, global *glo, unsigned int bit, int depth);
 void mark_start(task *tsk, unsigned int bit);
 void mark_end(task *tsk, unsigned int bit);
+void gcpool_free(task *tsk);
 void *alloc_mem(task *tsk, unsigned int nbytes);
 void *realloc_mem(task *tsk, void *old, unsigned int nbytes);
 cell *alloc_cell(task *tsk);
@@ -906,13 +1085,20 @@ void trace_step(task *tsk, pntr target, int allapps, const char *format, ...);
 
 /* native */
 
+#ifdef NATIVE_SUPPORTED
 void native_sigusr1(int sig, siginfo_t *ino, void *uc1);
 void native_sigfpe(int sig, siginfo_t *ino, void *uc1);
 void native_sigsegv(int sig, siginfo_t *ino, void *uc1);
 void native_compile(char *bcdata, int bcsize, task *tsk);
+#endif
 
 /* manager */
 
+/* Values of opt_distgcpause: which parts of a distributed collection tasks are paused for */
+#define DISTGC_PAUSE_NONE 0
+#define DISTGC_PAUSE_MARK 1
+#define DISTGC_PAUSE_ALL  2
+
 typedef struct gcarg {
   int ntasks;
   endpointid idmap[0];
@@ -924,6 +1110,10 @@ void start_manager(node *n);
 
 void interpreter_count_sparks(task *tsk, message *msg);
 void interpreter_distribute(task *tsk, message *msg);
+void sparkboard_register(task *tsk);
+void sparkboard_unregister(task *tsk);
+void sparkboard_publish(task *tsk);
+int sparkboard_victim(task *tsk);
 void scheduler_thread(node *n, endpoint *endpt, void *arg);
 
 /* java */
@@ -934,12 +1124,30 @@ pntr decode_java_response(task *tsk, const char *str, endpointid source);
 void send_jcmd(endpoint *endpt, int ioid, int oneway, const char *data, int cmdlen);
 void java_thread(node *n, endpoint *endpt, void *arg);
 
+/* fileio */
+
+void send_openfile(endpoint *endpt, int ioid, const char *filename);
+void send_readfile(endpoint *endpt, int ioid, int fd, int size);
+void start_fileio(node *n);
+
+/* mapfile */
+
+mappedfile *mapfile_new(int fd);
+void mapfile_free(mappedfile *mf);
+carray *mapfile_next_chunk(task *tsk, mappedfile *mf, int fd);
+int mapfile_finished(mappedfile *mf);
+int mapfile_referenced(mappedfile *mf);
+void mapfile_clear_marks(mappedfile *mf, unsigned int bit);
+
 #ifndef BUILTINS_C
 extern builtin builtin_info[NUM_BUILTINS];
 #endif
 
 #ifndef MEMORY_C
 extern unsigned char NULL_PNTR_BITS[8];
+#ifdef __LP64__
+extern char *heap_base;
+#endif
 extern const char *cell_types[CELL_COUNT];
 extern const char *sysobject_types[SYSOBJECT_COUNT];
 extern const char *frame_states[5];
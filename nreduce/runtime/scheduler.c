@@ -40,6 +40,7 @@
 #include <stdarg.h>
 #include <math.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -67,7 +68,7 @@ void interpreter_distribute(task *tsk, message *msg)
     if (dist[to] > 0) {
       node_log(tsk->n,LOG_INFO,"DISTRIBUTE1: %d -> %d : %d sparks",tsk->tid,to,dist[to]);
 
-      array *newmsg = write_start();
+      array *newmsg = schedule_start(tsk,dist[to]);
       int found = 0;
       while (dist[to] > 0) {
         frame *spark = tsk->sparklist->sprev;
@@ -92,6 +93,125 @@ void interpreter_distribute(task *tsk, message *msg)
   }
 }
 
+/* Spark board
+
+   Tasks running in the same process can't take sparks from each other directly, because
+   each has its own heap, so a spark can only be moved by serialising it in a SCHEDULE
+   message. What they can do cheaply is see which of their neighbours actually have sparks,
+   so that an idle task sends its FISH request to one of them, rather than to a randomly
+   chosen task which may well be idle too.
+
+   This is not work stealing: there are no per-thread spark deques, and a spark is always
+   handed over by its owner in response to a FISH. Stealing sparks directly would need the
+   interpreter threads of a process to share a heap and a collector.
+
+   Each task publishes its spark count in a slot of this process-wide table whenever it
+   handles an interrupt. The counts are only hints, and are read without locking; the lock
+   is only needed to claim and release slots.
+
+   A task's slot is found by hashing its localid, with linear probing. When a task exits its
+   slot is marked as deleted rather than emptied, so that lookups of other tasks further along
+   the same run of slots still find them. If every slot is in use, a newly started task logs a
+   warning and does not publish its count, so its neighbours won't choose it as a victim. */
+
+#define SPARKBOARD_SIZE 256
+#define SPARKSLOT_EMPTY 0
+#define SPARKSLOT_DELETED UINT32_MAX
+
+typedef struct sparkslot {
+  volatile uint32_t localid;
+  volatile int nsparks;
+} sparkslot;
+
+static sparkslot sparkboard[SPARKBOARD_SIZE];
+static pthread_mutex_t sparkboard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define sparkboard_hash(_localid,_i) (((_localid)%SPARKBOARD_SIZE+(_i))%SPARKBOARD_SIZE)
+
+void sparkboard_register(task *tsk)
+{
+  uint32_t localid = tsk->endpt->epid.localid;
+  int i;
+  assert((SPARKSLOT_EMPTY != localid) && (SPARKSLOT_DELETED != localid));
+  lock_mutex(&sparkboard_lock);
+  for (i = 0; i < SPARKBOARD_SIZE; i++) {
+    sparkslot *slot = &sparkboard[sparkboard_hash(localid,i)];
+    if ((SPARKSLOT_EMPTY == slot->localid) || (SPARKSLOT_DELETED == slot->localid)) {
+      slot->nsparks = 0;
+      slot->localid = localid;
+      tsk->sparkslot = slot;
+      break;
+    }
+  }
+  unlock_mutex(&sparkboard_lock);
+
+  if (NULL == tsk->sparkslot)
+    node_log(tsk->n,LOG_WARNING,"Spark board full (%d slots); task %d will not publish its sparks",
+             SPARKBOARD_SIZE,tsk->tid);
+}
+
+void sparkboard_unregister(task *tsk)
+{
+  int h;
+  if (NULL == tsk->sparkslot)
+    return;
+  lock_mutex(&sparkboard_lock);
+  h = tsk->sparkslot-sparkboard;
+  tsk->sparkslot->nsparks = 0;
+  tsk->sparkslot->localid = SPARKSLOT_DELETED;
+  tsk->sparkslot = NULL;
+
+  /* No lookup needs to probe past a slot that is followed by an empty one, so if that is the
+     case, this slot and any deleted ones before it can be emptied */
+  if (SPARKSLOT_EMPTY == sparkboard[(h+1)%SPARKBOARD_SIZE].localid) {
+    while (SPARKSLOT_DELETED == sparkboard[h].localid) {
+      sparkboard[h].localid = SPARKSLOT_EMPTY;
+      h = (h+SPARKBOARD_SIZE-1)%SPARKBOARD_SIZE;
+    }
+  }
+  unlock_mutex(&sparkboard_lock);
+}
+
+void sparkboard_publish(task *tsk)
+{
+  if (tsk->sparkslot)
+    tsk->sparkslot->nsparks = tsk->nsparks;
+}
+
+static int sparkboard_lookup(uint32_t localid)
+{
+  int i;
+  for (i = 0; i < SPARKBOARD_SIZE; i++) {
+    sparkslot *slot = &sparkboard[sparkboard_hash(localid,i)];
+    if (localid == slot->localid)
+      return slot->nsparks;
+    if (SPARKSLOT_EMPTY == slot->localid)
+      break;
+  }
+  return 0;
+}
+
+/* Returns the tid of the task in the same process as tsk which has the most sparks, or -1
+   if none of them have any */
+int sparkboard_victim(task *tsk)
+{
+  int best = -1;
+  int bestcount = 0;
+  int i;
+  for (i = 0; i < tsk->groupsize; i++) {
+    if ((i != tsk->tid) &&
+        (tsk->idmap[i].ip == tsk->endpt->epid.ip) &&
+        (tsk->idmap[i].port == tsk->endpt->epid.port)) {
+      int count = sparkboard_lookup(tsk->idmap[i].localid);
+      if (count > bestcount) {
+        best = i;
+        bestcount = count;
+      }
+    }
+  }
+  return best;
+}
+
 void scheduler(int n, int *nsparks, int **transfer, double tolerance)
 {
   int below[n];
@@ -48,109 +48,209 @@ extern const module_info *modules;
 
 pthread_key_t task_key;
 // FIXME: make sure these are set correctly
-int engine_type = ENGINE_NATIVE;
+int engine_type = DEFAULT_ENGINE;
 int strict_evaluation = 1;
 int opt_postpone = 1;
 int opt_fishframes = 128;
 int opt_fishhalf = 0;
 int opt_buildarray = 1;
 int opt_maxheap = 0;
+int opt_gcthreads = 0;
+int opt_deferpause = 0;
+int opt_nursery = 0;
+int opt_gctarget = 0;
+int opt_prefetch = 0;
+int opt_prefetchbytes = 65536;
+int opt_distgcpause = DISTGC_PAUSE_MARK;
+int opt_fileiothreads = 4;
+int opt_readchunksize = DEFAULT_IOSIZE;
+
+static inline uint64_t pntr_key(pntr p)
+{
+  return ((uint64_t)(uint32_t)p.data[1] << 32) | (uint32_t)p.data[0];
+}
 
-global *targethash_lookup(task *tsk, pntr p)
+static inline uint64_t gaddr_key(gaddr addr)
+{
+  return ((uint64_t)(uint32_t)addr.tid << 32) | (uint32_t)addr.lid;
+}
+
+static inline uint64_t globtable_key(globtable *gt, global *glo)
+{
+  return (GLOBTABLE_BYPNTR == gt->key) ? pntr_key(glo->p) : gaddr_key(glo->addr);
+}
+
+/* Mixes all bits of the key into the low bits used to select a slot (the finalizer from
+   MurmurHash3). Object pointers are aligned and global addresses are sequential, so neither can
+   be used directly. */
+static inline int globtable_slot(globtable *gt, uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return (int)(k & (gt->size-1));
+}
+
+void globtable_init(globtable *gt, int key)
+{
+  memset(gt,0,sizeof(globtable));
+  gt->key = key;
+  gt->size = GLOBTABLE_INITSIZE;
+  gt->slots = (global**)calloc(gt->size,sizeof(global*));
+}
+
+void globtable_destroy(globtable *gt)
 {
-  int h = hash(&p,sizeof(pntr));
-  global *g = tsk->targethash[h];
-  while (g && !pntrequal(g->p,p))
-    g = g->targetnext;
+  free(gt->slots);
+  gt->slots = NULL;
+}
+
+/* Empties the table, returning the old slot array (of the same size as the table) to the caller,
+   who is responsible for re-adding the globals and freeing it. Used by the garbage collector when
+   objects have moved, and so their keys have changed. */
+global **globtable_reset(globtable *gt)
+{
+  global **old = gt->slots;
+  gt->slots = (global**)calloc(gt->size,sizeof(global*));
+  gt->count = 0;
+  return old;
+}
+
+static global *globtable_lookup(globtable *gt, uint64_t k)
+{
+  int mask = gt->size-1;
+  int h = globtable_slot(gt,k);
+  int probes = 1;
+  global *g;
+
+  while ((NULL != (g = gt->slots[h])) && (globtable_key(gt,g) != k)) {
+    h = (h+1) & mask;
+    probes++;
+  }
+
+  gt->lookups++;
+  gt->probes += probes;
+  if (gt->maxprobe < probes)
+    gt->maxprobe = probes;
   return g;
 }
 
+static void globtable_insert(globtable *gt, global *glo)
+{
+  int mask = gt->size-1;
+  int h = globtable_slot(gt,globtable_key(gt,glo));
+  while (NULL != gt->slots[h])
+    h = (h+1) & mask;
+  gt->slots[h] = glo;
+  gt->count++;
+}
+
+static void globtable_resize(globtable *gt, int newsize)
+{
+  global **old = gt->slots;
+  int oldsize = gt->size;
+  int i;
+
+  gt->size = newsize;
+  gt->slots = (global**)calloc(gt->size,sizeof(global*));
+  gt->count = 0;
+  gt->resizes++;
+  for (i = 0; i < oldsize; i++)
+    if (NULL != old[i])
+      globtable_insert(gt,old[i]);
+  free(old);
+}
+
+static void globtable_add(globtable *gt, global *glo)
+{
+  if (100*(gt->count+1) > GLOBTABLE_MAXLOAD*gt->size)
+    globtable_resize(gt,2*gt->size);
+  globtable_insert(gt,glo);
+}
+
+/* Removes glo if it is present. Rather than leaving a marker in the vacated slot, later entries
+   in the same run are moved back to fill the gap if their home slot allows it, so that the table
+   never fills up with deleted entries. */
+static void globtable_remove(globtable *gt, global *glo)
+{
+  int mask = gt->size-1;
+  int h = globtable_slot(gt,globtable_key(gt,glo));
+  int j;
+
+  while ((NULL != gt->slots[h]) && (glo != gt->slots[h]))
+    h = (h+1) & mask;
+  if (NULL == gt->slots[h])
+    return;
+
+  gt->slots[h] = NULL;
+  gt->count--;
+
+  for (j = (h+1) & mask; NULL != gt->slots[j]; j = (j+1) & mask) {
+    int home = globtable_slot(gt,globtable_key(gt,gt->slots[j]));
+    /* The entry at j can move to h unless its home slot lies cyclically in (h,j] */
+    if ((h <= j) ? ((home <= h) || (home > j)) : ((home <= h) && (home > j))) {
+      gt->slots[h] = gt->slots[j];
+      gt->slots[j] = NULL;
+      h = j;
+    }
+  }
+
+  if ((GLOBTABLE_INITSIZE < gt->size) && (8*gt->count < gt->size))
+    globtable_resize(gt,gt->size/2);
+}
+
+global *targethash_lookup(task *tsk, pntr p)
+{
+  return globtable_lookup(&tsk->targethash,pntr_key(p));
+}
+
 global *physhash_lookup(task *tsk, pntr p)
 {
-  int h = hash(&p,sizeof(pntr));
-  global *g = tsk->physhash[h];
-  while (g && !pntrequal(g->p,p))
-    g = g->physnext;
-  return g;
+  return globtable_lookup(&tsk->physhash,pntr_key(p));
 }
 
 global *addrhash_lookup(task *tsk, gaddr addr)
 {
-  int h = hash(&addr,sizeof(gaddr));
-  global *g = tsk->addrhash[h];
-  while (g && ((g->addr.tid != addr.tid) || (g->addr.lid != addr.lid)))
-    g = g->addrnext;
-  return g;
+  return globtable_lookup(&tsk->addrhash,gaddr_key(addr));
 }
 
 void targethash_add(task *tsk, global *glo)
 {
-  int h = hash(&glo->p,sizeof(pntr));
-  assert(NULL == glo->targetnext);
   assert(NULL == targethash_lookup(tsk,glo->p));
-  glo->targetnext = tsk->targethash[h];
-  tsk->targethash[h] = glo;
+  globtable_add(&tsk->targethash,glo);
 }
 
 void physhash_add(task *tsk, global *glo)
 {
-  int h = hash(&glo->p,sizeof(pntr));
-  assert(NULL == glo->physnext);
   assert(NULL == physhash_lookup(tsk,glo->p));
-  glo->physnext = tsk->physhash[h];
-  tsk->physhash[h] = glo;
+  globtable_add(&tsk->physhash,glo);
 }
 
 void addrhash_add(task *tsk, global *glo)
 {
-  int h = hash(&glo->addr,sizeof(gaddr));
-  assert(NULL == glo->addrnext);
   assert(0 <= glo->addr.lid);
   assert(NULL == addrhash_lookup(tsk,glo->addr));
-  glo->addrnext = tsk->addrhash[h];
-  tsk->addrhash[h] = glo;
+  globtable_add(&tsk->addrhash,glo);
 }
 
 void targethash_remove(task *tsk, global *glo)
 {
-  int h = hash(&glo->p,sizeof(pntr));
-  global **ptr = &tsk->targethash[h];
-
   assert(glo);
-  while (*ptr && (*ptr != glo))
-    ptr = &(*ptr)->targetnext;
-  if (*ptr == glo) {
-    *ptr = glo->targetnext;
-    glo->targetnext = NULL;
-  }
+  globtable_remove(&tsk->targethash,glo);
 }
 
 void physhash_remove(task *tsk, global *glo)
 {
-  int h = hash(&glo->p,sizeof(pntr));
-  global **ptr = &tsk->physhash[h];
-
   assert(glo);
-  while (*ptr && (*ptr != glo))
-    ptr = &(*ptr)->physnext;
-  if (*ptr == glo) {
-    *ptr = glo->physnext;
-    glo->physnext = NULL;
-  }
+  globtable_remove(&tsk->physhash,glo);
 }
 
 void addrhash_remove(task *tsk, global *glo)
 {
-  int h = hash(&glo->addr,sizeof(gaddr));
-  global **ptr = &tsk->addrhash[h];
-
   assert(glo);
-  while (*ptr && (*ptr != glo))
-    ptr = &(*ptr)->addrnext;
-  if (*ptr == glo) {
-    *ptr = glo->addrnext;
-    glo->addrnext = NULL;
-  }
+  globtable_remove(&tsk->addrhash,glo);
 }
 
 /* Returns the physical address associated with the object p, creating a new GAT entry if needed */
@@ -234,6 +334,7 @@ void append_spark(task *tsk, frame *f)
   f->sprev = last;
   last->snext = f;
   tsk->sparklist->sprev = f;
+  tsk->nsparks++;
 }
 
 void prepend_spark(task *tsk, frame *f)
@@ -246,6 +347,7 @@ void prepend_spark(task *tsk, frame *f)
   f->snext = first;
   first->sprev = f;
   tsk->sparklist->snext = f;
+  tsk->nsparks++;
 }
 
 void remove_spark(task *tsk, frame *f)
@@ -262,6 +364,7 @@ void remove_spark(task *tsk, frame *f)
 
   f->sprev = NULL;
   f->snext = NULL;
+  tsk->nsparks--;
 }
 
 void check_sparks(task *tsk)
@@ -485,6 +588,10 @@ task *task_new(int tid, int groupsize, const char *bcdata, int bcsize, array *ar
   tsk->freeptr = (cell*)1;
   tsk->oldgenoffset = BLOCK_START;
   tsk->newgenoffset = sizeof(block);
+  tsk->newgenlimit = sizeof(block);
+  tsk->nurserybytes = opt_nursery;
+  gettimeofday(&tsk->lastminorend,NULL);
+  tsk->lastmajorend = tsk->lastminorend;
   tsk->altspace = FLAG_ALTSPACE;
   tsk->lifetimes = array_new(sizeof(unsigned int),0);
 
@@ -497,9 +604,11 @@ task *task_new(int tid, int groupsize, const char *bcdata, int bcsize, array *ar
   make_pntr(tsk->globnilpntr,globnilvalue);
   set_pntrdouble(tsk->globtruepntr,1.0);
 
-  tsk->targethash = (global**)calloc(GLOBAL_HASH_SIZE,sizeof(global*));
-  tsk->physhash = (global**)calloc(GLOBAL_HASH_SIZE,sizeof(global*));
-  tsk->addrhash = (global**)calloc(GLOBAL_HASH_SIZE,sizeof(global*));
+  globtable_init(&tsk->targethash,GLOBTABLE_BYPNTR);
+  globtable_init(&tsk->physhash,GLOBTABLE_BYPNTR);
+  globtable_init(&tsk->addrhash,GLOBTABLE_BYADDR);
+  tsk->prefetchsent = array_new(sizeof(cell*),0);
+  tsk->listcells = array_new(sizeof(listcell),0);
   tsk->idmap = (endpointid*)calloc(groupsize,sizeof(endpointid));
 
   tsk->ioalloc = 1;
@@ -561,13 +670,17 @@ task *task_new(int tid, int groupsize, const char *bcdata, int bcsize, array *ar
   tsk->stats.caps = (int*)calloc(bch->nfunctions,sizeof(int));
   tsk->stats.usage = (int*)calloc(bch->nops,sizeof(int));
   tsk->gcsent = (int*)calloc(tsk->groupsize,sizeof(int));
+  tsk->sparkhints = (int*)calloc(tsk->groupsize,sizeof(int));
   tsk->distmarks = (array**)calloc(tsk->groupsize,sizeof(array*));
 
   tsk->inflight_addrs = (array**)calloc(tsk->groupsize,sizeof(array*));
   tsk->unack_msg_acount = (array**)calloc(tsk->groupsize,sizeof(array*));
+  tsk->outbatch = (array**)calloc(tsk->groupsize,sizeof(array*));
+  tsk->outbatchcount = (int*)calloc(tsk->groupsize,sizeof(int));
   for (i = 0; i < tsk->groupsize; i++) {
     tsk->inflight_addrs[i] = array_new(sizeof(gaddr),0);
     tsk->unack_msg_acount[i] = array_new(sizeof(int),0);
+    tsk->outbatch[i] = array_new(1,0);
     tsk->distmarks[i] = array_new(sizeof(gaddr),0);
   }
 
@@ -627,22 +740,21 @@ void task_free(task *tsk)
   sweep_sysobjects(tsk,1);
 
 #if 0
-  int h;
   /* FIXME */
   sweep(tsk,1);
 
   /* Make sure all globals are deleted; this should be handled by sweep */
-  for (h = 0; h < GLOBAL_HASH_SIZE; h++) {
-    assert(NULL == tsk->addrhash[h]);
-    assert(NULL == tsk->targethash[h]);
-    assert(NULL == tsk->physhash[h]);
-  }
+  assert(0 == tsk->addrhash.count);
+  assert(0 == tsk->targethash.count);
+  assert(0 == tsk->physhash.count);
   assert(NULL == tsk->globals.first);
   assert(NULL == tsk->globals.last);
 #endif
 
+  gcpool_free(tsk);
   free_blocks(tsk->oldgen);
   free_blocks(tsk->newgen);
+  free_blocks(tsk->sparenursery);
 
   free(tsk->idmap);
   free(tsk->ioframes);
@@ -650,6 +762,7 @@ void task_free(task *tsk)
   for (i = 0; i < tsk->groupsize; i++) {
     array_free(tsk->inflight_addrs[i]);
     array_free(tsk->unack_msg_acount[i]);
+    array_free(tsk->outbatch[i]);
     array_free(tsk->distmarks[i]);
   }
 
@@ -670,14 +783,19 @@ void task_free(task *tsk)
   free(tsk->stats.caps);
   free(tsk->stats.usage);
   free(tsk->gcsent);
+  free(tsk->sparkhints);
   free(tsk->error);
   free(tsk->distmarks);
-  free(tsk->targethash);
-  free(tsk->physhash);
-  free(tsk->addrhash);
+  globtable_destroy(&tsk->targethash);
+  globtable_destroy(&tsk->physhash);
+  globtable_destroy(&tsk->addrhash);
+  array_free(tsk->prefetchsent);
+  array_free(tsk->listcells);
 
   free(tsk->inflight_addrs);
   free(tsk->unack_msg_acount);
+  free(tsk->outbatch);
+  free(tsk->outbatchcount);
 
   free(tsk->code);
   free(tsk->bcaddr_to_fno);
@@ -1004,9 +1122,14 @@ void print_profile(task *tsk)
   for (i = 0; i < NUM_BUILTINS; i++)
     bifusage[i].fno = i;
 
-  for (addr = 0; addr < bch->nops; addr++)
-    if (OP_BIF == instructions[addr].opcode)
+  /* Arithmetic and comparison sites are rewritten from OP_BIF during peephole optimisation, but
+     are still uses of the builtin */
+  for (addr = 0; addr < bch->nops; addr++) {
+    if ((OP_BIF == instructions[addr].opcode) || (OP_ARITH == instructions[addr].opcode))
       bifusage[instructions[addr].arg0].usage += tsk->stats.usage[addr];
+    else if (OP_JCMP == instructions[addr].opcode)
+      bifusage[instructions[addr].arg1].usage += tsk->stats.usage[addr];
+  }
 
   qsort(bifusage,NUM_BUILTINS,sizeof(usage_info),usage_info_compar);
 
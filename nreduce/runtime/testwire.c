@@ -0,0 +1,263 @@
+/*
+ * This file is part of the NReduce project
+ * Copyright (C) 2006-2010 Peter Kelly <kellypmk@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * $Id$
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "src/nreduce.h"
+#include "runtime.h"
+#include "messages.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* Microbenchmark for the encoding of graph data sent between tasks. Each case builds an object
+   in a sending task, then repeatedly serialises it as a RESPOND or SCHEDULE would, and decodes
+   the result in a separate receiving task. Reports the message size and the average time taken
+   to encode and decode it.
+
+   The list and string cases are sent with prefetching enabled and a budget large enough for the
+   whole object, so that every cell goes in the one message, as in a RESPOND. */
+
+#define WIREBENCH_BYTES (64*MB)
+
+#define WIREBENCH_CHUNK 4096
+
+extern int opt_buildarray;
+extern int opt_prefetch;
+extern int opt_prefetchbytes;
+
+typedef pntr (*wirebench_build)(task *tsk, int n);
+
+static pntr build_cons(task *tsk, int n)
+{
+  cell *c = alloc_cell(tsk);
+  pntr p;
+  c->type = CELL_CONS;
+  set_pntrdouble(c->field1,(double)n);
+  c->field2 = tsk->globnilpntr;
+  make_pntr(p,c);
+  return p;
+}
+
+static pntr build_list(task *tsk, int n)
+{
+  pntr p = tsk->globnilpntr;
+  pntr head;
+  int i;
+  for (i = n-1; i >= 0; i--) {
+    set_pntrdouble(head,(double)i);
+    p = mkcons(tsk,head,p);
+  }
+  return p;
+}
+
+/* Strings read from a file or socket consist of one byte array per chunk of input */
+static pntr build_string(task *tsk, int n)
+{
+  char data[WIREBENCH_CHUNK];
+  pntr p = tsk->globnilpntr;
+  int start;
+  int i;
+  for (i = 0; i < WIREBENCH_CHUNK; i++)
+    data[i] = 'a'+(i%26);
+  for (start = ((n-1)/WIREBENCH_CHUNK)*WIREBENCH_CHUNK; start >= 0; start -= WIREBENCH_CHUNK) {
+    int len = (n-start < WIREBENCH_CHUNK) ? n-start : WIREBENCH_CHUNK;
+    p = binary_data_to_list(tsk,data,len,p);
+  }
+  return p;
+}
+
+static pntr build_array(task *tsk, int n, int integers)
+{
+  pntr p = create_array(tsk,sizeof(pntr),n);
+  carray *carr = aref_array(p);
+  int i;
+  for (i = 0; i < n; i++) {
+    if (integers)
+      set_pntrdouble(((pntr*)carr->elements)[i],(double)i);
+    else
+      set_pntrdouble(((pntr*)carr->elements)[i],i+0.5);
+  }
+  carr->size = n;
+  return p;
+}
+
+static pntr build_int_array(task *tsk, int n)
+{
+  return build_array(tsk,n,1);
+}
+
+static pntr build_double_array(task *tsk, int n)
+{
+  return build_array(tsk,n,0);
+}
+
+static pntr build_byte_array(task *tsk, int n)
+{
+  pntr p = create_array(tsk,1,n);
+  carray *carr = aref_array(p);
+  int i;
+  for (i = 0; i < n; i++)
+    carr->elements[i] = 'a'+(i%26);
+  carr->size = n;
+  carr->nchars = n;
+  return p;
+}
+
+/* Caps are encoded the same way as frames (a few integers followed by references to the
+   arguments), but unlike frames do not require any bytecode to construct */
+static pntr build_cap(task *tsk, int n)
+{
+  cap *cp = cap_alloc(tsk,n+1,0,0,n);
+  cell *capcell = alloc_cell(tsk);
+  pntr p;
+  int i;
+  capcell->type = CELL_CAP;
+  make_pntr(capcell->field1,cp);
+  cp->c = capcell;
+  cp->sl.fileno = -1;
+  cp->sl.lineno = -1;
+  cp->count = n;
+  for (i = 0; i < n; i++)
+    set_pntrdouble(cp->data[i],(double)i);
+  make_pntr(p,capcell);
+  return p;
+}
+
+static void wirebench_case(node *n, const char *name, wirebench_build build, int size)
+{
+  socketid out_sockid;
+  task *sender;
+  task *receiver;
+  array *args = array_new(sizeof(char*),0);
+  array *wr = NULL;
+  struct timeval start;
+  struct timeval end;
+  double encodens;
+  double decodens;
+  pntr p;
+  int iterations;
+  int i;
+
+  memset(&out_sockid,0,sizeof(out_sockid));
+  sender = task_new(0,0,NULL,0,args,n,out_sockid,NULL,0);
+  receiver = task_new(1,0,NULL,0,args,n,out_sockid,NULL,0);
+  p = build(sender,size);
+
+  /* Limit the number of iterations so the receiver's heap doesn't get too large; there is no
+     garbage collection during the test */
+  iterations = WIREBENCH_BYTES/(size*sizeof(pntr)+1024);
+  if (1000 < iterations)
+    iterations = 1000;
+
+  /* Sending a list converts runs of CONS cells into arrays, and merges string chunks, so encode
+     the object once before timing to get it into the form in which it is normally sent */
+  wr = write_start();
+  write_prefetch(wr,sender,p);
+  list_free(sender->inflight,free);
+  sender->inflight = NULL;
+  write_end(wr);
+
+  gettimeofday(&start,NULL);
+  for (i = 0; i < iterations; i++) {
+    wr = write_start();
+    write_prefetch(wr,sender,p);
+    list_free(sender->inflight,free);
+    sender->inflight = NULL;
+    if (i+1 < iterations)
+      write_end(wr);
+  }
+  gettimeofday(&end,NULL);
+  encodens = timeval_diff(start,end).tv_sec*1000000000.0+timeval_diff(start,end).tv_usec*1000.0;
+  encodens /= iterations;
+
+  gettimeofday(&start,NULL);
+  for (i = 0; i < iterations; i++) {
+    reader rd = read_start(receiver,wr->data,wr->nbytes);
+    pntr got;
+    read_pntr(&rd,&got);
+    read_end(&rd);
+  }
+  gettimeofday(&end,NULL);
+  decodens = timeval_diff(start,end).tv_sec*1000000000.0+timeval_diff(start,end).tv_usec*1000.0;
+  decodens /= iterations;
+
+  printf("%-14s %8d %10d %12.0f %12.0f\n",name,size,wr->nbytes,encodens,decodens);
+
+  write_end(wr);
+  task_free(sender);
+  task_free(receiver);
+  array_free(args);
+}
+
+void run_wirebench(void)
+{
+  node *n = node_start(LOG_ERROR,0);
+  int saved_buildarray = opt_buildarray;
+  int saved_prefetch = opt_prefetch;
+  int saved_prefetchbytes = opt_prefetchbytes;
+  int sizes[3] = { 16, 1024, 65536 };
+  int bigsizes[3] = { 1024, 65536, 1048576 };
+  int i;
+
+  if (NULL == n)
+    exit(1);
+
+  /* Large arrays would otherwise be sent as buildarray frames, which require bytecode */
+  opt_buildarray = 0;
+
+  printf("Wire format version %d%s\n",WIRE_VERSION,
+#ifdef DEBUG_WIRE_TAGS
+         " (with debug tags)"
+#else
+         ""
+#endif
+         );
+  printf("%-14s %8s %10s %12s %12s\n","object","size","bytes","encode ns","decode ns");
+  wirebench_case(n,"cons",build_cons,1);
+  for (i = 0; i < 3; i++)
+    wirebench_case(n,"array-int",build_int_array,sizes[i]);
+  for (i = 0; i < 3; i++)
+    wirebench_case(n,"array-double",build_double_array,sizes[i]);
+  for (i = 0; i < 3; i++)
+    wirebench_case(n,"array-byte",build_byte_array,sizes[i]);
+  wirebench_case(n,"cap",build_cap,4);
+  wirebench_case(n,"cap",build_cap,64);
+
+  opt_prefetch = bigsizes[2];
+  opt_prefetchbytes = WIREBENCH_BYTES;
+  for (i = 0; i < 3; i++)
+    wirebench_case(n,"list",build_list,bigsizes[i]);
+  for (i = 0; i < 3; i++)
+    wirebench_case(n,"string",build_string,bigsizes[i]);
+
+  opt_buildarray = saved_buildarray;
+  opt_prefetch = saved_prefetch;
+  opt_prefetchbytes = saved_prefetchbytes;
+  node_shutdown(n);
+  node_run(n);
+}
@@ -70,7 +70,7 @@ snode *graph_to_syntax_r(source *src, p2sdata *d, pntr p)
     c = get_pntr(p);
     s = snode_new(-1,-1);
     s->type = SNODE_BUILTIN;
-    s->bif = (int)get_pntr(c->field1);
+    s->bif = (long)get_pntr(c->field1);
     return s;
   case CELL_SCREF:
     c = get_pntr(p);
@@ -153,7 +153,7 @@ static void dot_graph_r(FILE *f, pntr p, pntrset *done, int doind, dotfun fun, p
     dot_edge(f,p,c->field1,doind,NULL);
     break;
   case CELL_BUILTIN:
-    fprintf(f,"%s\"];\n",builtin_info[(int)get_pntr(c->field1)].name);
+    fprintf(f,"%s\"];\n",builtin_info[(long)get_pntr(c->field1)].name);
     break;
   case CELL_SCREF:
     fprintf(f,"%s\"];\n",((scomb*)get_pntr(c->field1))->name);
@@ -63,6 +63,7 @@ static node *worker_startup(int loglevel, int port)
              getpid(),ipbytes[0],ipbytes[1],ipbytes[2],ipbytes[3],n->listenport);
     start_manager(n);
     node_add_thread2(n,"java",java_thread,NULL,NULL,JAVA_ID,0);
+    start_fileio(n);
   }
   return n;
 }
@@ -54,8 +54,17 @@ extern int opt_fishframes;
 extern int opt_fishhalf;
 extern int opt_buildarray;
 extern int opt_maxheap;
-
-char *exec_modes[3] = { "interpreter", "native", "reducer" };
+extern int opt_gcthreads;
+extern int opt_deferpause;
+extern int opt_nursery;
+extern int opt_gctarget;
+extern int opt_prefetch;
+extern int opt_prefetchbytes;
+extern int opt_distgcpause;
+extern int opt_fileiothreads;
+extern int opt_readchunksize;
+
+char *exec_modes[4] = { "interpreter", "native", "reducer", "threaded" };
 
 int max_array_size = (1 << 18);
 
@@ -75,6 +84,7 @@ struct arguments {
   char *initial;
   char *client;
   int chordtest;
+  int wirebench;
   array *extra;
   char *evaluation;
 };
@@ -94,14 +104,15 @@ static void usage()
 "  -t, --trace DIR          Reduction engine: Print trace data to stdout and DIR\n"
 "  -T, --Trace DIR          Same as -t but uses \"landscape\" mode\n"
 "  -e, --engine ENGINE      Use execution engine:\n"
-"                           (r)educer|(i)nterpreter|(n)ative\n"
-"                           (default: interpreter)\n"
+"                           (r)educer|(i)nterpreter|(n)ative|(t)hreaded\n"
+"                           (default: "DEFAULT_ENGINE_NAME")\n"
 "  -v, --evaluation MODE    Use strict or lazy evaluation mode\n"
 "  -w, --worker             Run as worker\n"
 "  -p, --port PORT          Worker mode: listen on the specified port\n"
 "  -i, --initial HOST:PORT  Worker/client mode: initial node to connect to\n"
 "  --client NODESFILE CMD   Run program CMD on nodes read from NODESFILE\n"
 "  --chordtest NODESFILE    Test chord implementation ('' for single-host test)\n"
+"  --wirebench              Measure size and speed of the message encoding\n"
 "\n"
 "Options for printing output of compilation stages:\n"
 "(these do not actually run the program)\n"
@@ -111,7 +122,11 @@ static void usage()
 "  -l, --lambdadebug        Print results of lambda lifting\n"
 "  -o, --reorder-debug      Print results of letrec reordering\n"
 "      --appopt-debug       Print results of append optimisation\n"
-"  -r, --strictness-debug   Print supercombinators strictness information\n");
+"  -r, --strictness-debug   Print supercombinators strictness information\n"
+"\n"
+"Environment variables:\n"
+"\n"
+"  BYTECODE_CACHE=DIR       Cache compiled bytecode in DIR (default: no caching)\n");
   exit(1);
 }
 
@@ -121,11 +136,24 @@ void set_engine(const char *str)
     engine_type = ENGINE_INTERPRETER;
   }
   else if (!strcmp(str,"n") || !strcmp(str,"native")) {
+#ifdef NATIVE_SUPPORTED
     engine_type = ENGINE_NATIVE;
+#else
+    fprintf(stderr,"The native engine is only available in 32-bit x86 builds "
+            "(configure with --enable-m32)\n");
+    exit(1);
+#endif
   }
   else if (!strcmp(str,"r") || !strcmp(str,"reducer")) {
     engine_type = ENGINE_REDUCER;
   }
+  else if (!strcmp(str,"t") || !strcmp(str,"threaded")) {
+#ifdef THREADED_DISPATCH
+    engine_type = ENGINE_THREADED;
+#else
+    engine_type = ENGINE_INTERPRETER;
+#endif
+  }
   else {
     fprintf(stderr,"Invalid execution engine: %s\n",str);
     exit(1);
@@ -206,6 +234,9 @@ void parse_args(int argc, char **argv)
     else if (!strcmp(argv[i],"--chordtest")) {
       args.chordtest = 1;
     }
+    else if (!strcmp(argv[i],"--wirebench")) {
+      args.wirebench = 1;
+    }
     else {
       array_append(args.extra,&argv[i],sizeof(char*));
     }
@@ -329,6 +360,48 @@ void parse_optimisations()
   char *maxheap = getenv("OPT_MAXHEAP");
   if (NULL != maxheap)
     opt_maxheap = atoi(maxheap)*1024*1024;
+
+  char *gcthreads = getenv("OPT_GCTHREADS");
+  if (NULL != gcthreads)
+    opt_gcthreads = atoi(gcthreads);
+
+  char *deferpause = getenv("OPT_DEFERPAUSE");
+  if (NULL != deferpause)
+    opt_deferpause = atoi(deferpause);
+
+  char *nursery = getenv("OPT_NURSERY");
+  if (NULL != nursery)
+    opt_nursery = atoi(nursery)*1024*1024;
+
+  char *gctarget = getenv("OPT_GCTARGET");
+  if (NULL != gctarget)
+    opt_gctarget = atoi(gctarget);
+
+  char *prefetch = getenv("OPT_PREFETCH");
+  if (NULL != prefetch)
+    opt_prefetch = atoi(prefetch);
+
+  char *prefetchbytes = getenv("OPT_PREFETCHBYTES");
+  if (NULL != prefetchbytes)
+    opt_prefetchbytes = atoi(prefetchbytes)*1024;
+
+  char *distgcpause = getenv("OPT_DISTGCPAUSE");
+  if (NULL != distgcpause) {
+    opt_distgcpause = atoi(distgcpause);
+    if ((DISTGC_PAUSE_NONE > opt_distgcpause) || (DISTGC_PAUSE_ALL < opt_distgcpause)) {
+      fprintf(stderr,"Invalid OPT_DISTGCPAUSE value: %s (must be %d, %d or %d)\n",distgcpause,
+              DISTGC_PAUSE_NONE,DISTGC_PAUSE_MARK,DISTGC_PAUSE_ALL);
+      exit(1);
+    }
+  }
+
+  char *fileiothreads = getenv("OPT_FILEIOTHREADS");
+  if (NULL != fileiothreads)
+    opt_fileiothreads = atoi(fileiothreads);
+
+  char *readchunksize = getenv("OPT_READCHUNKSIZE");
+  if ((NULL != readchunksize) && (0 < atoi(readchunksize)))
+    opt_readchunksize = atoi(readchunksize)*1024;
 }
 
 int main(int argc, char **argv)
@@ -353,11 +426,11 @@ int main(int argc, char **argv)
   }
 
   assert(0 == sizeof(frame)%8);
-  assert(0 == ((int)&((frameblock*)0)->mem)%8);
+  assert(0 == offsetof(frameblock,mem)%8);
   assert(0 == sizeof(cell)%8);
   assert(0 == BLOCK_START%8);
   assert(0 == BLOCK_END%8);
-  assert(0 == ((int)&((carray*)0)->elements)%8);
+  assert(0 == offsetof(carray,elements)%8);
   assert(sizeof(block) == BLOCK_END);
   assert(MAX_ARRAY_SIZE*8 <= (BLOCK_END-BLOCK_START));
 
@@ -378,6 +451,7 @@ int main(int argc, char **argv)
 
   init_evaluation();
 
+#ifdef NATIVE_SUPPORTED
   if (ENGINE_NATIVE == engine_type) {
     struct sigaction act;
     sigemptyset(&act.sa_mask);
@@ -394,7 +468,9 @@ int main(int argc, char **argv)
     act.sa_sigaction = native_sigsegv;
     sigaction(SIGSEGV,&act,NULL);
   }
-  else if (ENGINE_INTERPRETER == engine_type) {
+  else
+#endif
+  if ((ENGINE_INTERPRETER == engine_type) || (ENGINE_THREADED == engine_type)) {
     struct sigaction act;
     sigemptyset(&act.sa_mask);
     act.sa_flags = SA_SIGINFO;
@@ -410,6 +486,11 @@ int main(int argc, char **argv)
   if (args.chordtest)
     return chordtest_mode();
 
+  if (args.wirebench) {
+    run_wirebench();
+    return 0;
+  }
+
   if (args.client)
     return client_mode();
 
@@ -421,6 +502,19 @@ int main(int argc, char **argv)
   args.filename = array_item(args.extra,0,char*);
   array_remove_items(args.extra,1);
 
+  /* When just running the program, use the bytecode cache to avoid compiling it again */
+  if ((ENGINE_REDUCER != engine_type) && !compileinfo && !args.strictdebug && !args.bytecode &&
+      !args.reorderdebug && !args.lambdadebug && !args.appendoptdebug) {
+    if (0 != source_compile_file_cached(args.filename,args.nosink,&bcdata,&bcsize))
+      return -1;
+
+    debug_stage("Execution");
+    r = standalone(bcdata,bcsize,array_count(args.extra),(const char**)args.extra->data);
+    free(bcdata);
+    array_free(args.extra);
+    return r;
+  }
+
   src = source_new();
 
 /*   debug_stage("Source code parsing"); */
@@ -46,6 +46,7 @@
 /* #define PROFILING */
 /* #define CONTINUOUS_DISTGC */
 /* #define DISABLE_ARRAYS */
+/* #define DEBUG_WIRE_TAGS */
 
 // Misc
 
@@ -56,15 +57,19 @@
 #define GLOBAL_HASH_SIZE 4096
 #define PROFILE_FILENAME "profile.out"
 #define MAX_LOCAL_CONNECTIONS 3
-#define MAX_TOTAL_CONNECTIONS 128
+/* Outgoing service connections a task may have open at once; with the epoll I/O thread, the
+   practical limit is the process's file descriptor limit, which the node raises on startup */
+#define MAX_TOTAL_CONNECTIONS 100000
 /* #define DISABLE_SPARKS */
 
 #define FLAG_MARKED         0x1
 #define FLAG_NEW            0x2
 #define FLAG_DMB            0x4
+#define FLAG_PINNED         0x8
 #define FLAG_REDUCED       0x10
 #define FLAG_MATURE        0x20
 #define FLAG_INRSET        0x40
 #define FLAG_ALTSPACE      0x80
+#define FLAG_PREFETCHED   0x100
 
 #endif /* _NREDUCE_H */
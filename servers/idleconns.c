@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Opens a large number of idle connections to a server, and periodically sends a line over a
+   randomly chosen one, timing how long it takes to be echoed back. Used to check that the cost
+   of servicing an active connection does not grow with the number of idle ones. If a process id
+   is given, the CPU time consumed by that process during each interval is reported as well. */
+
+#define PING_INTERVAL_US 100000
+#define REPORT_INTERVAL_S 1
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static double process_cpu(int pid)
+{
+  char filename[100];
+  char buf[4096];
+  FILE *f;
+  char *s;
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+
+  sprintf(filename,"/proc/%d/stat",pid);
+  if (NULL == (f = fopen(filename,"r")))
+    return 0.0;
+  if (NULL == fgets(buf,sizeof(buf),f)) {
+    fclose(f);
+    return 0.0;
+  }
+  fclose(f);
+
+  /* Skip the pid and command name, which may contain spaces */
+  if (NULL == (s = strrchr(buf,')')))
+    return 0.0;
+  sscanf(s+2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",&utime,&stime);
+  return (double)(utime+stime)/sysconf(_SC_CLK_TCK);
+}
+
+static int connect_to(struct sockaddr_in *addr)
+{
+  int sock;
+  int yes = 1;
+
+  if (0 > (sock = socket(AF_INET,SOCK_STREAM,0))) {
+    perror("socket");
+    return -1;
+  }
+
+  if (0 > connect(sock,(struct sockaddr*)addr,sizeof(struct sockaddr_in))) {
+    perror("connect");
+    close(sock);
+    return -1;
+  }
+
+  if (0 > setsockopt(sock,SOL_TCP,TCP_NODELAY,&yes,sizeof(int))) {
+    perror("setsockopt TCP_NODELAY");
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+static int ping(int sock)
+{
+  char *line = "ping\n";
+  int len = strlen(line);
+  char buf[100];
+  int got = 0;
+  int r;
+
+  if (len != write(sock,line,len)) {
+    perror("write");
+    return -1;
+  }
+
+  while (got < len) {
+    r = read(sock,&buf[got],len-got);
+    if (0 > r) {
+      perror("read");
+      return -1;
+    }
+    if (0 == r) {
+      fprintf(stderr,"Connection closed by server\n");
+      return -1;
+    }
+    got += r;
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char *hostname;
+  int port;
+  int nconns;
+  int seconds;
+  int pid = 0;
+  struct hostent *he;
+  struct sockaddr_in addr;
+  struct rlimit lim;
+  int *socks;
+  int i;
+  double start;
+  double last_report;
+  double last_cpu = 0.0;
+  double total = 0.0;
+  double worst = 0.0;
+  int count = 0;
+
+  setbuf(stdout,NULL);
+
+  if (5 > argc) {
+    fprintf(stderr,"Usage: idleconns <hostname> <port> <nconns> <seconds> [pid]\n");
+    exit(1);
+  }
+
+  hostname = argv[1];
+  port = atoi(argv[2]);
+  nconns = atoi(argv[3]);
+  seconds = atoi(argv[4]);
+  if (6 <= argc)
+    pid = atoi(argv[5]);
+
+  if (1 > nconns) {
+    fprintf(stderr,"Need at least one connection\n");
+    exit(1);
+  }
+
+  if ((0 == getrlimit(RLIMIT_NOFILE,&lim)) && (lim.rlim_cur < lim.rlim_max)) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE,&lim);
+  }
+
+  if (NULL == (he = gethostbyname(hostname))) {
+    perror("gethostbyname");
+    exit(1);
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (*((struct in_addr*)he->h_addr)).s_addr;
+  memset(&addr.sin_zero,0,8);
+
+  socks = (int*)calloc(nconns,sizeof(int));
+  for (i = 0; i < nconns; i++) {
+    if (0 > (socks[i] = connect_to(&addr))) {
+      fprintf(stderr,"Only opened %d connections\n",i);
+      exit(1);
+    }
+  }
+  printf("Opened %d connections\n",nconns);
+
+  srand(time(NULL));
+  start = now();
+  last_report = start;
+  if (pid)
+    last_cpu = process_cpu(pid);
+
+  while (now() < start+seconds) {
+    double before = now();
+    double taken;
+
+    if (0 > ping(socks[rand()%nconns]))
+      exit(1);
+
+    taken = now()-before;
+    total += taken;
+    if (worst < taken)
+      worst = taken;
+    count++;
+
+    if (now() >= last_report+REPORT_INTERVAL_S) {
+      double t = now();
+      printf("%d pings: avg %.3fms max %.3fms",count,1000.0*total/count,1000.0*worst);
+      if (pid) {
+        double cpu = process_cpu(pid);
+        printf(" server cpu %.1f%%",100.0*(cpu-last_cpu)/(t-last_report));
+        last_cpu = cpu;
+      }
+      printf("\n");
+      last_report = t;
+      total = 0.0;
+      worst = 0.0;
+      count = 0;
+    }
+
+    usleep(PING_INTERVAL_US);
+  }
+
+  for (i = 0; i < nconns; i++)
+    close(socks[i]);
+  free(socks);
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Streams a given amount of data through an echo server (e.g. samples/echoserver.elc) and reads
+   it back, reporting the throughput. Writing and reading are interleaved so that the server
+   never has to buffer more than the socket buffers hold. The server's log reports how many bytes
+   were copied within its I/O threads per MB transferred. */
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+  char *hostname;
+  int port;
+  long long total;
+  int bufsize;
+  struct hostent *he;
+  struct sockaddr_in addr;
+  int sock;
+  int yes = 1;
+  char *outbuf;
+  char *inbuf;
+  long long written = 0;
+  long long got = 0;
+  double start;
+  double taken;
+  int i;
+
+  setbuf(stdout,NULL);
+
+  if (5 > argc) {
+    fprintf(stderr,"Usage: streambench <hostname> <port> <megabytes> <bufsize>\n");
+    exit(1);
+  }
+
+  hostname = argv[1];
+  port = atoi(argv[2]);
+  total = atoll(argv[3])*1024*1024;
+  bufsize = atoi(argv[4]);
+
+  if (0 >= bufsize) {
+    fprintf(stderr,"Invalid buffer size\n");
+    exit(1);
+  }
+
+  if (NULL == (he = gethostbyname(hostname))) {
+    perror("gethostbyname");
+    exit(1);
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (*((struct in_addr*)he->h_addr)).s_addr;
+  memset(&addr.sin_zero,0,8);
+
+  if (0 > (sock = socket(AF_INET,SOCK_STREAM,0))) {
+    perror("socket");
+    exit(1);
+  }
+
+  if (0 > connect(sock,(struct sockaddr*)&addr,sizeof(struct sockaddr_in))) {
+    perror("connect");
+    exit(1);
+  }
+
+  if (0 > setsockopt(sock,SOL_TCP,TCP_NODELAY,&yes,sizeof(int))) {
+    perror("setsockopt TCP_NODELAY");
+    exit(1);
+  }
+
+  if (0 > fcntl(sock,F_SETFL,fcntl(sock,F_GETFL)|O_NONBLOCK)) {
+    perror("fcntl");
+    exit(1);
+  }
+
+  outbuf = (char*)malloc(bufsize);
+  inbuf = (char*)malloc(bufsize);
+  for (i = 0; i < bufsize; i++)
+    outbuf[i] = 'a'+(i%26);
+
+  start = now();
+  while (got < total) {
+    struct pollfd pfd;
+    int r;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if (written < total)
+      pfd.events |= POLLOUT;
+    pfd.revents = 0;
+
+    if (0 > poll(&pfd,1,-1)) {
+      if (EINTR == errno)
+        continue;
+      perror("poll");
+      exit(1);
+    }
+
+    if ((pfd.revents & POLLOUT) && (written < total)) {
+      int count = bufsize;
+      if (count > total-written)
+        count = total-written;
+      r = write(sock,outbuf,count);
+      if ((0 > r) && (EAGAIN != errno)) {
+        perror("write");
+        exit(1);
+      }
+      if (0 < r) {
+        written += r;
+        if (written == total)
+          shutdown(sock,SHUT_WR);
+      }
+    }
+
+    if (pfd.revents & (POLLIN|POLLHUP|POLLERR)) {
+      r = read(sock,inbuf,bufsize);
+      if ((0 > r) && (EAGAIN != errno)) {
+        perror("read");
+        exit(1);
+      }
+      if (0 == r) {
+        fprintf(stderr,"Connection closed after %lld of %lld bytes\n",got,total);
+        exit(1);
+      }
+      if (0 < r)
+        got += r;
+    }
+  }
+  taken = now()-start;
+
+  printf("%lld bytes echoed in %.3fs: %.2f MB/s\n",got,taken,got/taken/(1024.0*1024.0));
+
+  close(sock);
+  free(outbuf);
+  free(inbuf);
+  return 0;
+}